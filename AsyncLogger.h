@@ -0,0 +1,321 @@
+#ifndef __ASYNC_LOGGER__H_
+#define __ASYNC_LOGGER__H_
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/cstdint.hpp>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <errno.h>
+#include <unistd.h>
+
+// Logging for hot threads. Log() copies the record into a buffer owned by the
+// calling thread (a single producer/single consumer ring, no locks) and
+// returns. A background thread drains every buffer and writes the records to
+// the file descriptor in large batches, so callers never wait on I/O or on
+// each other. LogLazy() records a small formatter instead of text and the
+// background thread runs it, keeping even the formatting off the hot thread.
+// When a thread's buffer is full the record is dropped and counted rather than
+// blocking; the drops are reported in the output.
+//
+//   AsyncLogger::Instance().Log("consumed\n");
+//   AsyncLogger::Instance().LogLazy([id, n](std::string& out){ out+=...; });
+//
+// The logger must outlive the threads that log to it; Instance() does.
+class AsyncLogger{
+private:
+  static const std::size_t CACHE_LINE_SIZE = 64;
+  static const std::size_t BATCH_BYTES = 64*1024; // Write once this much is pending
+
+  enum Kind{ TEXT, LAZY, PAD };
+
+  // Every record starts with a header and is padded to a multiple of 8 bytes
+  struct Header{
+    boost::uint32_t size; // Whole record including the header
+    boost::uint32_t kind;
+  };
+
+  typedef void (*FormatFunction)(const void* formatter, std::string& out);
+
+  struct LazyHeader : Header{
+    FormatFunction format; // The formatter is stored right after this
+  };
+
+  // One logging thread's ring. Threads that exit hand theirs to the next new thread.
+  struct ThreadBuffer{
+    boost::atomic<std::size_t> head; // Consumed up to, written by the logger thread
+    char pad0[CACHE_LINE_SIZE-sizeof(boost::atomic<std::size_t>)];
+    boost::atomic<std::size_t> tail; // Published up to, written by the owner
+    boost::atomic<std::size_t> dropped;
+    char pad1[CACHE_LINE_SIZE-2*sizeof(boost::atomic<std::size_t>)];
+    boost::atomic<bool> in_use;
+    std::vector<boost::uint64_t> storage; // 8 byte aligned
+    char* data;
+    std::size_t mask;
+
+    explicit ThreadBuffer(std::size_t capacity):
+      head(0), tail(0), dropped(0), in_use(false),
+      storage(capacity/sizeof(boost::uint64_t)), data((char*)&storage[0]), mask(capacity-1){}
+  };
+
+  const int m_fd;
+  const std::size_t m_buffer_bytes; // Per thread, a power of two
+  const boost::posix_time::time_duration m_flush_interval;
+
+  boost::mutex m_buffers_mutex;
+  boost::ptr_vector<ThreadBuffer> m_buffers;
+  boost::thread_specific_ptr<ThreadBuffer> m_local; // Destroyed before m_buffers
+
+  boost::mutex m_mutex;
+  boost::condition_variable m_wake; // The logger thread sleeps on this
+  boost::condition_variable m_flushed_cond;
+  boost::atomic<bool> m_sleeping;
+  boost::atomic<bool> m_stop;
+  boost::atomic<boost::uint64_t> m_flush_requested;
+  boost::uint64_t m_flushed; // Guarded by m_mutex
+
+  // Logger thread only
+  std::string m_batch;
+  std::size_t m_reported_drops;
+  boost::thread m_thread;
+
+  static std::size_t RoundUp(std::size_t n){ return (n+7)&~(std::size_t)7; }
+
+  static std::size_t NextPowerOfTwo(std::size_t n){
+    std::size_t p=256;
+    while (p<n) p<<=1;
+    return p;
+  }
+
+  // Called when a thread exits, its buffer is left for the logger thread to drain
+  static void ReleaseBuffer(ThreadBuffer* buffer){
+    buffer->in_use.store(false, boost::memory_order_release);
+  }
+
+  ThreadBuffer& LocalBuffer(){
+    ThreadBuffer* buffer=m_local.get();
+    if (buffer) return *buffer;
+
+    boost::unique_lock<boost::mutex> lock(m_buffers_mutex);
+    for (std::size_t i=0; i<m_buffers.size() && !buffer; ++i){
+      bool free=false;
+      if (m_buffers[i].in_use.compare_exchange_strong(free, true, boost::memory_order_acquire)) buffer=&m_buffers[i];
+    }
+    if (!buffer){
+      m_buffers.push_back(new ThreadBuffer(m_buffer_bytes));
+      buffer=&m_buffers.back();
+      buffer->in_use.store(true, boost::memory_order_relaxed);
+    }
+    m_local.reset(buffer);
+    return *buffer;
+  }
+
+  // Reserve size bytes (a multiple of 8) in the calling thread's buffer, padding
+  // over the end of the ring if needed. Returns 0, counting a drop, when full.
+  char* Claim(ThreadBuffer& buffer, std::size_t size, std::size_t& tail){
+    const std::size_t capacity=buffer.mask+1;
+    tail=buffer.tail.load(boost::memory_order_relaxed);
+    const std::size_t head=buffer.head.load(boost::memory_order_acquire);
+    const std::size_t offset=tail&buffer.mask;
+    const std::size_t contiguous=capacity-offset;
+    const std::size_t needed= size>contiguous ? size+contiguous : size;
+    if (capacity-(tail-head)<needed){
+      buffer.dropped.fetch_add(1, boost::memory_order_relaxed);
+      return 0;
+    }
+    if (size>contiguous){
+      Header* pad=reinterpret_cast<Header*>(buffer.data+offset);
+      pad->size=(boost::uint32_t)contiguous;
+      pad->kind=PAD;
+      tail+=contiguous;
+    }
+    return buffer.data+(tail&buffer.mask);
+  }
+
+  void Publish(ThreadBuffer& buffer, std::size_t tail){
+    buffer.tail.store(tail, boost::memory_order_release);
+    // Only bother the logger thread when it sleeps and this buffer is filling up
+    if (m_sleeping.load(boost::memory_order_relaxed)
+        && tail-buffer.head.load(boost::memory_order_relaxed)>(buffer.mask+1)/2){
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      m_wake.notify_one();
+    }
+  }
+
+  template <typename F>
+  static void Format(const void* formatter, std::string& out){
+    (*static_cast<const F*>(formatter))(out);
+  }
+
+  // Move every published record into m_batch, returns false if there were none
+  bool Drain(){
+    std::vector<ThreadBuffer*> buffers;
+    {
+      boost::unique_lock<boost::mutex> lock(m_buffers_mutex);
+      for (std::size_t i=0; i<m_buffers.size(); ++i) buffers.push_back(&m_buffers[i]);
+    }
+
+    bool found=false;
+    std::size_t dropped=0;
+    for (std::size_t i=0; i<buffers.size(); ++i){
+      ThreadBuffer& buffer=*buffers[i];
+      dropped+=buffer.dropped.load(boost::memory_order_relaxed);
+      std::size_t head=buffer.head.load(boost::memory_order_relaxed);
+      const std::size_t tail=buffer.tail.load(boost::memory_order_acquire);
+      if (head==tail) continue;
+      found=true;
+
+      while (head!=tail){
+        const Header* record=reinterpret_cast<const Header*>(buffer.data+(head&buffer.mask));
+        if (record->kind==TEXT){
+          m_batch.append(reinterpret_cast<const char*>(record+1), record->size-sizeof(Header));
+        } else if (record->kind==LAZY){
+          const LazyHeader* lazy=static_cast<const LazyHeader*>(record);
+          lazy->format(lazy+1, m_batch);
+        }
+        head+=RoundUp(record->size);
+        if (m_batch.size()>=BATCH_BYTES){
+          buffer.head.store(head, boost::memory_order_release);
+          WriteBatch();
+        }
+      }
+      buffer.head.store(head, boost::memory_order_release);
+    }
+
+    if (dropped!=m_reported_drops){
+      m_batch+="[AsyncLogger: ";
+      m_batch+=std::to_string((unsigned long long)(dropped-m_reported_drops));
+      m_batch+=" records dropped]\n";
+      m_reported_drops=dropped;
+    }
+    return found;
+  }
+
+  void WriteBatch(){
+    const char* data=m_batch.data();
+    std::size_t left=m_batch.size();
+    while (left>0){
+      const ssize_t n=::write(m_fd, data, left);
+      if (n<0 && errno==EINTR) continue;
+      if (n<=0) break; // Nowhere to report it, the records are lost
+      data+=n; left-=(std::size_t)n;
+    }
+    m_batch.clear();
+  }
+
+  void Run(){
+    while (true){
+      const boost::uint64_t requested=m_flush_requested.load(boost::memory_order_acquire);
+      const bool stopping=m_stop.load();
+      const bool found=Drain();
+      WriteBatch();
+
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      if (m_flushed!=requested){
+        m_flushed=requested;
+        m_flushed_cond.notify_all();
+      }
+      if (found) continue;
+      if (stopping) return; // A whole pass after Stop found nothing
+
+      // Nothing pending: sleep until the flush interval, a Flush() or a filling buffer
+      m_sleeping.store(true);
+      if (!m_stop.load() && m_flush_requested.load()==requested) m_wake.timed_wait(lock, m_flush_interval);
+      m_sleeping.store(false);
+    }
+  }
+
+public:
+  // Write to fd, giving each logging thread buffer_bytes of buffer. The
+  // logger thread wakes at least every flush_interval when there is output.
+  explicit AsyncLogger(int fd=1, std::size_t buffer_bytes=64*1024,
+                       const boost::posix_time::time_duration& flush_interval=boost::posix_time::milliseconds(10)):
+    m_fd(fd), m_buffer_bytes(NextPowerOfTwo(buffer_bytes)), m_flush_interval(flush_interval),
+    m_local(&AsyncLogger::ReleaseBuffer),
+    m_sleeping(false), m_stop(false), m_flush_requested(0), m_flushed(0), m_reported_drops(0){
+    m_batch.reserve(2*BATCH_BYTES);
+    m_thread=boost::thread(&AsyncLogger::Run, this);
+  }
+
+  // Writes everything logged so far, then stops the logger thread
+  ~AsyncLogger(){
+    {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      m_stop.store(true);
+      m_wake.notify_one();
+    }
+    m_thread.join();
+  }
+
+  // The process wide logger on stdout
+  static AsyncLogger& Instance(){
+    static AsyncLogger logger(1);
+    return logger;
+  }
+
+  // Queue preformatted text. Text longer than half the buffer is truncated.
+  void Log(const char* text, std::size_t len){
+    ThreadBuffer& buffer=LocalBuffer();
+    len=std::min(len, (buffer.mask+1)/2-sizeof(Header));
+    const std::size_t size=sizeof(Header)+len;
+    std::size_t tail;
+    char* record=Claim(buffer, RoundUp(size), tail);
+    if (!record) return;
+    Header* header=reinterpret_cast<Header*>(record);
+    header->size=(boost::uint32_t)size;
+    header->kind=TEXT;
+    std::memcpy(header+1, text, len);
+    Publish(buffer, tail+RoundUp(size));
+  }
+
+  void Log(const std::string& text){
+    Log(text.data(), text.size());
+  }
+
+  void Log(const char* text){
+    Log(text, std::strlen(text));
+  }
+
+  // Queue a formatter, called as formatter(std::string& out) on the logger
+  // thread to append the text. It is copied bytewise, so capture values
+  // (numbers, pointers to long lived data), not strings.
+  template <typename F>
+  void LogLazy(const F& formatter){
+    static_assert(std::is_trivially_copyable<F>::value, "LogLazy formatters must be trivially copyable");
+    static_assert(std::alignment_of<F>::value<=8, "LogLazy formatters must be at most 8 byte aligned");
+
+    ThreadBuffer& buffer=LocalBuffer();
+    const std::size_t size=RoundUp(sizeof(LazyHeader))+sizeof(F);
+    std::size_t tail;
+    char* record=Claim(buffer, RoundUp(size), tail);
+    if (!record) return;
+    LazyHeader* header=reinterpret_cast<LazyHeader*>(record);
+    header->size=(boost::uint32_t)size;
+    header->kind=LAZY;
+    header->format=&AsyncLogger::Format<F>;
+    new (header+1) F(formatter);
+    Publish(buffer, tail+RoundUp(size));
+  }
+
+  // Block until everything logged before the call has been written
+  void Flush(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    const boost::uint64_t target=m_flush_requested.fetch_add(1)+1;
+    m_wake.notify_one();
+    while (m_flushed<target) m_flushed_cond.wait(lock);
+  }
+
+  // Records dropped so far because a thread's buffer was full
+  std::size_t Dropped(){
+    boost::unique_lock<boost::mutex> lock(m_buffers_mutex);
+    std::size_t dropped=0;
+    for (std::size_t i=0; i<m_buffers.size(); ++i) dropped+=m_buffers[i].dropped.load(boost::memory_order_relaxed);
+    return dropped;
+  }
+};
+
+#endif // __ASYNC_LOGGER__H_
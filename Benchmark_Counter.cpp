@@ -0,0 +1,90 @@
+#include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/cstdint.hpp>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+
+#include "ShardedCounter.h"
+
+// Counting throughput as threads are added.
+//
+//   Benchmark_Counter [INCREMENTS_PER_THREAD] [MAX_THREADS]
+//
+// Every thread increments one shared counter in a loop: a counter under a
+// mutex, a single atomic, and ShardedCounter with per-thread and per-CPU slots.
+// Prints millions of increments per second for 1, 2, 4, ... MAX_THREADS threads
+// (default: hardware threads) and checks the totals.
+
+using namespace std;
+
+double NowSeconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+class MutexCounter{
+private:
+  boost::mutex m_mutex;
+  boost::uint64_t m_value;
+
+public:
+  MutexCounter(): m_value(0){}
+  void Add(){ boost::mutex::scoped_lock lock(m_mutex); ++m_value; }
+  boost::uint64_t Value(){ boost::mutex::scoped_lock lock(m_mutex); return m_value; }
+};
+
+class AtomicCounter{
+private:
+  boost::atomic<boost::uint64_t> m_value;
+
+public:
+  AtomicCounter(): m_value(0){}
+  void Add(){ m_value.fetch_add(1, boost::memory_order_relaxed); }
+  boost::uint64_t Value() const { return m_value.load(); }
+};
+
+// Millions of increments per second with threads threads, false if the total is off
+template <typename Counter>
+bool Run(const std::string& name, std::size_t threads, boost::uint64_t increments){
+  Counter counter;
+  boost::barrier start(threads+1);
+  boost::thread_group workers;
+  for (std::size_t t=0; t<threads; ++t){
+    workers.create_thread([&]{
+        start.wait();
+        for (boost::uint64_t i=0; i<increments; ++i) counter.Add();
+      });
+  }
+  start.wait();
+  const double t0=NowSeconds();
+  workers.join_all();
+  const double seconds=NowSeconds()-t0;
+
+  const bool ok=counter.Value()==increments*threads;
+  cout<<left<<setw(12)<<name<<right<<setw(8)<<threads<<fixed<<setprecision(1)
+      <<setw(14)<<increments*threads/seconds/1e6<<(ok ? "" : "  WRONG TOTAL")<<endl;
+  return ok;
+}
+
+int main(int argc, char* argv[]){
+  const boost::uint64_t increments=argc>1 ? boost::lexical_cast<boost::uint64_t>(argv[1]) : 10000000;
+  const std::size_t hw=std::max(1u, boost::thread::hardware_concurrency());
+  const std::size_t max_threads=argc>2 ? boost::lexical_cast<std::size_t>(argv[2]) : hw;
+
+  cout<<increments<<" increments per thread, "<<hw<<" hardware threads"<<endl;
+  cout<<left<<setw(12)<<"counter"<<right<<setw(8)<<"threads"<<setw(14)<<"M incr/s"<<endl;
+
+  bool ok=true;
+  for (std::size_t threads=1; threads<=max_threads; threads*=2){
+    ok=Run<MutexCounter>("mutex", threads, increments) && ok;
+    ok=Run<AtomicCounter>("atomic", threads, increments) && ok;
+    ok=Run<ShardedCounter<64, PerThreadSlot> >("per-thread", threads, increments) && ok;
+    ok=Run<ShardedCounter<64, PerCpuSlot> >("per-cpu", threads, increments) && ok;
+  }
+  return ok ? 0 : 1;
+}
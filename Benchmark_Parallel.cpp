@@ -0,0 +1,107 @@
+#include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/cstdint.hpp>
+#include <iostream>
+#include <iomanip>
+#include <numeric>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+
+#include "ThreadPool.h"
+#include "ParallelAlgorithms.h"
+
+// Scaling of the parallel algorithms across pool sizes.
+//
+//   Benchmark_Parallel [ELEMENTS] [MAX_THREADS]
+//
+// Runs ParallelFor, ParallelReduce, ParallelScan and ParallelSort on pools of
+// 1, 2, 4, ... MAX_THREADS workers (default: hardware threads) and prints the
+// best of 3 runs next to the sequential std:: version, with the speedup.
+
+using namespace std;
+
+double NowSeconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+// Best of a few runs of f, in ms. setup runs untimed before each.
+template <typename Setup, typename F>
+double Time(const Setup& setup, const F& f){
+  double best=1e30;
+  for (int run=0; run<3; ++run){
+    setup();
+    const double start=NowSeconds();
+    f();
+    best=std::min(best, (NowSeconds()-start)*1000);
+  }
+  return best;
+}
+
+void Row(const std::string& name, const std::string& threads, double ms, double baseline){
+  cout<<left<<setw(10)<<name<<right<<setw(8)<<threads<<fixed<<setprecision(2)
+      <<setw(12)<<ms<<setw(10)<<baseline/ms<<"x"<<endl;
+}
+
+int main(int argc, char* argv[]){
+  const std::size_t n=argc>1 ? boost::lexical_cast<std::size_t>(argv[1]) : 10000000;
+  const std::size_t hw=std::max(1u, boost::thread::hardware_concurrency());
+  const std::size_t max_threads=argc>2 ? boost::lexical_cast<std::size_t>(argv[2]) : hw;
+
+  std::vector<boost::uint64_t> input(n), data(n), output(n);
+  boost::uint64_t seed=88172645463325252ull; // xorshift64
+  for (std::size_t i=0; i<n; ++i){ seed^=seed<<13; seed^=seed>>7; seed^=seed<<17; input[i]=seed%1000000; }
+
+  const auto reset=[&]{ std::copy(input.begin(), input.end(), data.begin()); };
+  const auto nothing=[]{};
+  const auto work=[](boost::uint64_t x){ return x*x%7919+x/3; }; // A little arithmetic per element
+
+  cout<<n<<" elements, "<<hw<<" hardware threads"<<endl;
+  cout<<left<<setw(10)<<"algorithm"<<right<<setw(8)<<"threads"<<setw(12)<<"ms"<<setw(11)<<"speedup"<<endl;
+
+  // Sequential baselines
+  const double for_seq=Time(nothing, [&]{ for (std::size_t i=0; i<n; ++i) output[i]=work(input[i]); });
+  boost::uint64_t sum_seq=0;
+  const double reduce_seq=Time(nothing, [&]{ sum_seq=std::accumulate(input.begin(), input.end(), (boost::uint64_t)0); });
+  const double scan_seq=Time(nothing, [&]{ std::partial_sum(input.begin(), input.end(), output.begin()); });
+  const std::vector<boost::uint64_t> scanned(output);
+  const double sort_seq=Time(reset, [&]{ std::sort(data.begin(), data.end()); });
+  const std::vector<boost::uint64_t> sorted(data);
+
+  Row("for", "std", for_seq, for_seq);
+  Row("reduce", "std", reduce_seq, reduce_seq);
+  Row("scan", "std", scan_seq, scan_seq);
+  Row("sort", "std", sort_seq, sort_seq);
+
+  bool ok=true;
+  for (std::size_t threads=1; threads<=max_threads; threads*=2){
+    ThreadPool pool(threads);
+    const std::string t=boost::lexical_cast<std::string>(threads);
+
+    Row("for", t, Time(nothing, [&]{
+          ParallelFor(pool, 0, n, [&](std::size_t i){ output[i]=work(input[i]); });
+        }), for_seq);
+
+    boost::uint64_t sum=0;
+    Row("reduce", t, Time(nothing, [&]{
+          sum=ParallelReduce(pool, 0, n, (boost::uint64_t)0,
+                             [&](std::size_t first, std::size_t last){
+                               return std::accumulate(input.begin()+first, input.begin()+last, (boost::uint64_t)0);
+                             },
+                             [](boost::uint64_t a, boost::uint64_t b){ return a+b; });
+        }), reduce_seq);
+    ok=ok && sum==sum_seq;
+
+    Row("scan", t, Time(nothing, [&]{ ParallelScan(pool, input.begin(), input.end(), output.begin()); }), scan_seq);
+    ok=ok && output==scanned;
+
+    Row("sort", t, Time(reset, [&]{ ParallelSort(pool, data.begin(), data.end()); }), sort_seq);
+    ok=ok && data==sorted;
+  }
+
+  cout<<(ok ? "All results match the sequential versions" : "MISMATCH against the sequential versions")<<endl;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/lexical_cast.hpp>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <time.h>
+
+#include "SynchronisedQueue.h"
+#include "PrioritySynchronisedQueue.h"
+
+// Latency of urgent messages while bulk traffic saturates the queue.
+//
+//   Benchmark_PriorityQueue [SECONDS] [BULK_PRODUCERS]
+//
+// Bulk producers keep a bounded queue full, a control thread sends an urgent
+// message every 100us and one consumer drains in batches, spending a little
+// time on each message. Runs one SynchronisedQueue, where urgent messages wait
+// behind the bulk backlog, and PrioritySynchronisedQueue with strict priority,
+// strict priority with the bulk lane aging after 1ms, and weighted 1:8.
+// Prints the urgent latency percentiles, the bulk throughput and the longest
+// a bulk message took to reach the consumer, waiting for room included.
+
+using namespace std;
+
+static const std::size_t CAPACITY = 10000; // Per lane
+static const std::size_t URGENT = 0, BULK = 1;
+
+struct Message{
+  boost::uint64_t sent_ns;
+  std::size_t lane;
+};
+
+boost::uint64_t NowNs(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (boost::uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+}
+
+// SynchronisedQueue behind the lane interface: every lane goes into one FIFO
+class SingleLane{
+private:
+  SynchronisedQueue<Message> m_queue;
+
+public:
+  SingleLane(): m_queue(CAPACITY*2){}
+  bool Enqueue(std::size_t, const Message& msg){ return m_queue.Enqueue(msg); }
+  template <typename OutputIterator>
+  std::size_t DequeueBulk(OutputIterator out, std::size_t max, const boost::posix_time::time_duration& timeout){
+    return m_queue.DequeueBulk(out, max, timeout);
+  }
+  void Close(){ m_queue.Close(); }
+};
+
+typedef PrioritySynchronisedQueue<Message, 2> PriorityQueue;
+
+struct Result{
+  std::vector<boost::uint64_t> urgent; // Latencies, ns
+  boost::uint64_t bulk;
+  boost::uint64_t bulk_max_ns;
+  double seconds;
+};
+
+template <typename Queue>
+Result Run(Queue& queue, double seconds, int bulk_producers){
+  Result result;
+  result.bulk=0; result.bulk_max_ns=0; result.seconds=seconds;
+  boost::atomic<bool> stop(false);
+
+  boost::thread consumer([&]{
+      std::vector<Message> batch;
+      while (true){
+        batch.clear();
+        if (!queue.DequeueBulk(std::back_inserter(batch), 64, boost::posix_time::milliseconds(10))){
+          if (stop) break;
+          continue;
+        }
+        for (std::size_t i=0; i<batch.size(); ++i){
+          const boost::uint64_t waited=NowNs()-batch[i].sent_ns;
+          if (batch[i].lane==URGENT) result.urgent.push_back(waited);
+          else { ++result.bulk; result.bulk_max_ns=std::max(result.bulk_max_ns, waited); }
+          // The work per message
+          const boost::uint64_t until=NowNs()+500;
+          while (NowNs()<until);
+        }
+      }
+    });
+
+  boost::thread_group producers;
+  for (int p=0; p<bulk_producers; ++p){
+    producers.create_thread([&]{
+        while (!stop){
+          Message msg={NowNs(), BULK};
+          if (!queue.Enqueue(BULK, msg)) return;
+        }
+      });
+  }
+  producers.create_thread([&]{
+      while (!stop){
+        boost::this_thread::sleep(boost::posix_time::microseconds(100));
+        Message msg={NowNs(), URGENT};
+        if (!queue.Enqueue(URGENT, msg)) return;
+      }
+    });
+
+  boost::this_thread::sleep(boost::posix_time::milliseconds((long)(seconds*1000)));
+  stop=true;
+  queue.Close();
+  producers.join_all();
+  consumer.join();
+  return result;
+}
+
+void Report(const std::string& name, Result& r){
+  std::vector<boost::uint64_t>& u=r.urgent;
+  std::sort(u.begin(), u.end());
+  const double us=1000.0;
+  cout<<left<<setw(20)<<name<<right<<fixed<<setprecision(1);
+  if (u.empty()) cout<<setw(10)<<"-"<<setw(10)<<"-"<<setw(10)<<"-";
+  else cout<<setw(10)<<u[u.size()/2]/us<<setw(10)<<u[u.size()*99/100]/us<<setw(10)<<u.back()/us;
+  cout<<setw(12)<<(r.bulk/r.seconds/1000)<<setw(14)<<r.bulk_max_ns/us<<endl;
+}
+
+int main(int argc, char* argv[]){
+  const double seconds=argc>1 ? boost::lexical_cast<double>(argv[1]) : 2;
+  const int bulk_producers=argc>2 ? boost::lexical_cast<int>(argv[2]) : 2;
+
+  cout<<left<<setw(20)<<"queue"<<right<<setw(10)<<"p50 us"<<setw(10)<<"p99 us"<<setw(10)<<"max us"
+      <<setw(12)<<"bulk k/s"<<setw(14)<<"bulk max us"<<endl;
+  {
+    SingleLane queue;
+    Result r=Run(queue, seconds, bulk_producers);
+    Report("single FIFO", r);
+  }
+  {
+    PriorityQueue queue(StrictPriority);
+    queue.SetLane(URGENT, CAPACITY);
+    queue.SetLane(BULK, CAPACITY);
+    Result r=Run(queue, seconds, bulk_producers);
+    Report("strict", r);
+  }
+  {
+    PriorityQueue queue(StrictPriority);
+    queue.SetLane(URGENT, CAPACITY);
+    queue.SetLane(BULK, CAPACITY, BlockWhenFull, 1, boost::posix_time::milliseconds(1));
+    Result r=Run(queue, seconds, bulk_producers);
+    Report("strict, aging 1ms", r);
+    cout<<"  "<<queue.Promoted()<<" bulk messages promoted"<<endl;
+  }
+  {
+    PriorityQueue queue(WeightedPriority);
+    queue.SetLane(URGENT, CAPACITY, BlockWhenFull, 1);
+    queue.SetLane(BULK, CAPACITY, BlockWhenFull, 8);
+    Result r=Run(queue, seconds, bulk_producers);
+    Report("weighted 1:8", r);
+  }
+  return 0;
+}
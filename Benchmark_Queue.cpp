@@ -0,0 +1,258 @@
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/lexical_cast.hpp>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "SynchronisedQueue.h"
+#include "MPMCQueue.h"
+#include "ThreadPlacement.h"
+
+// Non-interactive producer/consumer throughput benchmark.
+//
+//   Benchmark_Queue [--queue sync|mpmc|all] [--producers N] [--consumers N]
+//                   [--payload BYTES] [--capacity N] [--duration SECONDS] [--sweep]
+//                   [--placement none|compact|scatter]
+//
+// Producers enqueue timestamped messages as fast as they can for the given
+// duration, consumers dequeue them. Each run reports messages/sec, the
+// enqueue-to-dequeue latency percentiles and how busy the CPUs were. With
+// --sweep every power of two up to --producers x --consumers is run.
+// --placement (default THREAD_PLACEMENT) pins consumer i and producer i next to
+// each other and puts the queue storage on the NUMA node of the first one.
+
+using namespace std;
+
+struct Config{
+  std::string queue;
+  int producers;
+  int consumers;
+  std::size_t payload;
+  std::size_t capacity;
+  double duration;
+  bool sweep;
+  ThreadPlacement placement;
+};
+
+struct Result{
+  double seconds;
+  boost::uint64_t messages;
+  double cpu_percent; // Of all hardware threads
+  double cpu_ns_per_message;
+  std::vector<boost::uint32_t> latencies; // Sampled, ns
+};
+
+struct Message{
+  boost::uint64_t sent_ns;
+  std::string payload;
+};
+
+static const boost::uint64_t SAMPLE_EVERY = 16; // Latency sampled every Nth message
+
+boost::uint64_t NowNs(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (boost::uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+}
+
+double CpuSeconds(){
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+    + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec)/1e6;
+}
+
+template <typename Queue>
+class Producer{
+private:
+  Queue* m_queue;
+  std::size_t m_payload;
+  boost::atomic<bool>* m_stop;
+
+public:
+  Producer(Queue* queue, std::size_t payload, boost::atomic<bool>* stop):
+    m_queue(queue), m_payload(payload), m_stop(stop){}
+
+  void operator () (){
+    while (!m_stop->load(boost::memory_order_relaxed)){
+      // Reuse a consumed message so the benchmark measures the queue, not malloc
+      Message msg=m_queue->AcquireBuffer();
+      msg.payload.assign(m_payload, 'x');
+      msg.sent_ns=NowNs();
+      if (!m_queue->Enqueue(std::move(msg))) return; // Queue closed
+    }
+  }
+};
+
+template <typename Queue>
+class Consumer{
+private:
+  Queue* m_queue;
+  boost::uint64_t* m_count;
+  std::vector<boost::uint32_t>* m_latencies;
+
+public:
+  Consumer(Queue* queue, boost::uint64_t* count, std::vector<boost::uint32_t>* latencies):
+    m_queue(queue), m_count(count), m_latencies(latencies){}
+
+  void operator () (){
+    Message msg;
+    boost::uint64_t n=0;
+    while (m_queue->Dequeue(msg)){
+      if (++n%SAMPLE_EVERY==0){
+        const boost::uint64_t latency=NowNs()-msg.sent_ns;
+        m_latencies->push_back((boost::uint32_t)std::min<boost::uint64_t>(latency, 0xffffffffu));
+      }
+      m_queue->RecycleBuffer(std::move(msg));
+    }
+    *m_count=n;
+  }
+};
+
+template <typename Queue>
+Result Run(Queue& queue, const Config& config, int producers, int consumers){
+  queue.EnableBufferPool(config.capacity);
+
+  boost::atomic<bool> stop(false);
+  std::vector<boost::uint64_t> counts(consumers, 0);
+  std::vector<std::vector<boost::uint32_t> > latencies(consumers);
+  for (int i=0; i<consumers; ++i) latencies[i].reserve(1<<16);
+
+  const double cpu_start=CpuSeconds();
+  const boost::uint64_t start=NowNs();
+
+  boost::thread_group threads;
+  const ThreadPlacement& placement=config.placement;
+  for (int i=0; i<consumers; ++i){
+    Consumer<Queue> consumer(&queue, &counts[i], &latencies[i]);
+    threads.create_thread([&placement, i, consumer]() mutable { placement.Pin(2*i); consumer(); });
+  }
+  for (int i=0; i<producers; ++i){
+    Producer<Queue> producer(&queue, config.payload, &stop);
+    threads.create_thread([&placement, i, producer]() mutable { placement.Pin(2*i+1); producer(); });
+  }
+
+  boost::this_thread::sleep(boost::posix_time::microseconds((boost::int64_t)(config.duration*1e6)));
+
+  // Stop producers, consumers drain what is left and stop
+  stop.store(true);
+  queue.Close();
+  threads.join_all();
+
+  Result result;
+  result.seconds=(NowNs()-start)/1e9;
+  result.messages=0;
+  for (int i=0; i<consumers; ++i){
+    result.messages+=counts[i];
+    result.latencies.insert(result.latencies.end(), latencies[i].begin(), latencies[i].end());
+  }
+  const double cpu=CpuSeconds()-cpu_start;
+  const unsigned cpus=std::max(1u, boost::thread::hardware_concurrency());
+  result.cpu_percent=100.0*cpu/(result.seconds*cpus);
+  result.cpu_ns_per_message=result.messages ? cpu*1e9/result.messages : 0;
+  std::sort(result.latencies.begin(), result.latencies.end());
+  return result;
+}
+
+// p-th percentile (0..100) of sorted samples
+double Percentile(const std::vector<boost::uint32_t>& sorted, double p){
+  if (sorted.empty()) return 0;
+  return sorted[(std::size_t)(p/100.0*(sorted.size()-1))];
+}
+
+void PrintHeader(){
+  cout<<left<<setw(6)<<"queue"<<right<<setw(5)<<"prod"<<setw(5)<<"cons"
+      <<setw(14)<<"msgs/sec"<<setw(10)<<"p50 ns"<<setw(10)<<"p99 ns"<<setw(12)<<"p999 ns"<<setw(12)<<"max ns"
+      <<setw(8)<<"cpu %"<<setw(12)<<"cpu ns/msg"<<endl;
+}
+
+void PrintResult(const std::string& queue, int producers, int consumers, const Result& r){
+  cout<<left<<setw(6)<<queue<<right<<setw(5)<<producers<<setw(5)<<consumers
+      <<fixed<<setprecision(0)
+      <<setw(14)<<r.messages/r.seconds
+      <<setw(10)<<Percentile(r.latencies, 50)<<setw(10)<<Percentile(r.latencies, 99)
+      <<setw(12)<<Percentile(r.latencies, 99.9)<<setw(12)<<Percentile(r.latencies, 100)
+      <<setprecision(1)<<setw(8)<<r.cpu_percent<<setprecision(0)<<setw(12)<<r.cpu_ns_per_message<<endl;
+}
+
+void RunOne(const Config& config, const std::string& queue, int producers, int consumers){
+  const NumaAllocator<Message> alloc(config.placement.NodeFor(0));
+  Result r;
+  if (queue=="mpmc"){
+    MPMCQueue<Message, NumaAllocator<Message> > q(config.capacity, alloc);
+    r=Run(q, config, producers, consumers);
+  } else {
+    SynchronisedQueue<Message, NumaAllocator<Message> > q(config.capacity, BlockWhenFull, alloc);
+    r=Run(q, config, producers, consumers);
+  }
+  PrintResult(queue, producers, consumers, r);
+}
+
+int Usage(const char* name){
+  cerr<<"Usage: "<<name<<" [--queue sync|mpmc|all] [--producers N] [--consumers N]"
+      <<" [--payload BYTES] [--capacity N] [--duration SECONDS] [--sweep]"
+      <<" [--placement none|compact|scatter]"<<endl;
+  return 1;
+}
+
+int main(int argc, char* argv[]){
+  Config config;
+  config.queue="all";
+  config.producers=1;
+  config.consumers=1;
+  config.payload=64;
+  config.capacity=1024;
+  config.duration=2.0;
+  config.sweep=false;
+  config.placement=ThreadPlacement::FromEnvironment();
+
+  try {
+    for (int i=1; i<argc; ++i){
+      const std::string arg=argv[i];
+      if (arg=="--sweep"){ config.sweep=true; continue; }
+      if (i+1>=argc) return Usage(argv[0]);
+      const char* value=argv[++i];
+      if (arg=="--queue") config.queue=value;
+      else if (arg=="--producers") config.producers=boost::lexical_cast<int>(value);
+      else if (arg=="--consumers") config.consumers=boost::lexical_cast<int>(value);
+      else if (arg=="--payload") config.payload=boost::lexical_cast<std::size_t>(value);
+      else if (arg=="--capacity") config.capacity=boost::lexical_cast<std::size_t>(value);
+      else if (arg=="--duration") config.duration=boost::lexical_cast<double>(value);
+      else if (arg=="--placement"){
+        PlacementPolicy policy;
+        if (!ThreadPlacement::ParsePolicy(value, policy)) return Usage(argv[0]);
+        config.placement=ThreadPlacement(policy);
+      }
+      else return Usage(argv[0]);
+    }
+  } catch (const boost::bad_lexical_cast&){
+    return Usage(argv[0]);
+  }
+  if (config.queue!="sync" && config.queue!="mpmc" && config.queue!="all") return Usage(argv[0]);
+  if (config.producers<1 || config.consumers<1 || config.capacity<1) return Usage(argv[0]);
+
+  std::vector<std::string> queues;
+  if (config.queue!="mpmc") queues.push_back("sync");
+  if (config.queue!="sync") queues.push_back("mpmc");
+
+  cout<<boost::thread::hardware_concurrency()<<" hardware threads, payload "<<config.payload
+      <<" bytes, capacity "<<config.capacity<<", "<<config.duration<<" s per run, placement "
+      <<(config.placement.Policy()==PlaceCompact ? "compact" : config.placement.Policy()==PlaceScatter ? "scatter" : "none")<<endl;
+  PrintHeader();
+
+  for (std::size_t q=0; q<queues.size(); ++q){
+    if (!config.sweep){
+      RunOne(config, queues[q], config.producers, config.consumers);
+      continue;
+    }
+    for (int p=1; p<=config.producers; p*=2)
+      for (int c=1; c<=config.consumers; c*=2)
+        RunOne(config, queues[q], p, c);
+  }
+  return 0;
+}
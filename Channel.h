@@ -0,0 +1,180 @@
+#ifndef __CHANNEL__H_
+#define __CHANNEL__H_
+
+// Needs -std=c++20
+#include <coroutine>
+#include <deque>
+#include <algorithm>
+#include <utility>
+#include <boost/thread.hpp>
+#include <boost/circular_buffer.hpp>
+#include <boost/optional.hpp>
+
+#include "CoroutineScheduler.h"
+
+// SynchronisedQueue for coroutines. Instead of blocking a thread, Push() and
+// Pop() suspend the calling coroutine when the channel is full/empty, and the
+// coroutine that makes progress possible hands the item over directly and
+// queues the waiter on the scheduler.
+// Unbounded by default; with a capacity producers wait for room. Close()
+// resumes every waiter: pushes are refused from then on, consumers drain what
+// is left and then get an empty optional.
+//
+//   if (!co_await channel.Push(std::move(msg))) co_return; // Closed
+//   while (boost::optional<Message> msg=co_await channel.Pop()) ...
+template <typename T>
+class Channel{
+private:
+  struct PushAwaiter;
+  struct PopAwaiter;
+
+  CoroutineScheduler& m_scheduler;
+  const std::size_t m_capacity; // 0 for unbounded
+  bool m_closed;
+  boost::circular_buffer<T> m_items; // Only grows
+  std::deque<PopAwaiter*> m_consumers; // Suspended in Pop(), only while m_items is empty
+  std::deque<PushAwaiter*> m_producers; // Suspended in Push(), only while full
+  boost::mutex m_mutex;
+
+  bool Full() const { return m_capacity && m_items.size()>=m_capacity; }
+
+  void Store(T&& item){
+    if (m_items.full()) m_items.set_capacity(std::max<std::size_t>(16, m_items.capacity()*2));
+    m_items.push_back(std::move(item));
+  }
+
+  struct PushAwaiter{
+    Channel* channel;
+    T item;
+    bool ok;
+    std::coroutine_handle<> handle;
+
+    bool await_ready(){ return false; }
+
+    // Returns false to carry on without suspending
+    bool await_suspend(std::coroutine_handle<> h){
+      handle=h;
+      PopAwaiter* consumer=0;
+      {
+        boost::unique_lock<boost::mutex> lock(channel->m_mutex);
+        if (channel->m_closed){ ok=false; return false; }
+        if (!channel->m_consumers.empty()){
+          // A consumer is waiting, so nothing is queued: hand the item to it
+          consumer=channel->m_consumers.front();
+          channel->m_consumers.pop_front();
+          consumer->item=std::move(item);
+        } else if (!channel->Full()){
+          channel->Store(std::move(item));
+        } else {
+          channel->m_producers.push_back(this);
+          return true;
+        }
+      }
+      ok=true;
+      if (consumer) channel->m_scheduler.Resume(consumer->handle);
+      return false;
+    }
+
+    bool await_resume(){ return ok; }
+  };
+
+  struct PopAwaiter{
+    Channel* channel;
+    boost::optional<T> item;
+    std::coroutine_handle<> handle;
+
+    bool await_ready(){ return false; }
+
+    bool await_suspend(std::coroutine_handle<> h){
+      handle=h;
+      PushAwaiter* producer=0;
+      {
+        boost::unique_lock<boost::mutex> lock(channel->m_mutex);
+        if (!channel->m_items.empty()){
+          item=std::move(channel->m_items.front());
+          channel->m_items.pop_front();
+          // Room now: take the item of a waiting producer
+          if (!channel->m_producers.empty()){
+            producer=channel->m_producers.front();
+            channel->m_producers.pop_front();
+            channel->Store(std::move(producer->item));
+            producer->ok=true;
+          }
+        } else if (channel->m_closed){
+          return false; // Closed and drained
+        } else {
+          channel->m_consumers.push_back(this);
+          return true;
+        }
+      }
+      if (producer) channel->m_scheduler.Resume(producer->handle);
+      return false;
+    }
+
+    boost::optional<T> await_resume(){ return std::move(item); }
+  };
+
+public:
+  // capacity 0 means unbounded. Waiters are resumed on scheduler.
+  explicit Channel(CoroutineScheduler& scheduler, std::size_t capacity=0):
+    m_scheduler(scheduler), m_capacity(capacity), m_closed(false), m_items(capacity ? capacity : 16){}
+
+  // co_await Push(item) is false if the channel is closed
+  PushAwaiter Push(T item){
+    return PushAwaiter{ this, std::move(item), false, std::coroutine_handle<>() };
+  }
+
+  // co_await Pop() is empty once the channel is closed and drained
+  PopAwaiter Pop(){
+    return PopAwaiter{ this, boost::optional<T>(), std::coroutine_handle<>() };
+  }
+
+  // Add without waiting, for threads outside the scheduler. False if closed or full.
+  bool TryPush(T item){
+    PopAwaiter* consumer=0;
+    {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      if (m_closed) return false;
+      if (!m_consumers.empty()){
+        consumer=m_consumers.front();
+        m_consumers.pop_front();
+        consumer->item=std::move(item);
+      } else if (!Full()){
+        Store(std::move(item));
+      } else {
+        return false;
+      }
+    }
+    if (consumer) m_scheduler.Resume(consumer->handle);
+    return true;
+  }
+
+  // Refuse new items and resume every waiter
+  void Close(){
+    std::deque<PopAwaiter*> consumers;
+    std::deque<PushAwaiter*> producers;
+    {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      m_closed=true;
+      consumers.swap(m_consumers);
+      producers.swap(m_producers);
+    }
+    for (std::size_t i=0; i<consumers.size(); ++i) m_scheduler.Resume(consumers[i]->handle);
+    for (std::size_t i=0; i<producers.size(); ++i){
+      producers[i]->ok=false;
+      m_scheduler.Resume(producers[i]->handle);
+    }
+  }
+
+  bool IsClosed(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_closed;
+  }
+
+  std::size_t Size(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_items.size();
+  }
+};
+
+#endif // __CHANNEL__H_
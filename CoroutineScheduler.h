@@ -0,0 +1,138 @@
+#ifndef __COROUTINE_SCHEDULER__H_
+#define __COROUTINE_SCHEDULER__H_
+
+// Needs -std=c++20
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+
+#include "ThreadPool.h"
+
+class CoroutineScheduler;
+
+// A detached coroutine started with CoroutineScheduler::Spawn(). It starts
+// suspended, runs on the scheduler's workers and frees its frame when it
+// returns. An exception escaping it terminates, like one escaping a thread.
+//
+//   CoTask Consumer(Channel<int>& in){ while (auto v=co_await in.Pop()) ...; }
+class CoTask{
+public:
+  struct promise_type{
+    CoroutineScheduler* scheduler;
+
+    promise_type(): scheduler(0){}
+
+    CoTask get_return_object(){ return CoTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+
+    struct FinalAwaiter{
+      bool await_ready() noexcept { return false; }
+      void await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+      void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+
+    void return_void(){}
+    void unhandled_exception(){ std::terminate(); }
+  };
+
+  CoTask(CoTask&& other): m_handle(other.m_handle){ other.m_handle=0; }
+  ~CoTask(){ if (m_handle) m_handle.destroy(); } // Never spawned
+
+private:
+  friend class CoroutineScheduler;
+  std::coroutine_handle<promise_type> m_handle;
+
+  explicit CoTask(std::coroutine_handle<promise_type> handle): m_handle(handle){}
+  CoTask(const CoTask&);
+  CoTask& operator=(const CoTask&);
+
+  std::coroutine_handle<promise_type> Release(){
+    std::coroutine_handle<promise_type> handle=m_handle;
+    m_handle=0;
+    return handle;
+  }
+};
+
+// Runs coroutines on a ThreadPool. A coroutine that suspends (on a Channel,
+// on Yield()) gives its worker back and is resumed later as an ordinary pool
+// task, so many thousands of them share a few threads and each costs only
+// its frame, a few hundred bytes, instead of a thread stack.
+class CoroutineScheduler{
+private:
+  // Pool task that resumes a suspended coroutine, small enough for
+  // boost::function to store without allocating
+  struct Resumer{
+    std::coroutine_handle<> handle;
+    void operator () (){ handle.resume(); }
+  };
+
+  ThreadPool m_pool;
+  boost::atomic<std::size_t> m_live; // Spawned and not finished
+  boost::mutex m_mutex;
+  boost::condition_variable m_done;
+
+  friend struct CoTask::promise_type::FinalAwaiter;
+
+  void Finished(){
+    if (m_live.fetch_sub(1, boost::memory_order_acq_rel)==1){
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      m_done.notify_all();
+    }
+  }
+
+public:
+  // 0 threads means one per hardware thread
+  explicit CoroutineScheduler(std::size_t threads=0):
+    m_pool(threads), m_live(0){}
+
+  // Waits for the coroutines, then joins the workers
+  ~CoroutineScheduler(){
+    Wait();
+  }
+
+  // Start a coroutine on the pool
+  void Spawn(CoTask task){
+    std::coroutine_handle<CoTask::promise_type> handle=task.Release();
+    handle.promise().scheduler=this;
+    m_live.fetch_add(1, boost::memory_order_relaxed);
+    Resume(handle);
+  }
+
+  // Queue a suspended coroutine to continue on the pool
+  void Resume(std::coroutine_handle<> handle){
+    Resumer resumer={ handle };
+    m_pool.Submit(resumer);
+  }
+
+  // co_await scheduler.Yield() lets other coroutines run on this worker
+  struct YieldAwaiter{
+    CoroutineScheduler* scheduler;
+    bool await_ready(){ return false; }
+    void await_suspend(std::coroutine_handle<> handle){ scheduler->Resume(handle); }
+    void await_resume(){}
+  };
+
+  YieldAwaiter Yield(){
+    YieldAwaiter awaiter={ this };
+    return awaiter;
+  }
+
+  // Block until every spawned coroutine has returned
+  void Wait(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (m_live.load()!=0) m_done.wait(lock);
+  }
+
+  std::size_t Size() const { return m_pool.Size(); }
+};
+
+inline void CoTask::promise_type::FinalAwaiter::await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+  CoroutineScheduler* scheduler=handle.promise().scheduler;
+  handle.destroy();
+  if (scheduler) scheduler->Finished();
+}
+
+#endif // __COROUTINE_SCHEDULER__H_
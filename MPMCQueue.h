@@ -0,0 +1,381 @@
+#ifndef __MPMC_QUEUE__H_
+#define __MPMC_QUEUE__H_
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <boost/range/begin.hpp>
+#include <boost/range/end.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <new>
+#include <cstring>
+
+#include "ObjectPool.h"
+#include "QueueClosed.h"
+
+// Bounded lock-free queue for many producers and many consumers, a drop-in for
+// SynchronisedQueue. Each cell carries a sequence number telling whether it is
+// free or full for the current lap (Vyukov's bounded MPMC queue), so producers
+// and consumers only meet on the cell they hand over.
+// Enqueue/Dequeue block only when the queue is full/empty: they spin briefly,
+// then park on a condition variable. Nobody is notified unless somebody parked.
+// Close() wakes every waiter: producers are refused from then on, consumers
+// drain what is left, including items from producers already past their
+// closed check, and then get false.
+// Allocator places the cells, e.g. NumaAllocator on the node of the workers.
+template <typename T, typename Allocator=std::allocator<T> >
+class MPMCQueue{
+private:
+  static const std::size_t CACHE_LINE_SIZE = 64;
+  static const int SPIN_TRIES = 64; // Attempts before parking
+
+  struct CellBase{
+    boost::atomic<std::size_t> seq;
+    typename boost::aligned_storage<sizeof(T), boost::alignment_of<T>::value>::type storage;
+  };
+
+  // Every cell on whole cache lines of its own so neighbours don't false share
+  struct alignas(CACHE_LINE_SIZE) Cell : CellBase{
+    T* data(){ return static_cast<T*>(static_cast<void*>(&this->storage)); }
+  };
+
+  // Allocator gives no cache line alignment (nor does std::allocator before
+  // C++17), so the cells are over-allocated from it and aligned within, with
+  // the block's start kept just below them
+  class CellAllocator{
+  private:
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<char> Bytes;
+    Bytes m_bytes;
+
+    static std::size_t BlockSize(std::size_t n){ return n*sizeof(Cell)+CACHE_LINE_SIZE+sizeof(char*); }
+
+  public:
+    typedef Cell value_type;
+    template <typename U> struct rebind{ typedef CellAllocator other; };
+
+    explicit CellAllocator(const Allocator& alloc): m_bytes(alloc){}
+
+    Cell* allocate(std::size_t n){
+      char* block=std::allocator_traits<Bytes>::allocate(m_bytes, BlockSize(n));
+      char* cells=block+sizeof(char*);
+      cells+=(CACHE_LINE_SIZE-reinterpret_cast<std::size_t>(cells)%CACHE_LINE_SIZE)%CACHE_LINE_SIZE;
+      std::memcpy(cells-sizeof(char*), &block, sizeof(char*));
+      return reinterpret_cast<Cell*>(cells);
+    }
+
+    void deallocate(Cell* cells, std::size_t n){
+      char* block;
+      std::memcpy(&block, reinterpret_cast<char*>(cells)-sizeof(char*), sizeof(char*));
+      std::allocator_traits<Bytes>::deallocate(m_bytes, block, BlockSize(n));
+    }
+
+    bool operator==(const CellAllocator& other) const { return m_bytes==other.m_bytes; }
+    bool operator!=(const CellAllocator& other) const { return m_bytes!=other.m_bytes; }
+  };
+
+  std::vector<Cell, CellAllocator> m_cells;
+  const std::size_t m_mask;
+
+  char m_pad0[CACHE_LINE_SIZE];
+  boost::atomic<std::size_t> m_enqueue_pos;
+  char m_pad1[CACHE_LINE_SIZE - sizeof(boost::atomic<std::size_t>)];
+  boost::atomic<std::size_t> m_dequeue_pos;
+  char m_pad2[CACHE_LINE_SIZE - sizeof(boost::atomic<std::size_t>)];
+  boost::atomic<int> m_producers_active; // Past their closed check, not done yet
+  char m_pad3[CACHE_LINE_SIZE - sizeof(boost::atomic<int>)];
+
+  // Slow path, only touched when a thread has to park
+  boost::atomic<bool> m_closed;
+  boost::atomic<int> m_consumers_waiting;
+  boost::atomic<int> m_producers_waiting;
+  boost::mutex m_mutex;
+  boost::condition_variable m_not_empty;
+  boost::condition_variable m_not_full;
+
+  boost::scoped_ptr<ObjectPool<T> > m_pool; // Optional recycled message buffers
+
+  // Counts a producer in before it checks for Close(), so consumers can tell
+  // when no item can arrive anymore. The last one out after Close() wakes the
+  // consumers waiting for it.
+  class ProducerScope{
+  private:
+    MPMCQueue& m_queue;
+
+  public:
+    explicit ProducerScope(MPMCQueue& queue): m_queue(queue){
+      m_queue.m_producers_active.fetch_add(1, boost::memory_order_seq_cst);
+    }
+    ~ProducerScope(){
+      if (m_queue.m_producers_active.fetch_sub(1, boost::memory_order_seq_cst)==1 && m_queue.IsClosed())
+        WakeAll(m_queue.m_consumers_waiting, m_queue.m_mutex, m_queue.m_not_empty);
+    }
+  };
+
+  // Closed, and every producer that got past its check is done
+  bool Drained() const {
+    return m_closed.load(boost::memory_order_seq_cst) && m_producers_active.load(boost::memory_order_seq_cst)==0;
+  }
+
+  static std::size_t RoundUp(std::size_t n){
+    std::size_t p=2;
+    while (p<n) p<<=1;
+    return p;
+  }
+
+  // Wake a parked thread if there is one. The fence orders our publish
+  // before the waiter count read, pairing with the fence in Park().
+  static void Wake(boost::atomic<int>& waiting, boost::mutex& mutex, boost::condition_variable& cond){
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    if (waiting.load(boost::memory_order_relaxed)==0) return;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    cond.notify_one();
+  }
+
+  template <typename... Args>
+  bool Push(Args&&... args){
+    Cell* cell;
+    std::size_t pos=m_enqueue_pos.load(boost::memory_order_relaxed);
+    for (;;){
+      cell=&m_cells[pos & m_mask];
+      std::size_t seq=cell->seq.load(boost::memory_order_acquire);
+      std::ptrdiff_t diff=(std::ptrdiff_t)seq-(std::ptrdiff_t)pos;
+      if (diff==0){
+        if (m_enqueue_pos.compare_exchange_weak(pos, pos+1, boost::memory_order_relaxed)) break;
+      }
+      else if (diff<0) return false; // Full
+      else pos=m_enqueue_pos.load(boost::memory_order_relaxed);
+    }
+
+    new (cell->data()) T(std::forward<Args>(args)...);
+    cell->seq.store(pos+1, boost::memory_order_release);
+    return true;
+  }
+
+  bool Pop(T& result){
+    Cell* cell;
+    std::size_t pos=m_dequeue_pos.load(boost::memory_order_relaxed);
+    for (;;){
+      cell=&m_cells[pos & m_mask];
+      std::size_t seq=cell->seq.load(boost::memory_order_acquire);
+      std::ptrdiff_t diff=(std::ptrdiff_t)seq-(std::ptrdiff_t)(pos+1);
+      if (diff==0){
+        if (m_dequeue_pos.compare_exchange_weak(pos, pos+1, boost::memory_order_relaxed)) break;
+      }
+      else if (diff<0) return false; // Empty
+      else pos=m_dequeue_pos.load(boost::memory_order_relaxed);
+    }
+
+    T* data=cell->data();
+    result=std::move(*data);
+    data->~T();
+    cell->seq.store(pos+m_mask+1, boost::memory_order_release);
+    return true;
+  }
+
+  // Retry op until it succeeds, spinning first and then parking on cond.
+  // Gives up after deadline if one is given, or once stop() is true and a last
+  // op() fails: IsClosed for producers, Drained for consumers.
+  // op must not Wake(), it may run with m_mutex held.
+  template <typename Op>
+  bool Park(Op op, bool (MPMCQueue::*stop)() const, boost::atomic<int>& waiting, boost::condition_variable& cond,
+            const boost::system_time* deadline=0){
+    for (int i=0; i<SPIN_TRIES; ++i){
+      if (op()) return true;
+      if ((this->*stop)()) return op();
+      boost::this_thread::yield();
+    }
+
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    waiting.fetch_add(1, boost::memory_order_seq_cst);
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    bool done;
+    while (!(done=op())){
+      if ((this->*stop)()){ done=op(); break; }
+      if (!deadline) cond.wait(lock);
+      else if (!cond.timed_wait(lock, *deadline)){ done=op(); break; }
+    }
+    waiting.fetch_sub(1, boost::memory_order_relaxed);
+    return done;
+  }
+
+  static void WakeAll(boost::atomic<int>& waiting, boost::mutex& mutex, boost::condition_variable& cond){
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    if (waiting.load(boost::memory_order_relaxed)==0) return;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    cond.notify_all();
+  }
+
+public:
+  // Capacity is rounded up to a power of two
+  explicit MPMCQueue(std::size_t capacity=1024, const Allocator& alloc=Allocator()):
+    m_cells(RoundUp(capacity), CellAllocator(alloc)), m_mask(m_cells.size()-1),
+    m_enqueue_pos(0), m_dequeue_pos(0), m_producers_active(0), m_closed(false), m_consumers_waiting(0), m_producers_waiting(0){
+    for (std::size_t i=0; i<m_cells.size(); ++i) m_cells[i].seq.store(i, boost::memory_order_relaxed);
+  }
+
+  ~MPMCQueue(){
+    T dummy;
+    while (Pop(dummy)){}
+  }
+
+  // Add data to the queue if there is room
+  template <typename U>
+  bool TryEnqueue(U&& data){
+    ProducerScope scope(*this);
+    if (IsClosed() || !Push(std::forward<U>(data))) return false;
+    Wake(m_consumers_waiting, m_mutex, m_not_empty);
+    return true;
+  }
+
+  // Add data, waiting at most timeout for room
+  template <typename U>
+  bool TimedEnqueue(U&& data, const boost::posix_time::time_duration& timeout){
+    ProducerScope scope(*this);
+    if (IsClosed()) return false;
+    const boost::system_time deadline=boost::get_system_time()+timeout;
+    if (!Park([&]{ return Push(std::forward<U>(data)); }, &MPMCQueue::IsClosed, m_producers_waiting, m_not_full, &deadline))
+      return false;
+    Wake(m_consumers_waiting, m_mutex, m_not_empty);
+    return true;
+  }
+
+  // Take data from the queue if there is any
+  bool TryDequeue(T& result){
+    if (!Pop(result)) return false;
+    Wake(m_producers_waiting, m_mutex, m_not_full);
+    return true;
+  }
+
+  // Get data, waiting at most timeout for it
+  bool TimedDequeue(T& result, const boost::posix_time::time_duration& timeout){
+    const boost::system_time deadline=boost::get_system_time()+timeout;
+    if (!Park([&]{ return Pop(result); }, &MPMCQueue::Drained, m_consumers_waiting, m_not_empty, &deadline)) return false;
+    Wake(m_producers_waiting, m_mutex, m_not_full);
+    return true;
+  }
+
+  // Add data to the queue, wait for room if full.
+  // Returns false if the queue is closed.
+  bool Enqueue(const T& data){
+    return Emplace(data);
+  }
+
+  bool Enqueue(T&& data){
+    return Emplace(std::move(data));
+  }
+
+  // Build the data from args in its cell, wait for room if full.
+  // args are only consumed once a cell has been claimed.
+  template <typename... Args>
+  bool Emplace(Args&&... args){
+    ProducerScope scope(*this);
+    if (IsClosed()) return false;
+    if (!Park([&]{ return Push(std::forward<Args>(args)...); }, &MPMCQueue::IsClosed, m_producers_waiting, m_not_full))
+      return false;
+    Wake(m_consumers_waiting, m_mutex, m_not_empty);
+    return true;
+  }
+
+  // Get data from the queue, wait for data if not available.
+  // Throws QueueClosed once the queue is closed and drained.
+  T Dequeue(){
+    T result;
+    if (!Dequeue(result)) throw QueueClosed();
+    return result;
+  }
+
+  // Get data from the queue, returns false once closed and drained
+  bool Dequeue(T& result){
+    if (!Park([&]{ return Pop(result); }, &MPMCQueue::Drained, m_consumers_waiting, m_not_empty)) return false;
+    Wake(m_producers_waiting, m_mutex, m_not_full);
+    return true;
+  }
+
+  // Add a batch of data, waiting for room as needed, and wake consumers once.
+  // Returns how many were added, fewer if the queue gets closed.
+  template <typename InputIterator>
+  std::size_t EnqueueBulk(InputIterator first, InputIterator last){
+    ProducerScope scope(*this);
+    std::size_t n=0;
+    for (; first!=last && !IsClosed(); ++first, ++n){
+      const T& data=*first;
+      if (!Push(data)){
+        if (n) WakeAll(m_consumers_waiting, m_mutex, m_not_empty);
+        if (!Park([&]{ return Push(data); }, &MPMCQueue::IsClosed, m_producers_waiting, m_not_full)) break;
+      }
+    }
+    if (n==1) Wake(m_consumers_waiting, m_mutex, m_not_empty);
+    else if (n>1) WakeAll(m_consumers_waiting, m_mutex, m_not_empty);
+    return n;
+  }
+
+  template <typename Range>
+  std::size_t EnqueueBulk(const Range& range){
+    return EnqueueBulk(boost::begin(range), boost::end(range));
+  }
+
+  // Get up to max items, waiting up to timeout for the first one.
+  // Returns how many were written to out (0 on timeout or when the queue is
+  // closed and drained).
+  template <typename OutputIterator>
+  std::size_t DequeueBulk(OutputIterator out, std::size_t max, const boost::posix_time::time_duration& timeout){
+    if (max==0) return 0;
+
+    T data;
+    const boost::system_time deadline=boost::get_system_time()+timeout;
+    if (!Park([&]{ return Pop(data); }, &MPMCQueue::Drained, m_consumers_waiting, m_not_empty, &deadline)) return 0;
+
+    std::size_t n=1;
+    *out++=std::move(data);
+    while (n<max && Pop(data)){ *out++=std::move(data); ++n; }
+    WakeAll(m_producers_waiting, m_mutex, m_not_full);
+    return n;
+  }
+
+  // Get everything currently queued without waiting
+  template <typename OutputIterator>
+  std::size_t DrainAll(OutputIterator out){
+    T data;
+    std::size_t n=0;
+    while (Pop(data)){ *out++=std::move(data); ++n; }
+    if (n) WakeAll(m_producers_waiting, m_mutex, m_not_full);
+    return n;
+  }
+
+  // Refuse new items and wake every waiter. Items already queued can still
+  // be dequeued.
+  void Close(){
+    m_closed.store(true);
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    m_not_empty.notify_all();
+    m_not_full.notify_all();
+  }
+
+  bool IsClosed() const {
+    return m_closed.load(boost::memory_order_seq_cst); // Ordered after a producer counting itself in
+  }
+
+  // Keep up to pool_size consumed buffers for AcquireBuffer().
+  // Call before the queue is shared between threads.
+  void EnableBufferPool(std::size_t pool_size){
+    m_pool.reset(pool_size ? new ObjectPool<T>(pool_size) : 0);
+  }
+
+  // Get a buffer to build a message in, recycled if the pool has one
+  T AcquireBuffer(){
+    return m_pool ? m_pool->Acquire() : T();
+  }
+
+  // Hand a consumed message back for reuse
+  void RecycleBuffer(T&& buffer){
+    if (m_pool) m_pool->Release(std::move(buffer));
+  }
+
+  std::size_t Capacity() const { return m_mask+1; }
+};
+
+#endif // __MPMC_QUEUE__H_
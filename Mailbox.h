@@ -0,0 +1,109 @@
+#ifndef __MAILBOX__H_
+#define __MAILBOX__H_
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <utility>
+
+#include "SharedMem/ShmFutex.h"
+
+// Single-slot handoff of the latest value from one producer to one consumer,
+// for feeds where only the freshest value matters. It is a triple buffer: the
+// producer writes into its own slot and swaps it with the middle one, the
+// consumer swaps its slot with the middle one when that holds something new.
+// Neither side ever waits for the other. A value overwritten before the
+// consumer picked it up is conflated (skipped) and counted.
+//
+//   producer: mailbox.Publish(value);
+//   consumer: if (mailbox.Update()) use(mailbox.Read());
+//
+// WaitForUpdate() parks the consumer until something is published; Publish()
+// only makes a syscall when the consumer is parked.
+template <typename T>
+class Mailbox{
+private:
+  static const std::size_t CACHE_LINE_SIZE = 64;
+  static const unsigned FRESH = 4; // Set in m_middle when it holds an unread value
+
+  struct Slot{
+    T value;
+    char pad[CACHE_LINE_SIZE]; // Keep the producer's and consumer's slots apart
+  };
+
+  Slot m_slots[3];
+  unsigned m_write; // Producer's slot
+  char m_pad0[CACHE_LINE_SIZE];
+  boost::atomic<unsigned> m_middle; // Slot index | FRESH
+  boost::atomic<boost::uint64_t> m_published;
+  boost::atomic<boost::uint64_t> m_conflated;
+  char m_pad1[CACHE_LINE_SIZE];
+  unsigned m_read; // Consumer's slot
+  shm_futex::ShmEventCount m_updated;
+
+public:
+  Mailbox():
+    m_write(0), m_middle(1), m_published(0), m_conflated(0), m_read(2){}
+
+  // Producer side. The slot to build the next value in; it holds an old value.
+  T& WriteBuffer(){
+    return m_slots[m_write].value;
+  }
+
+  // Publish what was built in WriteBuffer(). Never blocks.
+  void Publish(){
+    const unsigned previous=m_middle.exchange(m_write|FRESH, boost::memory_order_acq_rel);
+    m_write=previous&~FRESH;
+    if (previous&FRESH) m_conflated.fetch_add(1, boost::memory_order_relaxed);
+    m_published.fetch_add(1, boost::memory_order_relaxed);
+    m_updated.notify_one();
+  }
+
+  void Publish(const T& value){
+    WriteBuffer()=value;
+    Publish();
+  }
+
+  void Publish(T&& value){
+    WriteBuffer()=std::move(value);
+    Publish();
+  }
+
+  // Consumer side. Take the latest published value if it hasn't been read
+  // yet, returns false if nothing new was published.
+  bool Update(){
+    if (!(m_middle.load(boost::memory_order_relaxed)&FRESH)) return false;
+    m_read=m_middle.exchange(m_read, boost::memory_order_acq_rel)&~FRESH;
+    return true;
+  }
+
+  // The value taken by the last successful Update()
+  const T& Read() const {
+    return m_slots[m_read].value;
+  }
+
+  // Update() and copy the value out
+  bool TryConsume(T& out){
+    if (!Update()) return false;
+    out=m_slots[m_read].value;
+    return true;
+  }
+
+  // Wait up to timeout for a value not read yet, then Update()
+  bool WaitForUpdate(const boost::posix_time::time_duration& timeout){
+    m_updated.await([this]{ return (m_middle.load(boost::memory_order_acquire)&FRESH)!=0; }, timeout);
+    return Update();
+  }
+
+  // Values published so far
+  boost::uint64_t Published() const {
+    return m_published.load(boost::memory_order_relaxed);
+  }
+
+  // Values overwritten before the consumer read them
+  boost::uint64_t Conflated() const {
+    return m_conflated.load(boost::memory_order_relaxed);
+  }
+};
+
+#endif // __MAILBOX__H_
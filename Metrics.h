@@ -0,0 +1,275 @@
+#ifndef __METRICS__H_
+#define __METRICS__H_
+
+#include <boost/cstdint.hpp>
+#include <ostream>
+
+// Low overhead counters and latency histograms for hot paths.
+// Build with -DENABLE_METRICS to turn them on. Without it every type below is
+// an empty inline stub, so instrumented code compiles to nothing.
+//
+// Enabled, each metric is split into SHARDS cache-line padded shards and a
+// thread always updates the same shard with a relaxed atomic add, so an event
+// costs a few nanoseconds and threads don't fight over one line. Reads sum the
+// shards. Latencies are taken in CPU ticks (rdtsc) and converted to ns on dump.
+// Histograms are log-linear: 8 linear sub-buckets per power of two, so any
+// value is known to within 12.5%.
+//
+//   metrics::Histogram wait("queue.wait_ns");
+//   boost::uint64_t t0=metrics::Now(); ...; wait.Record(metrics::Now()-t0);
+//   metrics::Registry::Instance().Dump(std::cout);
+
+#ifdef ENABLE_METRICS
+
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "ShardedCounter.h"
+
+namespace metrics {
+
+  static const bool ENABLED = true;
+  static const std::size_t SHARDS = 16;
+  static const std::size_t CACHE_LINE_SIZE = 64;
+
+  inline boost::uint64_t MonotonicNs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (boost::uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+  }
+
+  // Timestamp in ticks, only meaningful as a difference
+  inline boost::uint64_t Now(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return MonotonicNs();
+#endif
+  }
+
+  // Nanoseconds per tick, measured once
+  inline double NsPerTick(){
+#if defined(__x86_64__) || defined(__i386__)
+    static const double ratio=[]{
+      const boost::uint64_t ns0=MonotonicNs(), t0=Now();
+      boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+      return (double)(MonotonicNs()-ns0)/(double)(Now()-t0);
+    }();
+    return ratio;
+#else
+    return 1.0;
+#endif
+  }
+
+  // The shard this thread updates, handed out round robin on first use
+  inline std::size_t ShardIndex(){
+    static boost::atomic<std::size_t> next(0);
+    static thread_local std::size_t index=next.fetch_add(1, boost::memory_order_relaxed)%SHARDS;
+    return index;
+  }
+
+  class Metric;
+
+  // Every live metric, for dumping
+  class Registry{
+  private:
+    boost::mutex m_mutex;
+    std::vector<Metric*> m_metrics;
+
+  public:
+    static Registry& Instance(){
+      static Registry registry;
+      return registry;
+    }
+
+    void Add(Metric* metric){
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      m_metrics.push_back(metric);
+    }
+
+    void Remove(Metric* metric){
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      m_metrics.erase(std::remove(m_metrics.begin(), m_metrics.end(), metric), m_metrics.end());
+    }
+
+    void Dump(std::ostream& out);
+  };
+
+  class Metric{
+  private:
+    const char* m_name;
+
+  public:
+    explicit Metric(const char* name): m_name(name){ Registry::Instance().Add(this); }
+    virtual ~Metric(){ Registry::Instance().Remove(this); }
+
+    const char* Name() const { return m_name; }
+    virtual void Dump(std::ostream& out) const = 0;
+  };
+
+  inline void Registry::Dump(std::ostream& out){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    for (std::size_t i=0; i<m_metrics.size(); ++i) m_metrics[i]->Dump(out);
+  }
+
+  // A named, registered ShardedCounter
+  class Counter : public Metric{
+  private:
+    ShardedCounter<SHARDS, PerThreadSlot> m_count;
+
+  public:
+    explicit Counter(const char* name): Metric(name){}
+
+    void Add(boost::uint64_t n=1){
+      m_count.Add(n);
+    }
+
+    boost::uint64_t Value() const {
+      return m_count.Value();
+    }
+
+    void Dump(std::ostream& out) const {
+      out<<Name()<<" count="<<Value()<<"\n";
+    }
+  };
+
+  class Histogram : public Metric{
+  public:
+    enum Unit{ TICKS, VALUE }; // TICKS are shown as ns
+
+  private:
+    static const int SUB_BITS=3;
+    static const std::size_t SUB_BUCKETS=1<<SUB_BITS;
+    static const std::size_t BUCKETS=(64-SUB_BITS+1)*SUB_BUCKETS;
+
+    struct Shard{
+      boost::atomic<boost::uint64_t> buckets[BUCKETS];
+      char pad[CACHE_LINE_SIZE];
+    };
+    Shard m_shards[SHARDS];
+    Unit m_unit;
+
+    static std::size_t BucketOf(boost::uint64_t v){
+      if (v<SUB_BUCKETS) return (std::size_t)v;
+      const int e=63-__builtin_clzll(v); // e>=SUB_BITS
+      return (std::size_t)(e-SUB_BITS+1)*SUB_BUCKETS+(std::size_t)((v>>(e-SUB_BITS))&(SUB_BUCKETS-1));
+    }
+
+    // Smallest value that lands in bucket b
+    static boost::uint64_t LowerBound(std::size_t b){
+      if (b<SUB_BUCKETS) return b;
+      const int e=(int)(b/SUB_BUCKETS)+SUB_BITS-1;
+      return ((boost::uint64_t)(SUB_BUCKETS+b%SUB_BUCKETS))<<(e-SUB_BITS);
+    }
+
+    void Snapshot(std::vector<boost::uint64_t>& counts) const {
+      counts.assign(BUCKETS, 0);
+      for (std::size_t s=0; s<SHARDS; ++s)
+        for (std::size_t b=0; b<BUCKETS; ++b) counts[b]+=m_shards[s].buckets[b].load(boost::memory_order_relaxed);
+    }
+
+  public:
+    explicit Histogram(const char* name, Unit unit=TICKS): Metric(name), m_unit(unit){
+      for (std::size_t s=0; s<SHARDS; ++s)
+        for (std::size_t b=0; b<BUCKETS; ++b) m_shards[s].buckets[b].store(0, boost::memory_order_relaxed);
+    }
+
+    void Record(boost::uint64_t value){
+      m_shards[ShardIndex()].buckets[BucketOf(value)].fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    boost::uint64_t Count() const {
+      std::vector<boost::uint64_t> counts;
+      Snapshot(counts);
+      boost::uint64_t n=0;
+      for (std::size_t b=0; b<BUCKETS; ++b) n+=counts[b];
+      return n;
+    }
+
+    // Approximate p-th percentile (0..100), in ns for TICKS histograms
+    double Percentile(double p) const {
+      std::vector<boost::uint64_t> counts;
+      Snapshot(counts);
+      boost::uint64_t n=0;
+      for (std::size_t b=0; b<BUCKETS; ++b) n+=counts[b];
+      if (n==0) return 0;
+
+      const boost::uint64_t rank=(boost::uint64_t)(p/100.0*(double)(n-1))+1;
+      boost::uint64_t seen=0;
+      std::size_t b=0;
+      for (; b<BUCKETS; ++b){
+        seen+=counts[b];
+        if (seen>=rank) break;
+      }
+      const double value=(double)LowerBound(b);
+      return m_unit==TICKS ? value*NsPerTick() : value;
+    }
+
+    void Dump(std::ostream& out) const {
+      out<<Name()<<" count="<<Count()<<std::fixed<<std::setprecision(0)
+         <<" p50="<<Percentile(50)<<" p90="<<Percentile(90)
+         <<" p99="<<Percentile(99)<<" p999="<<Percentile(99.9)
+         <<" max="<<Percentile(100)<<"\n";
+    }
+  };
+
+  // Enqueue time carried with a queued item
+  class Stamp{
+  private:
+    boost::uint64_t m_ticks;
+
+  public:
+    Stamp(): m_ticks(Now()){}
+    boost::uint64_t Age() const { return Now()-m_ticks; }
+  };
+
+}//namespace
+
+#else // ENABLE_METRICS
+
+namespace metrics {
+
+  static const bool ENABLED = false;
+
+  inline boost::uint64_t Now(){ return 0; }
+
+  class Registry{
+  public:
+    static Registry& Instance(){ static Registry registry; return registry; }
+    void Dump(std::ostream&){}
+  };
+
+  class Counter{
+  public:
+    explicit Counter(const char*){}
+    void Add(boost::uint64_t =1){}
+    boost::uint64_t Value() const { return 0; }
+  };
+
+  class Histogram{
+  public:
+    enum Unit{ TICKS, VALUE };
+    explicit Histogram(const char*, Unit =TICKS){}
+    void Record(boost::uint64_t){}
+    boost::uint64_t Count() const { return 0; }
+    double Percentile(double) const { return 0; }
+  };
+
+  class Stamp{
+  public:
+    boost::uint64_t Age() const { return 0; }
+  };
+
+}//namespace
+
+#endif // ENABLE_METRICS
+
+#endif // __METRICS__H_
@@ -0,0 +1,45 @@
+#ifndef __OBJECT_POOL__H_
+#define __OBJECT_POOL__H_
+
+#include <boost/thread.hpp>
+#include <vector>
+#include <utility>
+
+// Bounded free list of reusable objects, e.g. message strings that keep their
+// heap buffer between uses. Objects come back from Acquire() as they were
+// released, so reset them (clear() a string) before reuse.
+template <typename T>
+class ObjectPool{
+private:
+  std::vector<T> m_free; // Reserved up front, never reallocates
+  std::size_t m_max_size;
+  boost::mutex m_mutex;
+
+public:
+  explicit ObjectPool(std::size_t max_size):
+    m_max_size(max_size){
+    m_free.reserve(max_size);
+  }
+
+  // Get a recycled object, or a new one if the pool is empty
+  T Acquire(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    if (m_free.empty()) return T();
+    T obj=std::move(m_free.back());
+    m_free.pop_back();
+    return obj;
+  }
+
+  // Give an object back, it is dropped if the pool is full
+  void Release(T&& obj){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    if (m_free.size()<m_max_size) m_free.push_back(std::move(obj));
+  }
+
+  std::size_t Size(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_free.size();
+  }
+};
+
+#endif // __OBJECT_POOL__H_
@@ -0,0 +1,277 @@
+#ifndef __PARALLEL_ALGORITHMS__H_
+#define __PARALLEL_ALGORITHMS__H_
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Data-parallel algorithms on a ThreadPool:
+//   ParallelFor(pool, begin, end, body)      body(i), or body(first, last) with ParallelForRange
+//   ParallelReduce(pool, begin, end, init, map, combine)
+//   ParallelScan(pool, first, last, out, op)  inclusive prefix "sum"
+//   ParallelSort(pool, first, last[, comp])
+// Ranges are split in halves recursively: the calling thread keeps one half
+// and queues the other on its own deque, where idle workers steal the
+// biggest pieces first. Splitting stops at a grain worked out from the range
+// and the pool size (about 8 pieces per worker), so small ranges don't pay
+// for tasks and big ones balance well. Split points fall on multiples of 64
+// elements, so neighbouring pieces don't write to the same cache line.
+// The caller runs pieces too while it waits, from inside or outside the pool.
+// The first exception thrown by a body is rethrown once everything stopped.
+class ParallelContext{
+private:
+  ThreadPool& m_pool;
+  boost::atomic<bool> m_failed;
+  boost::mutex m_mutex;
+  std::exception_ptr m_error;
+
+  template <typename F>
+  void Guard(F& f){
+    if (m_failed.load(boost::memory_order_relaxed)) return;
+    try {
+      f();
+    } catch (...) {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      if (!m_error) m_error=std::current_exception();
+      m_failed.store(true);
+    }
+  }
+
+public:
+  static const std::size_t ALIGN = 64; // Split points are multiples of this
+  static const int IDLE_POLLS = 64; // Invoke finds no task this often before it sleeps
+
+  explicit ParallelContext(ThreadPool& pool): m_pool(pool), m_failed(false){}
+
+  ThreadPool& Pool(){ return m_pool; }
+
+  // About 8 pieces per thread, at least min_grain elements each
+  std::size_t Grain(std::size_t n, std::size_t min_grain=1) const {
+    return std::max<std::size_t>(std::max<std::size_t>(min_grain, 1), n/(8*(m_pool.Size()+1)));
+  }
+
+  // Split [begin, end) near the middle, on an ALIGN boundary if it has room
+  static std::size_t Middle(std::size_t begin, std::size_t end){
+    const std::size_t mid=begin+(end-begin)/2;
+    const std::size_t aligned=mid/ALIGN*ALIGN;
+    return aligned>begin ? aligned : mid;
+  }
+
+  // Run f and g in parallel and return when both are done. g runs here, f
+  // goes to the pool; while it waits this thread runs other pending tasks.
+  // Once there are none left, f is running elsewhere: after a few polls the
+  // thread sleeps until f is done, checking back for new tasks every
+  // millisecond instead of burning a core.
+  template <typename F, typename G>
+  void Invoke(F f, G g){
+    boost::atomic<bool> done(false);
+    boost::mutex mutex;
+    boost::condition_variable finished;
+    m_pool.Submit([this, &f, &done, &mutex, &finished]{
+        Guard(f);
+        // Under the lock, which the waiter takes before returning, so these
+        // locals outlive the notify
+        boost::unique_lock<boost::mutex> lock(mutex);
+        done.store(true, boost::memory_order_release);
+        finished.notify_one();
+      });
+    Guard(g);
+
+    for (int idle=0; idle<IDLE_POLLS && !done.load(boost::memory_order_acquire); ){
+      if (m_pool.RunPendingTask()) idle=0;
+      else { ++idle; boost::this_thread::yield(); }
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!done.load(boost::memory_order_acquire)){
+      if (finished.timed_wait(lock, boost::posix_time::milliseconds(1))) continue;
+      lock.unlock();
+      while (!done.load(boost::memory_order_acquire) && m_pool.RunPendingTask()){}
+      lock.lock();
+    }
+  }
+
+  // body(first, last) over pieces of [begin, end) of at most grain elements
+  template <typename Body>
+  void For(std::size_t begin, std::size_t end, std::size_t grain, const Body& body){
+    if (end-begin<=grain){
+      if (begin<end && !m_failed.load(boost::memory_order_relaxed)) body(begin, end);
+      return;
+    }
+    const std::size_t mid=Middle(begin, end);
+    Invoke([this, mid, end, grain, &body]{ For(mid, end, grain, body); },
+           [this, begin, mid, grain, &body]{ For(begin, mid, grain, body); });
+  }
+
+  // Run body, then rethrow the first exception any piece threw
+  template <typename Body>
+  void Run(const Body& body){
+    Guard(body);
+    if (m_error) std::rethrow_exception(m_error);
+  }
+};
+
+// body(first, last) for pieces of [begin, end), grain 0 picks one
+template <typename Body>
+void ParallelForRange(ThreadPool& pool, std::size_t begin, std::size_t end, const Body& body, std::size_t grain=0){
+  if (end<=begin) return;
+  ParallelContext context(pool);
+  if (!grain) grain=context.Grain(end-begin, 1024);
+  context.Run([&]{ context.For(begin, end, grain, body); });
+}
+
+// body(i) for every i in [begin, end)
+template <typename Body>
+void ParallelFor(ThreadPool& pool, std::size_t begin, std::size_t end, const Body& body, std::size_t grain=0){
+  ParallelForRange(pool, begin, end, [&body](std::size_t first, std::size_t last){
+      for (std::size_t i=first; i<last; ++i) body(i);
+    }, grain);
+}
+
+// combine(... combine(init, map(p0_first, p0_last)) ..., map(pk_first, pk_last)),
+// map(first, last) reducing one piece. combine must be associative; the
+// pieces are combined in order, so the result doesn't depend on timing.
+template <typename T, typename Map, typename Combine>
+T ParallelReduce(ThreadPool& pool, std::size_t begin, std::size_t end, const T& init,
+                 const Map& map, const Combine& combine, std::size_t grain=0){
+  if (end<=begin) return init;
+  ParallelContext context(pool);
+  if (!grain) grain=context.Grain(end-begin, 1024);
+  const std::size_t pieces=(end-begin+grain-1)/grain;
+
+  // One partial per cache line
+  struct Partial{
+    T value;
+    char pad[ParallelContext::ALIGN];
+  };
+  std::vector<Partial> partials(pieces);
+  context.Run([&]{
+      context.For(0, pieces, 1, [&](std::size_t first, std::size_t last){
+          for (std::size_t p=first; p<last; ++p)
+            partials[p].value=map(begin+p*grain, std::min(end, begin+(p+1)*grain));
+        });
+    });
+
+  T result=init;
+  for (std::size_t p=0; p<pieces; ++p) result=combine(result, partials[p].value);
+  return result;
+}
+
+// out[i]=op(in[0], ... in[i]) for an associative op, out may be first.
+// Sums each piece in parallel, scans the piece totals, then scans each piece
+// again from its offset in parallel.
+template <typename InputIt, typename OutputIt, typename Op>
+void ParallelScan(ThreadPool& pool, InputIt first, InputIt last, OutputIt out, const Op& op, std::size_t grain=0){
+  typedef typename std::iterator_traits<InputIt>::value_type T;
+  const std::size_t n=(std::size_t)(last-first);
+  if (!n) return;
+  ParallelContext context(pool);
+  if (!grain) grain=context.Grain(n, 4096);
+  const std::size_t pieces=(n+grain-1)/grain;
+
+  std::vector<T> totals(pieces);
+  context.Run([&]{
+      context.For(0, pieces, 1, [&](std::size_t a, std::size_t b){
+          for (std::size_t p=a; p<b; ++p){
+            InputIt it=first+p*grain;
+            const InputIt stop=first+std::min(n, (p+1)*grain);
+            T sum=*it;
+            for (++it; it!=stop; ++it) sum=op(sum, *it);
+            totals[p]=sum;
+          }
+        });
+    });
+  for (std::size_t p=1; p<pieces; ++p) totals[p]=op(totals[p-1], totals[p]);
+
+  context.Run([&]{
+      context.For(0, pieces, 1, [&](std::size_t a, std::size_t b){
+          for (std::size_t p=a; p<b; ++p){
+            InputIt it=first+p*grain;
+            const InputIt stop=first+std::min(n, (p+1)*grain);
+            OutputIt to=out+p*grain;
+            T sum= p ? op(totals[p-1], *it) : *it;
+            *to=sum;
+            for (++it, ++to; it!=stop; ++it, ++to){ sum=op(sum, *it); *to=sum; }
+          }
+        });
+    });
+}
+
+template <typename InputIt, typename OutputIt>
+void ParallelScan(ThreadPool& pool, InputIt first, InputIt last, OutputIt out){
+  ParallelScan(pool, first, last, out, std::plus<typename std::iterator_traits<InputIt>::value_type>());
+}
+
+namespace parallel_detail {
+
+  // Merge two sorted ranges into out, splitting the bigger one at its middle
+  // and the other at the matching point so both halves merge in parallel
+  template <typename It, typename Out, typename Compare>
+  void Merge(ParallelContext& context, It a, It a_end, It b, It b_end, Out out,
+             const Compare& comp, std::size_t grain){
+    const std::size_t na=(std::size_t)(a_end-a), nb=(std::size_t)(b_end-b);
+    if (na+nb<=grain){
+      std::merge(a, a_end, b, b_end, out, comp);
+      return;
+    }
+    It a_mid, b_mid;
+    if (na>=nb){
+      a_mid=a+na/2;
+      b_mid=std::lower_bound(b, b_end, *a_mid, comp);
+    } else {
+      b_mid=b+nb/2;
+      a_mid=std::upper_bound(a, a_end, *b_mid, comp);
+    }
+    const Out out_mid=out+(a_mid-a)+(b_mid-b);
+    context.Invoke([=, &context, &comp]{ Merge(context, a_mid, a_end, b_mid, b_end, out_mid, comp, grain); },
+                   [=, &context, &comp]{ Merge(context, a, a_mid, b, b_mid, out, comp, grain); });
+  }
+
+  // Sort [first, last) using buffer (same size) as scratch. Leaves the result
+  // in [first, last) if in_place, otherwise in buffer.
+  template <typename It, typename Buf, typename Compare>
+  void Sort(ParallelContext& context, It first, It last, Buf buffer, bool in_place,
+            const Compare& comp, std::size_t grain){
+    const std::size_t n=(std::size_t)(last-first);
+    if (n<=grain){
+      std::sort(first, last, comp);
+      if (!in_place) std::copy(first, last, buffer);
+      return;
+    }
+    const std::size_t half=ParallelContext::Middle(0, n);
+    // Sort both halves into the other array, then merge back
+    context.Invoke([=, &context, &comp]{ Sort(context, first+half, last, buffer+half, !in_place, comp, grain); },
+                   [=, &context, &comp]{ Sort(context, first, first+half, buffer, !in_place, comp, grain); });
+    if (in_place) Merge(context, buffer, buffer+half, buffer+half, buffer+n, first, comp, grain);
+    else Merge(context, first, first+half, first+half, last, buffer, comp, grain);
+  }
+
+}//namespace
+
+// Parallel merge sort with a scratch buffer of the same size. Not stable.
+template <typename RandomIt, typename Compare>
+void ParallelSort(ThreadPool& pool, RandomIt first, RandomIt last, const Compare& comp, std::size_t grain=0){
+  typedef typename std::iterator_traits<RandomIt>::value_type T;
+  const std::size_t n=(std::size_t)(last-first);
+  ParallelContext context(pool);
+  if (!grain) grain=context.Grain(n, 8192);
+  if (n<=grain){
+    std::sort(first, last, comp);
+    return;
+  }
+  std::vector<T> buffer(n);
+  context.Run([&]{ parallel_detail::Sort(context, first, last, buffer.begin(), true, comp, grain); });
+}
+
+template <typename RandomIt>
+void ParallelSort(ThreadPool& pool, RandomIt first, RandomIt last){
+  ParallelSort(pool, first, last, std::less<typename std::iterator_traits<RandomIt>::value_type>());
+}
+
+#endif // __PARALLEL_ALGORITHMS__H_
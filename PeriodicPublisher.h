@@ -0,0 +1,176 @@
+#ifndef __PERIODIC_PUBLISHER__H_
+#define __PERIODIC_PUBLISHER__H_
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/cstdint.hpp>
+#include <utility>
+
+#include "Mailbox.h"
+#include "Metrics.h"
+#include "SharedMem/ShmFutex.h"
+
+// Shared by every PeriodicPublisher, compiled out unless ENABLE_METRICS
+struct PeriodicPublisherMetrics{
+  metrics::Counter publishes;
+  metrics::Histogram lag_ns; // Oldest unpublished update to its publish
+  metrics::Histogram batch;  // Updates coalesced into one publish
+
+  PeriodicPublisherMetrics():
+    publishes("PeriodicPublisher.publishes"), lag_ns("PeriodicPublisher.lag_ns"),
+    batch("PeriodicPublisher.batch", metrics::Histogram::VALUE){}
+
+  static PeriodicPublisherMetrics& Get(){
+    static PeriodicPublisherMetrics instance;
+    return instance;
+  }
+};
+
+// Publishes the latest state from a producer at a fixed cadence, to keep
+// downstream load bounded however fast the producer goes. Update() coalesces
+// into a Mailbox and never blocks. Every interval the latest value, if there
+// is a new one, goes to the sink. If nothing new arrived by then, the next
+// Update() is published straight away ("wait for a slow producer"). With a
+// batch threshold, that many updates publish early without waiting for the
+// tick. The sink runs on the publisher's own thread, or with a zero interval
+// on whatever calls Tick(), e.g. a timer.
+template <typename T>
+class PeriodicPublisher{
+public:
+  typedef boost::function<void(const T&)> Sink;
+
+private:
+  // A value and the updates it carries, stamped by the producer, so a publish
+  // accounts for exactly the updates behind the value it took
+  struct Stamped{
+    T value;
+    boost::uint64_t sequence;     // Updates up to and including this one
+    boost::uint64_t first_update; // metrics::Now() of the oldest update not published before it
+  };
+
+  Mailbox<Stamped> m_mailbox;
+  Sink m_sink;
+  const boost::posix_time::time_duration m_interval;
+  const boost::uint64_t m_threshold; // 0 for no early publishing
+
+  boost::uint64_t m_sequence; // Producer's count of updates
+  boost::uint64_t m_first_update; // Producer's stamp for the next value
+  boost::atomic<boost::uint64_t> m_updated; // m_sequence once its value is in the mailbox
+  boost::atomic<boost::uint64_t> m_consumed; // Sequence of the value published last
+  boost::atomic<bool> m_armed; // A tick found nothing, publish the next update at once
+  boost::atomic<bool> m_stop;
+  boost::atomic<boost::uint64_t> m_publishes;
+  shm_futex::ShmEventCount m_wake;
+  boost::thread m_thread;
+
+  // Updates in the mailbox not published yet
+  boost::uint64_t Pending() const {
+    const boost::uint64_t updated=m_updated.load(boost::memory_order_acquire);
+    const boost::uint64_t consumed=m_consumed.load(boost::memory_order_acquire);
+    return updated>consumed ? updated-consumed : 0; // A Tick may take a value before m_updated has it
+  }
+
+  bool ShouldPublishEarly() const {
+    const boost::uint64_t pending=Pending();
+    return (m_threshold && pending>=m_threshold) || (pending && m_armed.load(boost::memory_order_acquire));
+  }
+
+  void Run(){
+    boost::system_time next=boost::get_system_time()+m_interval;
+    while (!m_stop.load()){
+      const boost::posix_time::time_duration left=next-boost::get_system_time();
+      if (!left.is_negative())
+        m_wake.await([this]{ return m_stop.load() || ShouldPublishEarly(); }, left);
+
+      const bool tick=boost::get_system_time()>=next;
+      if (Tick()) m_armed.store(false);
+      else if (tick) m_armed.store(true);
+      if (tick) next+=m_interval;
+    }
+    Tick(); // Don't lose the last state
+  }
+
+  void Notify(){
+    m_wake.notify_one();
+  }
+
+  // Stamp the value built in the mailbox's write buffer and publish it, then
+  // wake the publisher if it should go out before the tick
+  void Stamp(){
+    Stamped& next=m_mailbox.WriteBuffer();
+    if (m_consumed.load(boost::memory_order_acquire)>=m_sequence) m_first_update=metrics::Now(); // All published before
+    next.sequence=++m_sequence;
+    next.first_update=m_first_update;
+    m_mailbox.Publish();
+    m_updated.store(m_sequence, boost::memory_order_release);
+    if (ShouldPublishEarly()) Notify();
+  }
+
+public:
+  // Publish to sink every interval on a thread of its own. An interval of
+  // zero starts no thread, call Tick() from a timer instead.
+  PeriodicPublisher(const Sink& sink, const boost::posix_time::time_duration& interval,
+                    boost::uint64_t batch_threshold=0):
+    m_sink(sink), m_interval(interval), m_threshold(batch_threshold),
+    m_sequence(0), m_first_update(0), m_updated(0), m_consumed(0), m_armed(false), m_stop(false), m_publishes(0){
+    if (m_interval.total_microseconds()>0) m_thread=boost::thread(&PeriodicPublisher::Run, this);
+  }
+
+  // Publishes the last update, then stops
+  ~PeriodicPublisher(){
+    Stop();
+  }
+
+  // Producer side, never blocks. Only one thread may update.
+  void Update(const T& value){
+    m_mailbox.WriteBuffer().value=value;
+    Stamp();
+  }
+
+  void Update(T&& value){
+    m_mailbox.WriteBuffer().value=std::move(value);
+    Stamp();
+  }
+
+  // Build the next state in place, then call Updated()
+  T& WriteBuffer(){
+    return m_mailbox.WriteBuffer().value;
+  }
+
+  void Updated(){
+    Stamp();
+  }
+
+  // Publish the latest state now if there is one not published yet.
+  // Called by the publisher thread, or by a timer when the interval is zero.
+  // Returns false if there was nothing new. Calls must not overlap.
+  bool Tick(){
+    if (!m_mailbox.Update()) return false;
+    const Stamped& latest=m_mailbox.Read();
+    const boost::uint64_t batch=latest.sequence-m_consumed.load(boost::memory_order_relaxed);
+    m_consumed.store(latest.sequence, boost::memory_order_release);
+    PeriodicPublisherMetrics& stats=PeriodicPublisherMetrics::Get();
+    stats.lag_ns.Record(metrics::Now()-latest.first_update);
+    stats.batch.Record(batch);
+    stats.publishes.Add();
+    m_sink(latest.value);
+    m_publishes.fetch_add(1, boost::memory_order_relaxed);
+    return true;
+  }
+
+  // Stop the publisher thread after publishing the last update
+  void Stop(){
+    if (m_stop.exchange(true)) return;
+    Notify();
+    if (m_thread.joinable()) m_thread.join();
+    else Tick();
+  }
+
+  boost::uint64_t Updates() const { return m_mailbox.Published(); }
+  boost::uint64_t Publishes() const { return m_publishes.load(boost::memory_order_relaxed); }
+  // Updates replaced by a newer one before they were published
+  boost::uint64_t Conflated() const { return m_mailbox.Conflated(); }
+};
+
+#endif // __PERIODIC_PUBLISHER__H_
@@ -0,0 +1,419 @@
+#ifndef __PRIORITY_SYNCHRONISED_QUEUE__H_
+#define __PRIORITY_SYNCHRONISED_QUEUE__H_
+
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/range/begin.hpp>
+#include <boost/range/end.hpp>
+#include <boost/circular_buffer.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <time.h>
+
+#include "SynchronisedQueue.h"
+
+// How a PrioritySynchronisedQueue picks the lane to dequeue from
+enum LaneScheduling{
+  StrictPriority,  // Always the lowest numbered lane that has items
+  WeightedPriority // Round robin, lane i gets up to weight(i) items per turn
+};
+
+// Shared by every PrioritySynchronisedQueue, compiled out unless ENABLE_METRICS
+struct PrioritySynchronisedQueueMetrics{
+  metrics::Counter enqueued;
+  metrics::Counter dequeued;
+  metrics::Counter dropped;
+  metrics::Counter promoted;       // Dequeued ahead of its turn because it waited past max_wait
+  metrics::Counter consumer_parks;
+  metrics::Counter producer_parks;
+  metrics::Histogram queued_ns;
+  metrics::Histogram park_ns;
+
+  PrioritySynchronisedQueueMetrics():
+    enqueued("PrioritySynchronisedQueue.enqueued"), dequeued("PrioritySynchronisedQueue.dequeued"),
+    dropped("PrioritySynchronisedQueue.dropped"), promoted("PrioritySynchronisedQueue.promoted"),
+    consumer_parks("PrioritySynchronisedQueue.consumer_parks"),
+    producer_parks("PrioritySynchronisedQueue.producer_parks"),
+    queued_ns("PrioritySynchronisedQueue.queued_ns"), park_ns("PrioritySynchronisedQueue.park_ns"){}
+
+  static PrioritySynchronisedQueueMetrics& Get(){
+    static PrioritySynchronisedQueueMetrics instance;
+    return instance;
+  }
+};
+
+// SynchronisedQueue with LANES FIFO lanes, lane 0 the most urgent.
+// With one FIFO a burst of bulk messages delays a control message queued
+// behind it; here each lane has its own storage, bound and OverflowPolicy, so
+// bulk producers fill and block on their own lane while urgent items go
+// around them. Consumers share one condition: a wake up takes whatever the
+// scheduling says is next, and DequeueBulk drains across lanes under one lock.
+//
+// Which lane is served next:
+//   StrictPriority    lane 0 first, then 1, ... Lower lanes only run when the
+//                     ones above are empty.
+//   WeightedPriority  lanes take turns, each taking up to its weight before
+//                     passing on, so the share of lane i under load is
+//                     weight(i)/sum of weights.
+// Either way a lane with a max_wait ages: once its oldest item has waited
+// longer than that, it goes ahead of the scheduling, the most overdue lane
+// first. Promotions alternate with scheduled picks, so an overdue bulk lane
+// gets at least every other dequeue under strict priority, and urgent items
+// still get the rest. Under weighted a max_wait on the urgent lane bounds how
+// long it waits for the other lanes' turns.
+//
+// Configure the lanes with SetLane() before the queue is shared between threads:
+//   PrioritySynchronisedQueue<Message, 2> queue;
+//   queue.SetLane(1, 10000, BlockWhenFull, 1, boost::posix_time::milliseconds(5));
+//   queue.Enqueue(0, control); queue.Enqueue(1, bulk);
+template <typename T, std::size_t LANES=2, typename Allocator=std::allocator<T> >
+class PrioritySynchronisedQueue{
+private:
+  struct Entry : metrics::Stamp{
+    boost::uint64_t queued; // Monotonic ns, only set when the lane ages
+    T value;
+    template <typename... Args>
+    explicit Entry(boost::uint64_t when, Args&&... args): queued(when), value(std::forward<Args>(args)...){}
+  };
+
+  struct Lane{
+    boost::circular_buffer<Entry, typename std::allocator_traits<Allocator>::template rebind_alloc<Entry> > queue;
+    std::size_t capacity; // 0 for unbounded
+    OverflowPolicy policy;
+    std::size_t weight;
+    boost::uint64_t max_wait; // ns, 0 never ages
+    std::size_t dropped;
+    int producers_waiting;
+    boost::condition_variable not_full; // Per lane, so room in one lane doesn't wake another's producers
+
+    explicit Lane(const Allocator& alloc):
+      queue(16, alloc), capacity(0), policy(BlockWhenFull), weight(1), max_wait(0),
+      dropped(0), producers_waiting(0){}
+
+    bool Full() const { return capacity && queue.size()>=capacity; }
+  };
+
+  boost::scoped_ptr<Lane> m_lanes[LANES]; // Lanes hold condition variables, which can't be moved
+  const LaneScheduling m_scheduling;
+  bool m_aging; // Some lane has a max_wait
+  std::size_t m_size; // Items in all lanes
+  std::size_t m_turn; // WeightedPriority: the lane being served
+  std::size_t m_credit; // and how many more it may take
+  std::size_t m_promoted;
+  bool m_promoted_last; // The last pick was a promotion
+  bool m_closed;
+  int m_consumers_waiting;
+  boost::mutex m_mutex;
+  boost::condition_variable m_cond; // Data is ready or the queue closed
+
+  static boost::uint64_t MonotonicNs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (boost::uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+  }
+
+  template <typename Ready>
+  bool Wait(boost::unique_lock<boost::mutex>& lock, boost::condition_variable& cond, int& waiting,
+            Ready ready, const boost::system_time* deadline){
+    if (ready()) return true;
+
+    PrioritySynchronisedQueueMetrics& stats=PrioritySynchronisedQueueMetrics::Get();
+    (&cond==&m_cond ? stats.consumer_parks : stats.producer_parks).Add();
+    const boost::uint64_t start=metrics::Now();
+
+    ++waiting;
+    bool ok=true;
+    while (!ready()){
+      if (!deadline) cond.wait(lock);
+      else if (!cond.timed_wait(lock, *deadline)){ ok=ready(); break; }
+    }
+    --waiting;
+
+    stats.park_ns.Record(metrics::Now()-start);
+    return ok;
+  }
+
+  // Make room for one item in lane following its policy, m_mutex must be held
+  bool MakeRoom(boost::unique_lock<boost::mutex>& lock, Lane& lane, bool block, const boost::system_time* deadline){
+    if (m_closed) return false;
+    if (!lane.Full()) return true;
+
+    switch (lane.policy){
+    case DropOldest:
+      lane.queue.pop_front(); --m_size; ++lane.dropped;
+      PrioritySynchronisedQueueMetrics::Get().dropped.Add();
+      return true;
+    case FailWhenFull:
+      return false;
+    case BlockWhenFull:
+      if (!block) return false;
+      return Wait(lock, lane.not_full, lane.producers_waiting, [this, &lane]{ return m_closed || !lane.Full(); }, deadline)
+        && !m_closed;
+    }
+    return false;
+  }
+
+  // Construct an item at the back of lane, m_mutex must be held
+  template <typename... Args>
+  void Push(Lane& lane, Args&&... args){
+    if (lane.queue.full()) lane.queue.set_capacity(lane.queue.capacity()*2);
+    PrioritySynchronisedQueueMetrics::Get().enqueued.Add();
+    lane.queue.push_back(Entry(lane.max_wait ? MonotonicNs() : 0, std::forward<Args>(args)...));
+    ++m_size;
+  }
+
+  // The lane to dequeue from next, m_size must be non-zero and m_mutex held
+  std::size_t Next(){
+    // A promotion is followed by a scheduled pick, so a lane that stays overdue
+    // under saturation still can't shut out the lanes above it
+    if (m_aging && !m_promoted_last){
+      // Most overdue aged lane, if any
+      const boost::uint64_t now=MonotonicNs();
+      std::size_t overdue=LANES;
+      boost::uint64_t earliest=0;
+      for (std::size_t i=0; i<LANES; ++i){
+        const Lane& lane=*m_lanes[i];
+        if (!lane.max_wait || lane.queue.empty()) continue;
+        const boost::uint64_t due=lane.queue.front().queued+lane.max_wait;
+        if (due<=now && (overdue==LANES || due<earliest)){ overdue=i; earliest=due; }
+      }
+      if (overdue!=LANES && overdue!=Scheduled(false)){
+        ++m_promoted; m_promoted_last=true;
+        PrioritySynchronisedQueueMetrics::Get().promoted.Add();
+        return overdue;
+      }
+    }
+    m_promoted_last=false;
+    return Scheduled(true);
+  }
+
+  // The lane the scheduling picks, charging its credit if take
+  std::size_t Scheduled(bool take){
+    if (m_scheduling==StrictPriority){
+      std::size_t i=0;
+      while (m_lanes[i]->queue.empty()) ++i;
+      return i;
+    }
+
+    // Stay on the lane in turn while it has credit and items, else pass the turn on
+    std::size_t turn=m_turn, credit=m_credit;
+    if (!credit || m_lanes[turn]->queue.empty()){
+      do { turn=(turn+1)%LANES; } while (m_lanes[turn]->queue.empty());
+      credit=m_lanes[turn]->weight;
+    }
+    if (take){ m_turn=turn; m_credit=credit-1; }
+    return turn;
+  }
+
+  // Move the next item out, m_size must be non-zero and m_mutex held
+  void Pop(T& result){
+    Lane& lane=*m_lanes[Next()];
+    Entry& front=lane.queue.front();
+    PrioritySynchronisedQueueMetrics& stats=PrioritySynchronisedQueueMetrics::Get();
+    stats.queued_ns.Record(front.Age());
+    stats.dequeued.Add();
+    result=std::move(front.value); lane.queue.pop_front(); --m_size;
+    if (lane.producers_waiting) lane.not_full.notify_one();
+  }
+
+  template <typename... Args>
+  bool Insert(std::size_t lane, bool block, const boost::system_time* deadline, Args&&... args){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    Lane& l=*m_lanes[lane];
+    if (!MakeRoom(lock, l, block, deadline)) return false;
+    Push(l, std::forward<Args>(args)...);
+
+    if (m_consumers_waiting) m_cond.notify_one();
+    return true;
+  }
+
+  bool Remove(T& result, bool block, const boost::system_time* deadline){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    if (!m_size){
+      if (!block) return false;
+      Wait(lock, m_cond, m_consumers_waiting, [this]{ return m_closed || m_size; }, deadline);
+      if (!m_size) return false;
+    }
+
+    Pop(result);
+    return true;
+  }
+
+  // Move up to max items to out in scheduling order, m_mutex must be held
+  template <typename OutputIterator>
+  std::size_t Take(OutputIterator out, std::size_t max){
+    std::size_t n=0;
+    T item;
+    for (; n<max && m_size; ++n){
+      Pop(item);
+      *out++=std::move(item);
+    }
+    return n;
+  }
+
+public:
+  // Every lane starts unbounded, BlockWhenFull, weight 1 and never aging
+  explicit PrioritySynchronisedQueue(LaneScheduling scheduling=StrictPriority, const Allocator& alloc=Allocator()):
+    m_scheduling(scheduling), m_aging(false), m_size(0), m_turn(0), m_credit(0), m_promoted(0),
+    m_promoted_last(false), m_closed(false), m_consumers_waiting(0){
+    for (std::size_t i=0; i<LANES; ++i) m_lanes[i].reset(new Lane(alloc));
+    m_credit=m_lanes[0]->weight;
+  }
+
+  // Bound lane to capacity items (0 unbounded) handled by policy when full.
+  // weight is its turn under WeightedPriority, at least 1. With a max_wait
+  // its oldest item goes first once it has waited that long.
+  // Call before the queue is shared between threads.
+  void SetLane(std::size_t lane, std::size_t capacity, OverflowPolicy policy=BlockWhenFull, std::size_t weight=1,
+               const boost::posix_time::time_duration& max_wait=boost::posix_time::time_duration()){
+    Lane& l=*m_lanes[lane];
+    l.capacity=capacity;
+    l.policy=policy;
+    l.weight=std::max<std::size_t>(1, weight);
+    l.max_wait=max_wait.is_negative() ? 0 : (boost::uint64_t)max_wait.total_nanoseconds();
+    if (capacity && capacity>l.queue.capacity()) l.queue.set_capacity(capacity);
+
+    m_aging=false;
+    for (std::size_t i=0; i<LANES; ++i) m_aging=m_aging || m_lanes[i]->max_wait;
+    if (lane==m_turn) m_credit=l.weight;
+  }
+
+  // Add data to lane and notify a consumer.
+  // Returns false if the queue is closed or the lane full under FailWhenFull.
+  bool Enqueue(std::size_t lane, const T& data){
+    return Insert(lane, true, 0, data);
+  }
+
+  bool Enqueue(std::size_t lane, T&& data){
+    return Insert(lane, true, 0, std::move(data));
+  }
+
+  template <typename... Args>
+  bool Emplace(std::size_t lane, Args&&... args){
+    return Insert(lane, true, 0, std::forward<Args>(args)...);
+  }
+
+  // Add data only if that doesn't need to wait for room
+  template <typename U>
+  bool TryEnqueue(std::size_t lane, U&& data){
+    return Insert(lane, false, 0, std::forward<U>(data));
+  }
+
+  // Add data, waiting at most timeout for room
+  template <typename U>
+  bool TimedEnqueue(std::size_t lane, U&& data, const boost::posix_time::time_duration& timeout){
+    const boost::system_time deadline=boost::get_system_time()+timeout;
+    return Insert(lane, true, &deadline, std::forward<U>(data));
+  }
+
+  // Add a batch to lane under one lock and wake consumers once.
+  // Under BlockWhenFull this waits for room as needed; returns how many were added.
+  template <typename InputIterator>
+  std::size_t EnqueueBulk(std::size_t lane, InputIterator first, InputIterator last){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    Lane& l=*m_lanes[lane];
+    std::size_t n=0;
+    for (; first!=last; ++first, ++n){
+      if (l.Full() && n && m_consumers_waiting) m_cond.notify_all(); // Let consumers make room
+      if (!MakeRoom(lock, l, true, 0)) break;
+      Push(l, *first);
+    }
+
+    if (m_consumers_waiting){
+      if (n==1) m_cond.notify_one();
+      else if (n>1) m_cond.notify_all();
+    }
+    return n;
+  }
+
+  template <typename Range>
+  std::size_t EnqueueBulk(std::size_t lane, const Range& range){
+    return EnqueueBulk(lane, boost::begin(range), boost::end(range));
+  }
+
+  // Get the next item by priority. Wait for data if not available.
+  // Throws QueueClosed once the queue is closed and drained.
+  T Dequeue(){
+    T result;
+    if (!Remove(result, true, 0)) throw QueueClosed();
+    return result;
+  }
+
+  // Get the next item, returns false once closed and drained
+  bool Dequeue(T& result){
+    return Remove(result, true, 0);
+  }
+
+  bool TryDequeue(T& result){
+    return Remove(result, false, 0);
+  }
+
+  bool TimedDequeue(T& result, const boost::posix_time::time_duration& timeout){
+    const boost::system_time deadline=boost::get_system_time()+timeout;
+    return Remove(result, true, &deadline);
+  }
+
+  // Get up to max items across the lanes, in the order single Dequeues would
+  // return them, under one lock. Waits up to timeout for the first item and
+  // returns how many were written to out (0 on timeout or closed and drained).
+  template <typename OutputIterator>
+  std::size_t DequeueBulk(OutputIterator out, std::size_t max, const boost::posix_time::time_duration& timeout){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    const boost::system_time deadline=boost::get_system_time()+timeout;
+    Wait(lock, m_cond, m_consumers_waiting, [this]{ return m_closed || m_size; }, &deadline);
+
+    return Take(out, max);
+  }
+
+  // Get everything currently queued without waiting
+  template <typename OutputIterator>
+  std::size_t DrainAll(OutputIterator out){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return Take(out, m_size);
+  }
+
+  // Refuse new items and wake every waiter. Items already queued can still
+  // be dequeued.
+  void Close(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    m_closed=true;
+    m_cond.notify_all();
+    for (std::size_t i=0; i<LANES; ++i) m_lanes[i]->not_full.notify_all();
+  }
+
+  bool IsClosed(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_closed;
+  }
+
+  // Items in all lanes
+  std::size_t Size(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_size;
+  }
+
+  std::size_t Size(std::size_t lane){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_lanes[lane]->queue.size();
+  }
+
+  // Items of lane discarded so far by DropOldest
+  std::size_t Dropped(std::size_t lane){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_lanes[lane]->dropped;
+  }
+
+  // Items dequeued ahead of the scheduling because their lane aged
+  std::size_t Promoted(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_promoted;
+  }
+};
+
+#endif // __PRIORITY_SYNCHRONISED_QUEUE__H_
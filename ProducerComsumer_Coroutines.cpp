@@ -0,0 +1,65 @@
+// Build with -std=c++20
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <iostream>
+#include <string>
+
+#include "CoroutineScheduler.h"
+#include "Channel.h"
+
+using namespace std;
+
+// Many producer -> channel -> consumer pipelines as coroutines on a few threads.
+//
+//   ProducerComsumer_Coroutines [PIPELINES] [MESSAGES_PER_PIPELINE]
+
+typedef Channel<int> IntChannel;
+
+boost::atomic<long> consumed(0);
+boost::atomic<long> checksum(0);
+
+// Produces count numbers into the channel, then closes it
+CoTask Producer(IntChannel& channel, int count){
+  for (int i=1; i<=count; ++i){
+    if (!co_await channel.Push(i)) co_return; // Closed
+  }
+  channel.Close();
+}
+
+// Consumes until the channel is closed and drained
+CoTask Consumer(IntChannel& channel){
+  long n=0, sum=0;
+  while (boost::optional<int> value=co_await channel.Pop()){
+    ++n; sum+=*value;
+  }
+  consumed+=n;
+  checksum+=sum;
+}
+
+int main(int argc, char* argv[]){
+  const int pipelines=argc>1 ? boost::lexical_cast<int>(argv[1]) : 10000;
+  const int messages=argc>2 ? boost::lexical_cast<int>(argv[2]) : 1000;
+
+  CoroutineScheduler scheduler;
+  cout<<pipelines<<" pipelines of "<<messages<<" messages on "<<scheduler.Size()<<" threads"<<endl;
+
+  const boost::posix_time::ptime start=boost::posix_time::microsec_clock::universal_time();
+
+  // Small bounded channels, so producers regularly suspend waiting for room
+  boost::ptr_vector<IntChannel> channels;
+  for (int i=0; i<pipelines; ++i){
+    channels.push_back(new IntChannel(scheduler, 8));
+    scheduler.Spawn(Consumer(channels.back()));
+    scheduler.Spawn(Producer(channels.back(), messages));
+  }
+  scheduler.Wait();
+
+  const double seconds=(boost::posix_time::microsec_clock::universal_time()-start).total_microseconds()/1e6;
+  const long expected=(long)pipelines*messages;
+  cout<<"Consumed "<<consumed<<" of "<<expected<<" messages in "<<seconds<<" s ("
+      <<(long)(consumed/seconds)<<" msgs/sec)"<<endl;
+  cout<<"Checksum "<<(checksum==(long)pipelines*((long)messages*(messages+1)/2) ? "ok" : "WRONG")<<endl;
+  return consumed==expected ? 0 : 1;
+}
@@ -1,45 +1,41 @@
 #include <boost/thread.hpp>
 #include <iostream>
+#include <string>
+
+#include "AsyncLogger.h"
+#include "Mailbox.h"
 
 using namespace std;
 
-boost::mutex m;
-boost::condition_variable con_producer;
-boost::condition_variable con_consumer;
-volatile bool ready_to_consume = false;
-volatile bool done = false;
-int counter(0);
+// The producer never waits for the consumer: it overwrites the mailbox and the
+// consumer always prints the latest counter, skipping values it was too slow for.
+Mailbox<int> mailbox;
+const int last = 100;
 
 
 void Consumer()
 {
-  boost::mutex::scoped_lock lock(m);
-  while(!done)
+  int counter = 0;
+  while(counter != last)
     {
-      if(!ready_to_consume)
+      if(!mailbox.WaitForUpdate(boost::posix_time::seconds(1)))
         {
-          con_consumer.wait(lock);
+          continue;
         }
-      cout << counter << endl;
-      ready_to_consume = false;
-      con_producer.notify_one();
+      counter = mailbox.Read();
+      AsyncLogger::Instance().LogLazy([counter](std::string& out){ out += std::to_string(counter); out += '\n'; });
+
+      // A slow consumer, some values will be conflated
+      boost::this_thread::sleep(boost::posix_time::millisec(50));
     }
 }
 
 void Producer()
 {
-  while(!done)
+  for(int counter = 1; counter <= last; ++counter)
     {
-      boost::this_thread::sleep(boost::posix_time::millisec(500));
-      boost::mutex::scoped_lock lock(m);
-      if(ready_to_consume)
-        {
-          con_producer.wait(lock);
-        }
-      ++counter;
-      ready_to_consume = true;
-      done = (counter == 10);
-      con_consumer.notify_one();
+      boost::this_thread::sleep(boost::posix_time::millisec(10));
+      mailbox.Publish(counter);
     }
 }
 
@@ -49,5 +45,7 @@ int main()
   boost::thread producer_pthread(Producer);
   consumer_pthread.join();
   producer_pthread.join();
+  AsyncLogger::Instance().Flush();
+  cout << "Published " << mailbox.Published() << ", conflated " << mailbox.Conflated() << endl;
   return 0;
 }
@@ -1,60 +1,41 @@
 #include <boost/thread.hpp>
-#include <boost/lexical_cast.hpp>
-#include <queue>
 #include <iostream>
 #include <string>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+
+#include "SynchronisedQueue.h"
+#include "MPMCQueue.h"
+#include "ThreadPool.h"
+#include "AsyncLogger.h"
+#include "ThreadPlacement.h"
 
 using namespace boost;
 using namespace boost::this_thread;
 using namespace std;
 
-// Queue class that has thread synchronisation
-template <typename T>
-class SynchronisedQueue{
-private:
-  std::queue<T> m_queue; // Use STL queue to store data
-  boost::mutex m_mutex; // The mutex to synchronise on
-  boost::condition_variable m_cond; // The condition to wait for
-
-public:
-  // Add data to the queue and notify others
-  void Enqueue(const T& data){
-    // Acquire lock on the queue
-    boost::unique_lock<boost::mutex> lock(m_mutex);
-
-    // Add the data to the queue
-    m_queue.push(data);
-
-    // Notify others that data is ready
-    m_cond.notify_one();
-
-  } // Lock is automatically released here
-
-    // Get data from the queue. Wait for data if not available
-  T Dequeue(){
-    // Acquire lock on the queue
-    boost::unique_lock<boost::mutex> lock(m_mutex);
-
-    // When there is no data, wait till someone fills it.
-    // Lock is automatically released in the wait and obtained
-    // again after the wait
-    while (m_queue.size()==0) m_cond.wait(lock);
+// The shared queue type, MPMCQueue is a lock-free drop-in. Its storage goes
+// on the NUMA node of the workers when THREAD_PLACEMENT pins them.
+typedef SynchronisedQueue<std::string, NumaAllocator<std::string> > MessageQueue;
 
-    // Retrieve the data from the queue
-    T result=m_queue.front(); m_queue.pop();
-    return result;
-  } // Lock is automatically released here
-};
+// Append a non-negative number without lexical_cast temporaries
+void AppendNumber(std::string& str, int value){
+  char digits[16];
+  int n=0;
+  do { digits[n++]='0'+value%10; value/=10; } while (value>0);
+  while (n>0) str+=digits[--n];
+}
 
 // Class that produces objects and puts them in a queue
 class Producer{
 private:
   int m_id; // The id of the producer
-  SynchronisedQueue<std::string>* m_queue; // The queue to use
+  MessageQueue* m_queue; // The queue to use
 
 public:
   // Constructor with id and the queue to use
-  Producer(int id, SynchronisedQueue<std::string>* queue){
+  Producer(int id, MessageQueue* queue){
     m_id=id;
     m_queue=queue;
   }
@@ -63,11 +44,20 @@ public:
   void operator () (){
     int data=0;
     while (true){
-      // Produce a string and store in the queue
-      std::string str = "Producer ["+boost::lexical_cast<std::string>(m_id+1)+"]: produced data "+boost::lexical_cast<std::string>(++data)+".";
-      m_queue->Enqueue(str);
-      str+="\n";
-      cout<<str;
+      // Produce a string in a recycled buffer and move it into the queue
+      std::string str = m_queue->AcquireBuffer();
+      str.clear();
+      str+="Producer ["; AppendNumber(str, m_id+1);
+      str+="]: produced data "; AppendNumber(str, ++data); str+=".";
+
+      if (!m_queue->Enqueue(std::move(str))) return; // Queue closed
+
+      // Log it, the formatting happens on the logger thread
+      const int id=m_id+1, n=data;
+      AsyncLogger::Instance().LogLazy([id, n](std::string& out){
+          out+="Producer ["; AppendNumber(out, id);
+          out+="]: produced data "; AppendNumber(out, n); out+=".\n";
+        });
 
       // Sleep one second
       boost::this_thread::sleep(boost::posix_time::seconds(1));
@@ -79,24 +69,32 @@ public:
 class Consumer{
 private:
   int m_id; // The id of the consumer
-  SynchronisedQueue<std::string>* m_queue; // The queue to use
+  MessageQueue* m_queue; // The queue to use
 
 public:
   // Constructor with id and the queue to use.
-  Consumer(int id, SynchronisedQueue<std::string>* queue){
+  Consumer(int id, MessageQueue* queue){
     m_id=id;
     m_queue=queue;
   }
 
   // The thread function reads data from the queue
   void operator () (){
+    std::vector<std::string> batch;
+    std::string line; // Reused for printing
     while (true){
-      // Get the data from the queue and print it
-      std::string str = "Consumer ["+boost::lexical_cast<std::string>(m_id+1)+"] consumed: ("+m_queue->Dequeue()+")\n";
-      cout<<str;
-
-      // Make sure we can be interrupted
-      boost::this_thread::interruption_point();
+      // Get a batch of data from the queue and print it
+      batch.clear();
+      if (m_queue->DequeueBulk(std::back_inserter(batch), 16, boost::posix_time::milliseconds(100))==0
+          && m_queue->IsClosed()) return; // Closed and drained
+      for (std::size_t i=0; i<batch.size(); ++i){
+        line="Consumer ["; AppendNumber(line, m_id+1);
+        line+="] consumed: ("; line+=batch[i]; line+=")\n";
+        AsyncLogger::Instance().Log(line);
+
+        // Hand the buffer back to the producers
+        m_queue->RecycleBuffer(std::move(batch[i]));
+      }
     }
   }
 };
@@ -109,9 +107,6 @@ int main(){
   // The number of producers/consumers
   int nrProducers, nrConsumers;
 
-  // The shared queue
-  SynchronisedQueue<std::string> queue;
-
   // Ask the number of producers
   cout<<"How many producers do you want? : ";
   cin>>nrProducers;
@@ -120,27 +115,37 @@ int main(){
   cout<<"How many consumers do you want? : ";
   cin>>nrConsumers;
 
-  // Create producers
-  boost::thread_group producers;
+  // Producers and consumers loop until the queue closes, so the pool needs
+  // a worker for each of them
+  std::size_t nrWorkers=std::max<std::size_t>(boost::thread::hardware_concurrency(), nrProducers+nrConsumers);
+  ThreadPool pool(nrWorkers);
+
+  // The shared queue, bounded so producers wait when consumers fall behind,
+  // recycling message buffers, near the first worker
+  MessageQueue queue(1024, BlockWhenFull, NumaAllocator<std::string>(pool.Placement().NodeFor(0)));
+  queue.EnableBufferPool(1024);
+
+  // Submit producers
   for (int i=0; i<nrProducers; i++)
     {
-      Producer p(i, &queue);
-      producers.create_thread(p);
+      pool.Submit(Producer(i, &queue));
     }
 
-  // Create consumers
-  boost::thread_group consumers;
+  // Submit consumers
   for (int i=0; i<nrConsumers; i++)
     {
-      Consumer c(i, &queue);
-      consumers.create_thread(c);
+      pool.Submit(Consumer(i, &queue));
     }
 
   //Wait for a while
   double wait(0.0);
   while(wait < 500000){ wait+=0.0001; };
 
-  // Interrupt the threads and stop them
-  producers.interrupt_all(); producers.join_all();
-  consumers.interrupt_all(); consumers.join_all();
+  // Close the queue: producers stop, consumers drain what is left and stop
+  queue.Close();
+  pool.Wait();
+  AsyncLogger::Instance().Flush();
+
+  // Queue depth, wait and park statistics when built with -DENABLE_METRICS
+  metrics::Registry::Instance().Dump(cout);
 }
@@ -0,0 +1,12 @@
+#ifndef __QUEUE_CLOSED__H_
+#define __QUEUE_CLOSED__H_
+
+#include <stdexcept>
+
+// Thrown by the value-returning Dequeue() of a closed and drained queue
+class QueueClosed : public std::runtime_error{
+public:
+  QueueClosed(): std::runtime_error("queue closed"){}
+};
+
+#endif // __QUEUE_CLOSED__H_
@@ -0,0 +1,93 @@
+#ifndef __SHARDED_COUNTER__H_
+#define __SHARDED_COUNTER__H_
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/assert.hpp>
+#include <cstddef>
+#include <sched.h>
+
+// A counter for hot paths that many threads, or processes, bump at once.
+//
+// A single atomic, or a counter under a mutex, puts every increment on one
+// cache line, which then bounces between cores: past a few threads the counter
+// is the bottleneck. Here the count is split over SLOTS cache-line padded
+// slots, an increment is a relaxed add on one of them and Value() sums them on
+// demand. A read sees every add that finished before it, but is not a snapshot
+// of one instant while adds are running.
+//
+// Which slot an add goes to is the Slot policy:
+//   PerThreadSlot  each thread its own slot, handed out round robin. Best in
+//                  one process: with no more threads than SLOTS none share.
+//   PerCpuSlot     the slot of the CPU the caller is running on. Right across
+//                  processes, whose thread numbering would collide, e.g. for a
+//                  counter in shared memory: two adds only meet on a slot when
+//                  one was preempted between picking it and adding.
+//
+// Slots are aligned to cache lines, so the counter must be too: fine for
+// statics, members and the stack, but before C++17 operator new ignores the
+// alignment, and so do managed segments. The counter holds no pointers and
+// needs no destructor, so it can live in shared memory as it is, placed on a
+// line of its own:
+//   typedef ShardedCounter<64, PerCpuSlot> SharedCounter;
+//   void* at=segment.allocate_aligned(sizeof(SharedCounter), COUNTER_CACHE_LINE_SIZE);
+//   SharedCounter* hits=new (at) SharedCounter;
+//   hits->Add();
+
+static const std::size_t COUNTER_CACHE_LINE_SIZE = 64;
+
+struct PerThreadSlot{
+  static std::size_t Index(){
+    static boost::atomic<std::size_t> next(0);
+    static thread_local std::size_t index=next.fetch_add(1, boost::memory_order_relaxed);
+    return index;
+  }
+};
+
+struct PerCpuSlot{
+  static std::size_t Index(){
+    const int cpu=sched_getcpu();
+    return cpu>=0 ? (std::size_t)cpu : PerThreadSlot::Index();
+  }
+};
+
+template <std::size_t SLOTS=64, typename Slot=PerThreadSlot>
+class ShardedCounter{
+private:
+  // One slot per line: padding alone leaves a slot straddling two lines
+  // whenever the array doesn't start on one
+  struct alignas(COUNTER_CACHE_LINE_SIZE) Padded{
+    boost::atomic<boost::uint64_t> value;
+  };
+  static_assert(sizeof(Padded)==COUNTER_CACHE_LINE_SIZE, "a slot must fill one cache line");
+  Padded m_slots[SLOTS];
+
+  boost::atomic<boost::uint64_t>& Mine(){ return m_slots[Slot::Index()%SLOTS].value; }
+
+public:
+  ShardedCounter(){
+    BOOST_ASSERT(reinterpret_cast<std::size_t>(this)%COUNTER_CACHE_LINE_SIZE==0);
+    for (std::size_t i=0; i<SLOTS; ++i) m_slots[i].value.store(0, boost::memory_order_relaxed);
+  }
+
+  void Add(boost::uint64_t n=1){ Mine().fetch_add(n, boost::memory_order_relaxed); }
+
+  // The sum wraps like an unsigned add, so the counter can go down as a gauge
+  void Sub(boost::uint64_t n=1){ Mine().fetch_sub(n, boost::memory_order_relaxed); }
+
+  boost::uint64_t Value() const {
+    boost::uint64_t sum=0;
+    for (std::size_t i=0; i<SLOTS; ++i) sum+=m_slots[i].value.load(boost::memory_order_relaxed);
+    return sum;
+  }
+
+  // Value() as a signed number, for gauges
+  boost::int64_t SignedValue() const { return (boost::int64_t)Value(); }
+
+  // Zero every slot. Adds racing with it may survive or be lost.
+  void Reset(){
+    for (std::size_t i=0; i<SLOTS; ++i) m_slots[i].value.store(0, boost::memory_order_relaxed);
+  }
+};
+
+#endif // __SHARDED_COUNTER__H_
@@ -0,0 +1,107 @@
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#include <boost/scope_exit.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+#include "../ShardedCounter.h"
+
+// Processes counting into shared memory: the same increments on a counter under
+// an interprocess mutex and on a ShardedCounter with per-CPU slots.
+
+#define SHARED_MEMORY_NAME "PlayCounters"
+
+//at the start of the mapping, which is page aligned, as the counter's slots need
+struct shared_counters {
+  boost::interprocess::interprocess_mutex mutex;
+  boost::uint64_t locked;
+  ShardedCounter<64, PerCpuSlot> sharded;
+
+  shared_counters()
+    : locked(0)
+  {
+  }
+};
+
+void report(const std::string & which, long increments, const boost::posix_time::ptime & start)
+{
+  boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+  std::cout << which << ": " << increments << " increments in " << elapsed.total_milliseconds() << " ms ("
+            << (long)(increments * 1e6 / (elapsed.total_microseconds() + 1)) << " increments/s)" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  using namespace boost::interprocess;
+
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " parent | child [INCREMENTS] | read" << std::endl;
+    return 1;
+  }
+
+  const std::string which = argv[1];
+  if (which == "parent") {
+    shared_memory_object::remove(SHARED_MEMORY_NAME);
+    shared_memory_object shm(create_only, SHARED_MEMORY_NAME, read_write);
+
+    BOOST_SCOPE_EXIT(void) {
+      shared_memory_object::remove(SHARED_MEMORY_NAME);
+    } BOOST_SCOPE_EXIT_END;
+
+    shm.truncate(sizeof (shared_counters));
+    mapped_region region(shm, read_write);
+    new (region.get_address()) shared_counters;
+
+    std::cout << "sleep 60s" << std::endl;
+    sleep(60);
+    return 0;
+  }
+
+  shared_memory_object shm(open_only, SHARED_MEMORY_NAME, read_write);
+  mapped_region region(shm, read_write);
+  shared_counters & counters = *static_cast<shared_counters *>(region.get_address());
+
+  if (which == "child") {
+    const long increments = argc > 2 ? boost::lexical_cast<long>(argv[2]) : 10000000;
+
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    for (long i = 0; i < increments; ++i) {
+      scoped_lock<interprocess_mutex> lock(counters.mutex);
+      ++counters.locked;
+    }
+    report("mutex", increments, start);
+
+    start = boost::posix_time::microsec_clock::universal_time();
+    for (long i = 0; i < increments; ++i) {
+      counters.sharded.Add();
+    }
+    report("sharded", increments, start);
+  } else if (which == "read") {
+    boost::uint64_t locked;
+    {
+      scoped_lock<interprocess_mutex> lock(counters.mutex);
+      locked = counters.locked;
+    }
+    std::cout << "mutex: " << locked << ", sharded: " << counters.sharded.Value() << std::endl;
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+./a.out parent &
+./a.out child &
+./a.out child &
+./a.out child &
+./a.out child
+./a.out read
+
+*/
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "ShmGenerationMap.h"
+
+#define MAP_NAME "PlayGenerations"
+
+using namespace shm_generation_map;
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " publish [ENTRIES] [THREADS] | reader [SECONDS] | remove" << std::endl;
+    return 1;
+  }
+
+  const std::string which = argv[1];
+
+  if (which == "remove") {
+    ShmGenerationMap::remove(MAP_NAME);
+    return 0;
+  }
+
+  ShmGenerationMap map(MAP_NAME);
+
+  if (which == "publish") {
+    //every value starts with the generation it was built for
+    const std::size_t entries = argc > 2 ? boost::lexical_cast<std::size_t>(argv[2]) : 1000000;
+    const std::size_t threads = argc > 3 ? boost::lexical_cast<std::size_t>(argv[3]) : 4;
+    const std::string tag = boost::lexical_cast<std::string>(map.generation_number() + 1) + ":";
+
+    std::vector<std::pair<std::string, std::string> > input;
+    input.reserve(entries);
+    for (std::size_t i = 0; i < entries; ++i) {
+      const std::string key = "key" + boost::lexical_cast<std::string>(i);
+      input.push_back(std::make_pair(key, tag + std::string(i % 200, 'v')));
+    }
+
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    const boost::uint64_t number = map.publish(input.begin(), input.end(), threads);
+    std::cout << "published generation " << number << ": " << entries << " entries in "
+              << (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds() << " ms" << std::endl;
+  } else if (which == "reader") {
+    //look keys up for a while, reporting every generation switch
+    const long seconds = argc > 2 ? boost::lexical_cast<long>(argv[2]) : 60;
+    const boost::posix_time::ptime end = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::seconds(seconds);
+    boost::uint64_t generation = 0;
+    long lookups = 0, missing = 0;
+    generation_view view;
+    for (long i = 0; boost::posix_time::microsec_clock::universal_time() < end; ++i) {
+      for (int j = 0; j < 1000; ++j, ++lookups) {
+        if (!map.find_view("key" + boost::lexical_cast<std::string>((i * 1000 + j) % 1000000), view)) {
+          ++missing;
+        }
+      }
+      if (map.generation_number() != generation) {
+        generation = map.generation_number();
+        std::cout << "reader: now on generation " << generation << " after " << lookups << " lookups" << std::endl;
+      }
+    }
+    std::cout << "reader: " << lookups << " lookups, " << missing << " missing" << std::endl;
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+./a.out publish
+./a.out reader 60 &
+./a.out reader 60 &
+./a.out publish 1000000 8
+./a.out publish 1000000 8
+./a.out remove
+
+*/
@@ -10,6 +10,8 @@
 #include <boost/interprocess/sync/sharable_lock.hpp>
 #include <boost/interprocess/sync/upgradable_lock.hpp>
 
+#include "ShmFutex.h"
+
 // http://stackoverflow.com/questions/12439099/interprocess-reader-writer-lock-with-boost/
 
 #define SHARED_MEMORY_NAME "SO12439099-MySharedMemory"
@@ -20,6 +22,7 @@ private:
 
   mutable upgradable_mutex_type mutex;
   volatile int counter;
+  shm_futex::ShmEventCount changed;
 
 public:
   shared_data()
@@ -35,6 +38,15 @@ public:
   void set_counter(int counter) {
     boost::interprocess::scoped_lock<upgradable_mutex_type> lock(mutex);
     this->counter = counter;
+    lock.unlock();
+    changed.notify_all();
+  }
+
+  // Block until the counter is no longer seen, instead of spinning on count()
+  int wait_for_change(int seen) {
+    int now = seen;
+    changed.await([&]{ return (now = count()) != seen; });
+    return now;
   }
 };
 
@@ -75,8 +87,11 @@ int main(int argc, char *argv[])
     mapped_region region(shm, read_write);
     shared_data& d = *static_cast<shared_data *>(region.get_address());
 
-    for (int i = 0; i < 100000; ++i) {
-      std::cout << "reader_child: " << d.count() << std::endl;
+    // Follow the writer until it publishes its last value
+    int seen = d.count();
+    while (seen != 100000 - 1) {
+      seen = d.wait_for_change(seen);
+      std::cout << "reader_child: " << seen << std::endl;
     }
   } else if (which == "writer_child") {
     shared_memory_object shm(open_only, SHARED_MEMORY_NAME, read_write);
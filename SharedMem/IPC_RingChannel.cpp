@@ -0,0 +1,122 @@
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#include <boost/scope_exit.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "ShmRingBuffer.h"
+
+#define SHARED_MEMORY_NAME "PlayRingChannel"
+
+using namespace shm_ring_buffer;
+
+static const std::size_t RING_CAPACITY = 1 << 20; //bytes for spsc, slots/16 for mpmc
+static const boost::uint32_t MAX_RECORD = 48;
+static const std::size_t BATCH = 64;
+
+struct counting_consumer {
+  long & received;
+  void operator()(const char *, boost::uint32_t) const { ++received; }
+};
+
+template<class Ring>
+void produce(Ring & ring, long messages)
+{
+  char payload[MAX_RECORD];
+  RecordRef batch[BATCH];
+  long sent = 0;
+  while(sent < messages){
+    std::size_t n = 0;
+    for(; n < BATCH && sent + (long)n < messages; ++n){
+      batch[n].data = payload;
+      batch[n].len = sizeof(long);
+      *reinterpret_cast<long *>(payload) = sent + n;
+    }
+
+    std::size_t done = 0;
+    while(done < n){
+      done += ring.try_push_bulk(batch + done, n - done);
+    }
+    sent += n;
+  }
+}
+
+template<class Ring>
+void consume(Ring & ring, long messages)
+{
+  long received = 0;
+  counting_consumer f = { received };
+  while(received < messages){
+    ring.consume(f, BATCH);
+  }
+}
+
+template<class Ring>
+int run(const std::string & which, long messages, std::size_t capacity)
+{
+  using namespace boost::interprocess;
+
+  if (which == "parent") {
+    ShmRingChannel<Ring>::remove(SHARED_MEMORY_NAME);
+    ShmRingChannel<Ring> channel(create_only, SHARED_MEMORY_NAME, capacity, MAX_RECORD);
+
+    BOOST_SCOPE_EXIT(void) {
+      ShmRingChannel<Ring>::remove(SHARED_MEMORY_NAME);
+    } BOOST_SCOPE_EXIT_END;
+
+    std::cout<<"sleep 60s"<<std::endl;
+    sleep(60);
+    return 0;
+  }
+
+  ShmRingChannel<Ring> channel(open_only, SHARED_MEMORY_NAME);
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  if (which == "producer") {
+    produce(channel.ring(), messages);
+  } else if (which == "consumer") {
+    consume(channel.ring(), messages);
+  } else {
+    return 1;
+  }
+
+  boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+  std::cout << which << ": " << messages << " messages in " << elapsed.total_milliseconds() << " ms ("
+            << (long)(messages * 1e6 / (elapsed.total_microseconds() + 1)) << " msg/s)" << std::endl;
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " WHICH(parent|producer|consumer) spsc|mpmc [MESSAGES]" << std::endl;
+    return 1;
+  }
+
+  const std::string which = argv[1];
+  const std::string kind = argv[2];
+  const long messages = argc > 3 ? boost::lexical_cast<long>(argv[3]) : 10000000;
+
+  if (kind == "spsc") {
+    return run<SpscRing>(which, messages, RING_CAPACITY);
+  } else if (kind == "mpmc") {
+    return run<MpmcRing>(which, messages, RING_CAPACITY / 16);
+  }
+  return 1;
+}
+
+
+/*
+./a.out parent spsc &
+./a.out consumer spsc &
+./a.out producer spsc
+
+./a.out parent mpmc &
+./a.out consumer mpmc 5000000 &
+./a.out consumer mpmc 5000000 &
+./a.out producer mpmc 5000000 &
+./a.out producer mpmc 5000000 &
+
+*/
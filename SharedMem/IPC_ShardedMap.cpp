@@ -0,0 +1,121 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <ctime>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "ShmShardedMap.h"
+
+using namespace shm_sharded_map;
+
+static const std::size_t SHARDS = 16;
+static const int SHARD_BYTES = 64 << 20;
+
+void report(const std::string & which, std::size_t entries, const boost::posix_time::ptime & start)
+{
+  boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+  std::cout << which << ": " << entries << " entries in " << elapsed.total_milliseconds() << " ms ("
+            << (long)(entries * 1e6 / (elapsed.total_microseconds() + 1)) << " entries/s)" << std::endl;
+}
+
+void print_inspect(const std::string & name)
+{
+  map_info info;
+  if (!ShmShardedMap::inspect(name, info)) {
+    std::cout << name << ": not registered" << std::endl;
+    return;
+  }
+  const std::time_t created = (std::time_t)info.entry.created;
+  std::cout << name << ": " << info.entry.shards << " shards of " << info.entry.shard_bytes << " bytes, "
+            << info.entries() << " entries, created by pid " << info.entry.creator << " on " << std::ctime(&created);
+  for (std::size_t i = 0; i < info.shards.size(); ++i) {
+    const shard_info & shard = info.shards[i];
+    std::cout << "  " << std::left << std::setw(24) << shard.segment << std::right;
+    if (!shard.exists) { std::cout << "missing" << std::endl; continue; }
+    std::cout << std::setw(10) << shard.entries << " entries " << std::setw(12) << shard.free_bytes << " bytes free"
+              << " (" << shard.recoveries << " recoveries)" << std::endl;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " load NAME [ENTRIES] [THREADS] [RANK RANKS]" << std::endl
+              << "       " << argv[0] << " get NAME KEY" << std::endl
+              << "       " << argv[0] << " list | inspect NAME | remove NAME" << std::endl;
+    return 1;
+  }
+
+  const std::string which = argv[1];
+
+  if (which == "list") {
+    const std::vector<map_entry> maps = ShmShardedMap::list();
+    for (std::size_t i = 0; i < maps.size(); ++i) {
+      print_inspect(maps[i].name);
+    }
+    return 0;
+  }
+
+  if (argc < 3) { return 1; }
+  const std::string name = argv[2];
+
+  if (which == "inspect") {
+    print_inspect(name);
+  } else if (which == "remove") {
+    std::cout << (ShmShardedMap::remove(name) ? "removed " : "not registered: ") << name << std::endl;
+  } else if (which == "get") {
+    if (argc < 4) { return 1; }
+    //opening an unregistered map would create and register all its segments
+    map_entry entry;
+    if (!ShmShardedMap::registered(name, entry)) {
+      std::cout << "not registered: " << name << std::endl;
+      return 1;
+    }
+    ShmShardedMap map(name, SHARDS, SHARD_BYTES);
+    value_view view;
+    if (map.find_view(argv[3], view)) {
+      std::cout << view.str() << std::endl;
+    } else {
+      std::cout << "not found" << std::endl;
+    }
+  } else if (which == "load") {
+    const std::size_t entries = argc > 3 ? boost::lexical_cast<std::size_t>(argv[3]) : 1000000;
+    const std::size_t threads = argc > 4 ? boost::lexical_cast<std::size_t>(argv[4]) : 4;
+    const std::size_t rank = argc > 6 ? boost::lexical_cast<std::size_t>(argv[5]) : 0;
+    const std::size_t ranks = argc > 6 ? boost::lexical_cast<std::size_t>(argv[6]) : 1;
+
+    std::vector<std::pair<std::string, std::string> > input;
+    input.reserve(entries);
+    for (std::size_t i = 0; i < entries; ++i) {
+      const std::string key = "key" + boost::lexical_cast<std::string>(i);
+      input.push_back(std::make_pair(key, key + ":" + std::string(i % 200, 'v')));
+    }
+
+    ShmShardedMap map(name, SHARDS, SHARD_BYTES);
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    const std::size_t loaded = map.bulk_load(input.begin(), input.end(), threads, rank, ranks);
+    report(which, loaded, start);
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+./a.out load Prices 2000000 1
+./a.out remove Prices
+./a.out load Prices 2000000 8
+./a.out list
+./a.out get Prices key12345
+
+//two processes loading one map, each its half of the shards
+./a.out remove Prices
+./a.out load Prices 2000000 4 0 2 &
+./a.out load Prices 2000000 4 1 2
+./a.out inspect Prices
+
+*/
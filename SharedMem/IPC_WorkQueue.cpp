@@ -0,0 +1,126 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <signal.h>
+#include <unistd.h>
+
+#include <boost/scope_exit.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "ShmWorkQueue.h"
+
+#define SHARED_MEMORY_NAME "PlayWorkQueue"
+#define QUEUE_NAME "Jobs"
+
+using namespace shm_work_queue;
+
+static const std::size_t SLOTS = 65536;
+static const boost::uint32_t MAX_PAYLOAD = 256;
+
+//Job: its number followed by a variable amount of filler derived from it
+boost::uint32_t make_job(char * buffer, long number)
+{
+  const boost::uint32_t len = sizeof(long) + (boost::uint32_t)(number % (MAX_PAYLOAD - sizeof(long) + 1));
+  std::memcpy(buffer, &number, sizeof(long));
+  std::memset(buffer + sizeof(long), (char)number, len - sizeof(long));
+  return len;
+}
+
+bool check_job(const job & j)
+{
+  long number;
+  char expected[MAX_PAYLOAD];
+  if(j.len < sizeof(long)){ return false; }
+  std::memcpy(&number, j.data, sizeof(long));
+  return make_job(expected, number) == j.len && std::memcmp(expected, j.data, j.len) == 0;
+}
+
+void report(const std::string & which, long jobs, const boost::posix_time::ptime & start)
+{
+  boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+  std::cout << which << ": " << jobs << " jobs in " << elapsed.total_milliseconds() << " ms ("
+            << (long)(jobs * 1e6 / (elapsed.total_microseconds() + 1)) << " jobs/s)" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " WHICH(parent|producer|worker) [JOBS] [CRASH_AFTER]" << std::endl;
+    return 1;
+  }
+
+  const std::string which = argv[1];
+  const long jobs = argc > 2 ? boost::lexical_cast<long>(argv[2]) : 1000000;
+  const long crash_after = argc > 3 ? boost::lexical_cast<long>(argv[3]) : 0;
+
+  if (which == "parent") {
+    ShmWorkQueue::remove(SHARED_MEMORY_NAME);
+    ShmWorkQueue jobs_queue(SHARED_MEMORY_NAME, QUEUE_NAME, SLOTS, MAX_PAYLOAD);
+
+    BOOST_SCOPE_EXIT(void) {
+      ShmWorkQueue::remove(SHARED_MEMORY_NAME);
+    } BOOST_SCOPE_EXIT_END;
+
+    //supervise: hand the jobs of crashed workers to the live ones
+    std::cout<<"recover for 60s"<<std::endl;
+    for (int i = 0; i < 600; ++i) {
+      usleep(100000);
+      const std::size_t requeued = jobs_queue->recover();
+      if (requeued) {
+        std::cout << "parent: requeued " << requeued << " jobs of dead workers" << std::endl;
+      }
+    }
+    return 0;
+  }
+
+  ShmWorkQueue jobs_queue(SHARED_MEMORY_NAME, QUEUE_NAME);
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  if (which == "producer") {
+    char buffer[MAX_PAYLOAD];
+    for (long i = 0; i < jobs; ++i) {
+      const boost::uint32_t len = make_job(buffer, i);
+      while (!jobs_queue->submit(buffer, len, boost::posix_time::seconds(1))) {
+        std::cerr << "producer: queue full" << std::endl;
+      }
+    }
+    report(which, jobs, start);
+  } else if (which == "worker") {
+    //stops after jobs acks or a second without work
+    long done = 0, redelivered = 0, corrupt = 0;
+    job j;
+    while (done < jobs && jobs_queue->claim(j, boost::posix_time::seconds(1))) {
+      if (crash_after && done == crash_after) {
+        std::cout << "worker: crashing while holding a job" << std::endl;
+        kill(getpid(), SIGKILL);
+      }
+      if (j.attempts > 1) { ++redelivered; }
+      if (!check_job(j)) { ++corrupt; }
+      jobs_queue->ack(j);
+      ++done;
+    }
+    report(which, done, start);
+    std::cout << which << ": " << redelivered << " redelivered, " << corrupt << " corrupt" << std::endl;
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+./a.out parent &
+./a.out worker &
+./a.out worker &
+./a.out producer 5000000 &
+./a.out producer 5000000
+
+//crash recovery: the first worker dies holding its 11th job, the parent requeues it
+//and the second worker reports it as redelivered
+./a.out parent &
+./a.out producer 1000
+./a.out worker 100 10
+./a.out worker
+
+*/
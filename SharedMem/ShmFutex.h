@@ -0,0 +1,163 @@
+#ifndef __SHM_FUTEX__H_
+#define __SHM_FUTEX__H_
+
+#include <cerrno>
+#include <climits>
+#include <ctime>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+//Wait/notify for state that lives in shared memory, built on Linux futexes.
+//
+//ShmEventCount is an event count: waiters spin on their predicate for a bounded,
+//adaptive number of iterations and then park in the kernel on a 32-bit epoch.
+//notify_*() only enters the kernel when somebody is parked, so a notifier with no
+//waiters pays one fence and one load.
+//
+//The futex is not FUTEX_PRIVATE, so the object works from any mapping of the
+//same memory in any process.
+
+namespace shm_futex {
+
+  inline int futex_wait(boost::atomic<boost::uint32_t> * addr, boost::uint32_t expected, const struct timespec * timeout){
+    return syscall(SYS_futex, reinterpret_cast<boost::uint32_t *>(addr), FUTEX_WAIT, expected, timeout, 0, 0);
+  }
+
+  inline int futex_wake(boost::atomic<boost::uint32_t> * addr, int count){
+    return syscall(SYS_futex, reinterpret_cast<boost::uint32_t *>(addr), FUTEX_WAKE, count, 0, 0, 0);
+  }
+
+  inline void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  inline boost::int64_t monotonic_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (boost::int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  class ShmEventCount {
+  private:
+    static const boost::uint32_t MIN_SPIN = 16;
+    static const boost::uint32_t MAX_SPIN = 4096; //a few microseconds of pause instructions
+
+    boost::atomic<boost::uint32_t> m_epoch;   //futex word
+    boost::atomic<boost::uint32_t> m_waiters; //parked or about to park
+    boost::atomic<boost::uint32_t> m_spin;    //current spin budget, shared by all waiters
+
+    static bool can_spin(){
+      static const bool multicore = boost::thread::hardware_concurrency() > 1;
+      return multicore;
+    }
+
+    //Park until notified, the deadline (monotonic us, <0 for none) passes or a spurious wakeup
+    void park(boost::uint32_t key, boost::int64_t deadline_us){
+      if(deadline_us < 0){
+        futex_wait(&m_epoch, key, 0);
+        return;
+      }
+
+      boost::int64_t left = deadline_us - monotonic_us();
+      if(left <= 0){ return; }
+      struct timespec ts;
+      ts.tv_sec = left / 1000000;
+      ts.tv_nsec = (left % 1000000) * 1000;
+      futex_wait(&m_epoch, key, &ts);
+    }
+
+    template<class Pred>
+    bool await_until(Pred pred, boost::int64_t deadline_us){
+      //spin phase: grow the budget when spinning pays off, shrink it when we had to park
+      if(can_spin()){
+        const boost::uint32_t budget = m_spin.load(boost::memory_order_relaxed);
+        for(boost::uint32_t i = 0; i < budget; ++i){
+          if(pred()){
+            if(budget < MAX_SPIN){ m_spin.store(budget + budget / 8 + 1, boost::memory_order_relaxed); }
+            return true;
+          }
+          cpu_relax();
+        }
+        if(budget > MIN_SPIN){ m_spin.store(budget - budget / 8, boost::memory_order_relaxed); }
+      }
+
+      //park phase
+      for(;;){
+        const boost::uint32_t key = prepare_wait();
+        if(pred()){
+          cancel_wait();
+          return true;
+        }
+        if(deadline_us >= 0 && monotonic_us() >= deadline_us){
+          cancel_wait();
+          return pred();
+        }
+        wait(key, deadline_us);
+      }
+    }
+
+  public:
+    ShmEventCount(): m_epoch(0), m_waiters(0), m_spin(MIN_SPIN * 8){}
+
+    /*Low level protocol*/
+    //key = prepare_wait(); if(condition){ cancel_wait(); } else { wait(key); }
+    boost::uint32_t prepare_wait(){
+      m_waiters.fetch_add(1, boost::memory_order_seq_cst);
+      return m_epoch.load(boost::memory_order_seq_cst);
+    }
+
+    void cancel_wait(){
+      m_waiters.fetch_sub(1, boost::memory_order_relaxed);
+    }
+
+    void wait(boost::uint32_t key, boost::int64_t deadline_us = -1){
+      if(m_epoch.load(boost::memory_order_acquire) == key){
+        park(key, deadline_us);
+      }
+      m_waiters.fetch_sub(1, boost::memory_order_relaxed);
+    }
+
+    /*Wait*/
+    //Return once pred() holds
+    template<class Pred>
+    void await(Pred pred){
+      await_until(pred, -1);
+    }
+
+    //Return pred(), giving up after timeout
+    template<class Pred>
+    bool await(Pred pred, const boost::posix_time::time_duration & timeout){
+      return await_until(pred, monotonic_us() + timeout.total_microseconds());
+    }
+
+    /*Notify*/
+    //Call after making the awaited state visible
+    void notify_one(){
+      boost::atomic_thread_fence(boost::memory_order_seq_cst);
+      if(m_waiters.load(boost::memory_order_relaxed) == 0){ return; }
+      m_epoch.fetch_add(1, boost::memory_order_release);
+      futex_wake(&m_epoch, 1);
+    }
+
+    void notify_all(){
+      boost::atomic_thread_fence(boost::memory_order_seq_cst);
+      if(m_waiters.load(boost::memory_order_relaxed) == 0){ return; }
+      m_epoch.fetch_add(1, boost::memory_order_release);
+      futex_wake(&m_epoch, INT_MAX);
+    }
+  };
+
+}//namespace
+
+#endif // __SHM_FUTEX__H_
@@ -0,0 +1,478 @@
+#ifndef __SHM_GENERATION_MAP__H_
+#define __SHM_GENERATION_MAP__H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+#include "ShmFutex.h"
+#include "ShmProcess.h"
+#include "ShmRobustMutex.h"
+#include "ShmStringHashMap.h"
+
+//A read-only string map replaced a whole generation at a time.
+//
+//A reload that inserts millions of keys into a live map holds its lock for
+//hours and leaves it half old, half new. Here the map is rebuilt off to the
+//side instead: publish() builds a complete generation in a segment of its own,
+//"<name>.<generation>", that no reader knows about yet, then makes it current
+//by bumping one number in the small control segment "<name>".
+//
+//A generation is never written once published, so readers need no lock at all:
+//they map it read-only and look keys up directly. Each thread remembers the
+//generation it last used and checks the control segment's number on every
+//lookup, moving to a new generation on its first lookup after the flip.
+//
+//The builder hashes the input into partitions, each its own table presized for
+//its keys so it never rehashes, and fills them from several threads at once.
+//Each partition allocates from an arena of its own, carved from the segment a
+//chunk at a time, so the threads only meet on the segment's allocator lock
+//once per chunk instead of for every string. The segment is sized from the
+//input up front, and built again bigger in the rare case that was not enough.
+//
+//Publishing unlinks the old generation's segment. The memory stays mapped, and
+//valid, in every process still using it, and goes back to the system when the
+//last of them moves on (or drops its generation_views into it).
+
+namespace shm_generation_map {
+
+  using shm_string_hashmap::view_hash;
+  typedef shm_robust::managed_shared_memory ManagedSegment;
+
+  static const std::size_t MAX_PARTITIONS = 256;
+
+  //Bump allocation for one partition's table, in chunks from the segment.
+  //A generation is never written once built, so nothing is freed on its own:
+  //the memory goes with the segment.
+  class arena {
+  private:
+    boost::interprocess::offset_ptr<ManagedSegment::segment_manager> m_segment;
+    boost::interprocess::offset_ptr<char> m_next;
+    boost::interprocess::offset_ptr<char> m_end;
+    const std::size_t m_chunk;
+
+  public:
+    arena(ManagedSegment::segment_manager * segment, std::size_t chunk):
+      m_segment(segment), m_next(0), m_end(0), m_chunk(chunk){}
+
+    //Throws bad_alloc when the segment is full
+    void * allocate(std::size_t bytes, std::size_t align){
+      char * at = m_next.get();
+      std::size_t pad = at ? (align - reinterpret_cast<std::size_t>(at) % align) % align : 0;
+      if(!at || static_cast<std::size_t>(m_end.get() - at) < pad + bytes){
+        const std::size_t size = std::max(m_chunk, bytes + align);
+        at = static_cast<char *>(m_segment->allocate(size)); //the only locked step
+        m_end = at + size;
+        pad = (align - reinterpret_cast<std::size_t>(at) % align) % align;
+      }
+      m_next = at + pad + bytes;
+      return at + pad;
+    }
+  };
+
+  template<class T>
+  class arena_allocator {
+  private:
+    boost::interprocess::offset_ptr<arena> m_arena;
+
+  public:
+    typedef T value_type;
+    typedef boost::interprocess::offset_ptr<T> pointer;
+    typedef boost::interprocess::offset_ptr<const T> const_pointer;
+    typedef T & reference;
+    typedef const T & const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    template<class U> struct rebind { typedef arena_allocator<U> other; };
+
+    explicit arena_allocator(arena * a): m_arena(a){}
+    template<class U> arena_allocator(const arena_allocator<U> & other): m_arena(other.get_arena()){}
+
+    pointer allocate(size_type n){
+      return pointer(static_cast<T *>(m_arena->allocate(n * sizeof(T), boost::alignment_of<T>::value)));
+    }
+    void deallocate(const pointer &, size_type){}
+    size_type max_size() const { return size_type(-1) / sizeof(T); }
+
+    arena * get_arena() const { return m_arena.get(); }
+    template<class U> bool operator==(const arena_allocator<U> & other) const { return m_arena == other.get_arena(); }
+    template<class U> bool operator!=(const arena_allocator<U> & other) const { return m_arena != other.get_arena(); }
+  };
+
+  typedef boost::interprocess::basic_string<char, std::char_traits<char>, arena_allocator<char> > GenerationString;
+  typedef std::pair<const GenerationString, GenerationString> GenerationValue;
+  typedef boost::unordered_map<GenerationString, GenerationString, boost::hash<GenerationString>,
+                               std::equal_to<GenerationString>, arena_allocator<GenerationValue> > GenerationTable;
+
+  struct view_equal {
+    bool operator()(const boost::string_view & a, const GenerationString & b) const
+    { return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size()) == 0; }
+  };
+
+  //Lives in the control segment
+  struct generation_control {
+    shm_robust::robust_mutex<PTHREAD_MUTEX_NORMAL> mutex; //publishers
+    boost::atomic<boost::uint64_t> current;  //0 until the first publish
+    boost::uint64_t last;                    //highest generation handed out
+    boost::uint64_t building;                //being built, 0 if none
+    boost::uint32_t builder;                 //its pid
+    shm_futex::ShmEventCount published;
+
+    generation_control(): current(0), last(0), building(0), builder(0){}
+  };
+
+  //Lives in a generation's segment
+  struct generation_header {
+    boost::uint64_t number;
+    boost::uint64_t entries;
+    boost::uint32_t partitions;
+    boost::interprocess::offset_ptr<GenerationTable> tables[MAX_PARTITIONS];
+  };
+
+  //A generation mapped into this process
+  class generation {
+  private:
+    ManagedSegment m_segment;
+    const generation_header * m_header;
+
+  public:
+    //Throws interprocess_exception if the segment is gone
+    explicit generation(const std::string & segment_name):
+      m_segment(boost::interprocess::open_read_only, segment_name.c_str()),
+      m_header(m_segment.find<generation_header>("generation").first){
+      if(!m_header){
+        throw boost::interprocess::interprocess_exception("ShmGenerationMap: generation segment without a header");
+      }
+    }
+
+    boost::uint64_t number() const { return m_header->number; }
+    std::size_t size() const { return m_header->entries; }
+
+    const GenerationString * find(const boost::string_view & key) const {
+      const GenerationTable & table = *m_header->tables[view_hash()(key) % m_header->partitions];
+      GenerationTable::const_iterator it = table.find(key, view_hash(), view_equal());
+      return it == table.end() ? 0 : &it->second;
+    }
+  };
+
+  //A value read in place from a generation, which stays mapped while the view
+  //holds it. Values never change, so there is nothing to pin.
+  class generation_view {
+  private:
+    boost::shared_ptr<const generation> m_generation;
+    const char * m_data;
+    std::size_t m_size;
+
+    friend class ShmGenerationMap;
+
+  public:
+    generation_view(): m_data(0), m_size(0){}
+
+    void reset(){
+      m_generation.reset();
+      m_data = 0;
+      m_size = 0;
+    }
+
+    const char * data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+    boost::string_view str() const { return boost::string_view(m_data, m_size); }
+
+    //0 if empty
+    boost::uint64_t generation_number() const { return m_generation ? m_generation->number() : 0; }
+  };
+
+  class ShmGenerationMap {
+  private:
+    typedef boost::shared_ptr<const generation> generation_ptr;
+
+    struct thread_cache {
+      generation_ptr current;
+    };
+
+    std::string m_name;
+    ManagedSegment m_control_segment;
+    generation_control * m_control;
+
+    //Generations mapped by this process, shared by its threads
+    boost::mutex m_mapped_mutex;
+    std::map<boost::uint64_t, boost::weak_ptr<const generation> > m_mapped;
+    boost::thread_specific_ptr<thread_cache> m_cache;
+
+    static std::string segment_name(const std::string & name, boost::uint64_t number){
+      return name + "." + boost::lexical_cast<std::string>(number);
+    }
+
+    //The current generation, mapped, 0 if none has been published
+    generation_ptr current(){
+      thread_cache * cache = m_cache.get();
+      if(!cache){
+        cache = new thread_cache;
+        m_cache.reset(cache);
+      }
+      boost::uint64_t number = m_control->current.load(boost::memory_order_acquire);
+      if(cache->current && cache->current->number() == number){
+        return cache->current;
+      }
+
+      for(;;){
+        if(!number){ return generation_ptr(); }
+        boost::mutex::scoped_lock lock(m_mapped_mutex);
+        generation_ptr mapped = m_mapped[number].lock();
+        if(!mapped){
+          try {
+            mapped.reset(new generation(segment_name(m_name, number)));
+          } catch(const boost::interprocess::interprocess_exception &){
+            //unlinked by a publish since we read the number, try the new one
+            m_mapped.erase(number);
+            const boost::uint64_t now = m_control->current.load(boost::memory_order_acquire);
+            if(now == number){ throw; }
+            number = now;
+            continue;
+          }
+          m_mapped[number] = mapped;
+        }
+        for(std::map<boost::uint64_t, boost::weak_ptr<const generation> >::iterator it = m_mapped.begin(); it != m_mapped.end(); ){
+          if(it->second.expired()){ m_mapped.erase(it++); } else { ++it; }
+        }
+        cache->current = mapped; //drops this thread's hold on the old one
+        return mapped;
+      }
+    }
+
+    //Hands back a build claim, and removes the unpublished segment, however
+    //publish() is left, so a failed build doesn't lock out later ones
+    struct build_claim {
+      generation_control & control;
+      const std::string segment;
+      const boost::uint64_t number;
+      bool published;
+
+      build_claim(generation_control & c, const std::string & name, boost::uint64_t n):
+        control(c), segment(name), number(n), published(false){}
+
+      ~build_claim(){
+        if(published){ return; }
+        boost::interprocess::shared_memory_object::remove(segment.c_str());
+        try {
+          boost::interprocess::scoped_lock<shm_robust::robust_mutex<PTHREAD_MUTEX_NORMAL> > lock(control.mutex);
+          if(control.building == number && control.builder == (boost::uint32_t)shm_process::current_pid()){
+            control.building = 0;
+            control.builder = 0;
+          }
+        } catch(...){
+          log_error("ShmGenerationMap: couldn't release a failed build, the next publish reclaims it once this process exits");
+        }
+      }
+    };
+
+    template<class Iterator>
+    struct build_job {
+      std::vector<std::vector<Iterator> > by_partition;
+      std::vector<std::size_t> partition_bytes; //of keys and values
+      generation_header * header;
+      boost::atomic<std::size_t> next;
+      boost::atomic<bool> out_of_memory;
+      build_job(std::size_t partitions): by_partition(partitions), partition_bytes(partitions), header(0), next(0), out_of_memory(false){}
+    };
+
+    template<class Iterator>
+    static void fill_partitions(build_job<Iterator> & job){
+      for(std::size_t p; !job.out_of_memory && (p = job.next.fetch_add(1)) < job.by_partition.size(); ){
+        GenerationTable & table = *job.header->tables[p];
+        const arena_allocator<char> alloc(table.get_allocator());
+        const std::vector<Iterator> & entries = job.by_partition[p];
+        try {
+          for(std::size_t i = 0; i < entries.size(); ++i){
+            const std::string & key = entries[i]->first;
+            const std::string & val = entries[i]->second;
+            table.emplace(GenerationString(key.data(), key.size(), alloc), GenerationString(val.data(), val.size(), alloc));
+          }
+        } catch(const boost::interprocess::bad_alloc &){
+          job.out_of_memory = true;
+        }
+      }
+    }
+
+    //Build generation number from the partitioned input into a new segment of
+    //bytes bytes, false if it didn't fit
+    template<class Iterator>
+    bool build(boost::uint64_t number, build_job<Iterator> & job, std::size_t bytes, std::size_t threads){
+      const std::string name = segment_name(m_name, number);
+      boost::interprocess::shared_memory_object::remove(name.c_str());
+      try {
+        ManagedSegment segment(boost::interprocess::create_only, name.c_str(), bytes);
+        generation_header * header = segment.construct<generation_header>("generation")();
+        header->number = number;
+        header->entries = 0;
+        header->partitions = job.by_partition.size();
+        for(std::size_t p = 0; p < job.by_partition.size(); ++p){
+          //chunks of about an eighth of the partition, 4 KB to 1 MB
+          const std::size_t chunk = std::min<std::size_t>(1 << 20, std::max<std::size_t>(4096, job.partition_bytes[p] / 8));
+          arena * memory = segment.construct<arena>(boost::interprocess::anonymous_instance)(segment.get_segment_manager(), chunk);
+          //buckets for every key up front, the table never rehashes
+          header->tables[p] = segment.construct<GenerationTable>(boost::interprocess::anonymous_instance)
+            (job.by_partition[p].size() + 1, boost::hash<GenerationString>(), std::equal_to<GenerationString>(),
+             arena_allocator<GenerationValue>(memory));
+        }
+        job.header = header;
+        job.next = 0;
+
+        boost::thread_group builders;
+        for(std::size_t i = 1; i < threads; ++i){
+          builders.create_thread([&]{ fill_partitions(job); });
+        }
+        fill_partitions(job);
+        builders.join_all();
+
+        //what the tables hold, duplicate keys in the input were dropped
+        for(std::size_t p = 0; p < job.by_partition.size(); ++p){
+          header->entries += header->tables[p]->size();
+        }
+      } catch(const boost::interprocess::bad_alloc &){
+        job.out_of_memory = true;
+      }
+      if(job.out_of_memory){
+        boost::interprocess::shared_memory_object::remove(name.c_str());
+        return false;
+      }
+      return true;
+    }
+
+  public:
+    /*Constructor*/
+    //open or create the control segment. If anything fails, throws interprocess_exception.
+    explicit ShmGenerationMap(const std::string & name):
+      m_name(name),
+      m_control_segment(boost::interprocess::open_or_create, name.c_str(), sizeof(generation_control) + 4096),
+      m_control(m_control_segment.find_or_construct<generation_control>("control")()){}
+
+    /*Find*/
+    //No locks, the generation is immutable
+    bool find(const std::string & key, std::string & val){
+      const generation_ptr gen = current();
+      const GenerationString * found = gen ? gen->find(key) : 0;
+      if(!found){ return false; }
+      val.assign(found->begin(), found->end());
+      return true;
+    }
+
+    //Zero-copy find, view keeps its generation mapped until reset
+    bool find_view(const std::string & key, generation_view & view){
+      view.reset();
+      const generation_ptr gen = current();
+      const GenerationString * found = gen ? gen->find(key) : 0;
+      if(!found){ return false; }
+      view.m_generation = gen;
+      view.m_data = found->data();
+      view.m_size = found->size();
+      return true;
+    }
+
+    /*Generations*/
+    //The current generation's number, 0 before the first publish
+    boost::uint64_t generation_number() const {
+      return m_control->current.load(boost::memory_order_acquire);
+    }
+
+    //Entries in the current generation
+    size_t size(){
+      const generation_ptr gen = current();
+      return gen ? gen->size() : 0;
+    }
+
+    //Block until a generation after seen is published, returns false on timeout
+    bool wait_for_publish(boost::uint64_t & seen, const boost::posix_time::time_duration & timeout){
+      boost::uint64_t now = seen;
+      const bool published = m_control->published.await([&]{ return (now = generation_number()) != seen; }, timeout);
+      seen = now;
+      return published;
+    }
+
+    /*Publish*/
+    //Build a generation from [first, last) of pairs of strings with threads threads
+    //and make it current. Later duplicates of a key are dropped. Returns its number.
+    //One build runs at a time: throws interprocess_exception if another live
+    //process is building. If the build throws, nothing is published and the
+    //next publish can start right away.
+    template<class Iterator>
+    boost::uint64_t publish(Iterator first, Iterator last, std::size_t threads){
+      boost::uint64_t number;
+      {
+        boost::interprocess::scoped_lock<shm_robust::robust_mutex<PTHREAD_MUTEX_NORMAL> > lock(m_control->mutex);
+        if(m_control->building){
+          if(shm_process::process_alive(m_control->builder)){
+            throw boost::interprocess::interprocess_exception("ShmGenerationMap: another process is building a generation");
+          }
+          boost::interprocess::shared_memory_object::remove(segment_name(m_name, m_control->building).c_str()); //its builder died
+        }
+        number = ++m_control->last;
+        m_control->building = number;
+        m_control->builder = shm_process::current_pid();
+      }
+      build_claim claim(*m_control, segment_name(m_name, number), number);
+
+      //partition and size the input
+      std::size_t entries = 0, bytes = 0;
+      for(Iterator it = first; it != last; ++it){
+        ++entries;
+        bytes += it->first.size() + it->second.size();
+      }
+      const std::size_t partitions = std::min(MAX_PARTITIONS, std::max<std::size_t>(1, threads) * 4);
+      build_job<Iterator> job(partitions);
+      for(Iterator it = first; it != last; ++it){
+        const std::size_t p = view_hash()(it->first) % partitions;
+        job.by_partition[p].push_back(it);
+        job.partition_bytes[p] += it->first.size() + it->second.size();
+      }
+
+      //node, two strings' headers and allocator overhead per entry, and buckets
+      std::size_t segment_bytes = (1 << 20) + bytes + entries * (sizeof(GenerationValue) + 128 + 2 * sizeof(void *));
+      while(!build(number, job, segment_bytes, std::max<std::size_t>(1, threads))){
+        segment_bytes *= 2;
+        job.out_of_memory = false;
+      }
+
+      boost::uint64_t old;
+      {
+        boost::interprocess::scoped_lock<shm_robust::robust_mutex<PTHREAD_MUTEX_NORMAL> > lock(m_control->mutex);
+        old = m_control->current.exchange(number, boost::memory_order_acq_rel);
+        m_control->building = 0;
+        m_control->builder = 0;
+        claim.published = true;
+      }
+      m_control->published.notify_all();
+      if(old){ boost::interprocess::shared_memory_object::remove(segment_name(m_name, old).c_str()); }
+      return number;
+    }
+
+    /*Remove*/
+    //Remove the control segment and the current generation's
+    static bool remove(const std::string & name){
+      try {
+        ManagedSegment control(boost::interprocess::open_only, name.c_str());
+        generation_control * found = control.find<generation_control>("control").first;
+        if(found && found->current){
+          boost::interprocess::shared_memory_object::remove(segment_name(name, found->current).c_str());
+        }
+      } catch(const boost::interprocess::interprocess_exception &){
+        return false;
+      }
+      return boost::interprocess::shared_memory_object::remove(name.c_str());
+    }
+  };
+
+}//namespace
+
+#endif // __SHM_GENERATION_MAP__H_
@@ -0,0 +1,270 @@
+#ifndef __SHM_MAP_JOURNAL__H_
+#define __SHM_MAP_JOURNAL__H_
+
+#include <cstring>
+#include <new>
+
+#include <unistd.h>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+#include <boost/utility/string_view.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "ShmFutex.h"
+#include "ShmProcess.h"
+
+//Crash bookkeeping for a map in shared memory, kept next to the map.
+//
+//The journal holds one record: the write in progress, if any. Before touching
+//the map a writer copies in the key, the new value (redo image) and the value
+//it replaces (undo image), as far as they fit in the journal buffer, and marks
+//the record active. The record also tells how far the write got: building the
+//new strings off to the side, copying a value over one with room for it,
+//swapping a new value into an existing entry, linking a new entry into the
+//table (the only step that can leave the table inconsistent) or freeing what
+//they replaced.
+//
+//It also tracks who is using the map's lock: per process, how many of its
+//threads are waiting for or holding it, in a slot of its own so counting costs
+//no cross-process traffic. A process that dies while counted in may have left
+//the lock held forever. Whoever notices it first (the next process to open the
+//map, or one timing out on the lock) claims the recovery, waits for the live
+//users to step back, then replaces the lock and, if a writer died mid-write,
+//completes the write from the record.
+
+namespace shm_string_hashmap {
+
+  class map_journal {
+  public:
+    enum record_flags {
+      HAS_KEY = 1,  //the key fitted
+      HAS_REDO = 2, //the new value fitted after the key
+      HAS_UNDO = 4, //the old value fitted after the key, and redo
+      EXISTED = 8   //the key was in the map before the write
+    };
+
+    enum write_phase {
+      IDLE = 0,    //no write in progress
+      PREPARE = 1,   //building the new entry or value, the table is untouched
+      OVERWRITE = 2, //copying the value over the old one, only it may be torn
+      SWAP = 3,      //swapping the new value into its entry, only that string may be torn
+      LINK = 4,      //linking the new entry into the table, which may be inconsistent
+      RELEASE = 5    //freeing what it replaced, the table is consistent again
+    };
+
+    static const std::size_t USER_SLOTS = 256; //processes using the map at once
+
+  private:
+    typedef boost::atomic<boost::uint32_t> atomic_pid;
+    typedef boost::interprocess::offset_ptr<char> char_ptr;
+
+    //One per process using the lock, found by probing from pid % USER_SLOTS
+    struct user_slot {
+      atomic_pid pid;
+      boost::atomic<boost::uint32_t> users; //threads waiting for or holding the lock
+      char pad[64 - 2*sizeof(boost::atomic<boost::uint32_t>)];
+    };
+
+    atomic_pid m_recovering; //running a recovery, 0 if nobody
+    boost::atomic<boost::uint32_t> m_phase; //of the write in progress
+    shm_futex::ShmEventCount m_recovered;
+    boost::atomic<boost::uint32_t> m_recoveries;
+
+    boost::uint32_t m_flags;
+    boost::uint32_t m_key_len;
+    boost::uint32_t m_redo_len;
+    boost::uint32_t m_undo_len;
+    char_ptr m_region; //user slots, then the record
+    boost::uint32_t m_capacity;
+
+    user_slot * slots() const { return reinterpret_cast<user_slot *>(m_region.get()); }
+    char * record() const { return m_region.get() + USER_SLOTS * sizeof(user_slot); }
+
+    bool fits(std::size_t used, std::size_t len) const { return used + len <= m_capacity; }
+
+    //This process's slot, claimed on first use. Idle slots of dead processes are
+    //reclaimed here, busy ones are left for a recovery to find.
+    user_slot & own_slot() const {
+      const boost::uint32_t pid = shm_process::current_pid();
+      for(;;){
+        for(std::size_t i = 0; i < USER_SLOTS; ++i){
+          user_slot & slot = slots()[(pid + i) % USER_SLOTS];
+          boost::uint32_t owner = slot.pid.load(boost::memory_order_acquire);
+          if(owner == pid){ return slot; }
+          if(!owner && slot.pid.compare_exchange_strong(owner, pid)){ return slot; }
+        }
+        reclaim_dead_slots(false);
+      }
+    }
+
+    void reclaim_dead_slots(bool busy_too) const {
+      for(std::size_t i = 0; i < USER_SLOTS; ++i){
+        user_slot & slot = slots()[i];
+        boost::uint32_t owner = slot.pid.load(boost::memory_order_acquire);
+        if(owner && (busy_too || !slot.users.load(boost::memory_order_relaxed)) && !shm_process::process_alive(owner)){
+          slot.users.store(0, boost::memory_order_relaxed);
+          slot.pid.compare_exchange_strong(owner, 0);
+        }
+      }
+    }
+
+    //Users counted in by processes that died, and that may hold the lock
+    bool dead_user_found() const {
+      const boost::uint32_t self = shm_process::current_pid();
+      for(std::size_t i = 0; i < USER_SLOTS; ++i){
+        const user_slot & slot = slots()[i];
+        const boost::uint32_t owner = slot.pid.load(boost::memory_order_acquire);
+        if(owner && owner != self && slot.users.load(boost::memory_order_seq_cst) && !shm_process::process_alive(owner)){
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool live_user_found() const {
+      for(std::size_t i = 0; i < USER_SLOTS; ++i){
+        const user_slot & slot = slots()[i];
+        const boost::uint32_t owner = slot.pid.load(boost::memory_order_acquire);
+        if(owner && slot.users.load(boost::memory_order_seq_cst) && shm_process::process_alive(owner)){
+          return true;
+        }
+      }
+      return false;
+    }
+
+  public:
+    //Bytes to allocate for a journal whose record holds capacity bytes
+    static std::size_t bytes_for(boost::uint32_t capacity){
+      return USER_SLOTS * sizeof(user_slot) + capacity;
+    }
+
+    //region has bytes_for(capacity) bytes, no journal if it is 0
+    map_journal(char * region, boost::uint32_t capacity):
+      m_recovering(0), m_phase(IDLE), m_recoveries(0),
+      m_flags(0), m_key_len(0), m_redo_len(0), m_undo_len(0), m_region(region), m_capacity(region ? capacity : 0){
+      for(std::size_t i = 0; region && i < USER_SLOTS; ++i){
+        new (&slots()[i].pid) atomic_pid(0);
+        new (&slots()[i].users) boost::atomic<boost::uint32_t>(0);
+      }
+    }
+
+    bool enabled() const { return m_region.get() != 0; }
+    char * region() const { return m_region.get(); }
+
+    /*Users*/
+    //Count this thread in before touching the lock, waiting out a recovery
+    void enter(){
+      user_slot & slot = own_slot();
+      for(;;){
+        slot.users.fetch_add(1, boost::memory_order_seq_cst);
+        const boost::uint32_t recovering = m_recovering.load(boost::memory_order_seq_cst);
+        if(!recovering){ return; }
+        slot.users.fetch_sub(1, boost::memory_order_seq_cst);
+
+        //if the recovering process died too, drop its claim and let the next one retry
+        if(!m_recovered.await([&]{ return m_recovering.load(boost::memory_order_acquire) == 0; },
+                              boost::posix_time::milliseconds(100))
+           && !shm_process::process_alive(recovering)){
+          boost::uint32_t expected = recovering;
+          m_recovering.compare_exchange_strong(expected, 0);
+        }
+      }
+    }
+
+    //Count this thread out once the lock is released
+    void leave(){
+      own_slot().users.fetch_sub(1, boost::memory_order_seq_cst);
+    }
+
+    //A process died counted in, the lock may never be released
+    bool needs_recovery() const { return dead_user_found(); }
+
+    /*Writer*/
+    //Record a write before applying it, old is 0 if key is new
+    template<class String>
+    void begin(const boost::string_view & key, const String * old, const boost::string_view & val){
+      char * out = record();
+      std::size_t used = 0;
+      m_flags = old ? EXISTED : 0;
+      m_key_len = m_redo_len = m_undo_len = 0;
+
+      if(fits(used, key.size())){
+        std::memcpy(out, key.data(), key.size());
+        m_key_len = key.size();
+        used += key.size();
+        m_flags |= HAS_KEY;
+
+        if(fits(used, val.size())){
+          std::memcpy(out + used, val.data(), val.size());
+          m_redo_len = val.size();
+          used += val.size();
+          m_flags |= HAS_REDO;
+        }
+
+        if(old && fits(used, old->size())){
+          std::memcpy(out + used, old->data(), old->size());
+          m_undo_len = old->size();
+          m_flags |= HAS_UNDO;
+        }
+      }
+      m_phase.store(PREPARE, boost::memory_order_release);
+    }
+
+    //Mark the step the write is about to take
+    void advance(write_phase phase){
+      m_phase.store(phase, boost::memory_order_release);
+    }
+
+    void commit(){
+      m_phase.store(IDLE, boost::memory_order_release);
+    }
+
+    /*Recovery*/
+    //Claim the recovery of a lock a dead process may hold. Returns once no live
+    //process is using the lock, false if there is nothing to recover or another
+    //process does it. The caller must not be counted in.
+    bool begin_recovery(){
+      if(!dead_user_found()){ return false; }
+
+      boost::uint32_t expected = 0;
+      if(!m_recovering.compare_exchange_strong(expected, shm_process::current_pid(), boost::memory_order_seq_cst)){
+        return false;
+      }
+      if(!dead_user_found()){ //recovered meanwhile
+        m_recovering.store(0, boost::memory_order_seq_cst);
+        m_recovered.notify_all();
+        return false;
+      }
+
+      //users time out of the dead lock within 100 ms and step back,
+      //the dead never will
+      while(live_user_found()){
+        usleep(1000);
+      }
+      return true;
+    }
+
+    void end_recovery(){
+      reclaim_dead_slots(true);
+      m_phase.store(IDLE, boost::memory_order_relaxed);
+      m_recoveries.fetch_add(1, boost::memory_order_relaxed);
+      m_recovering.store(0, boost::memory_order_seq_cst);
+      m_recovered.notify_all();
+    }
+
+    //The interrupted write, valid between begin_recovery and end_recovery
+    write_phase phase() const { return write_phase(m_phase.load(boost::memory_order_acquire)); }
+    boost::uint32_t flags() const { return m_flags; }
+    boost::string_view key() const { return boost::string_view(record(), m_key_len); }
+    boost::string_view redo() const { return boost::string_view(record() + m_key_len, m_redo_len); }
+    boost::string_view undo() const { return boost::string_view(record() + m_key_len + m_redo_len, m_undo_len); }
+
+    //Dead lock users recovered from so far
+    boost::uint32_t recoveries() const { return m_recoveries.load(boost::memory_order_relaxed); }
+  };
+
+}//namespace
+
+#endif // __SHM_MAP_JOURNAL__H_
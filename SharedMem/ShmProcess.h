@@ -0,0 +1,58 @@
+#ifndef __SHM_PROCESS__H_
+#define __SHM_PROCESS__H_
+
+#include <cerrno>
+#include <cstdio>
+
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <boost/atomic.hpp>
+
+//Process identity for state shared between processes: who holds what, and
+//whether they are still around to release it.
+
+namespace shm_process {
+
+  namespace detail {
+    inline boost::atomic<pid_t> & cached_pid(){
+      static boost::atomic<pid_t> pid(0);
+      return pid;
+    }
+
+    inline void reset_pid(){
+      cached_pid().store(getpid(), boost::memory_order_relaxed);
+    }
+  }
+
+  //getpid() without a syscall per call, kept right across fork()
+  inline pid_t current_pid(){
+    static const int registered = pthread_atfork(0, 0, &detail::reset_pid);
+    (void)registered;
+    pid_t pid = detail::cached_pid().load(boost::memory_order_relaxed);
+    if(!pid){
+      pid = getpid();
+      detail::cached_pid().store(pid, boost::memory_order_relaxed);
+    }
+    return pid;
+  }
+
+  //False once pid has exited, zombies included: an exited child its parent hasn't
+  //waited for yet still answers kill(). Only meaningful within this pid namespace.
+  inline bool process_alive(pid_t pid){
+    if(kill(pid, 0) != 0 && errno == ESRCH){ return false; }
+
+    char path[32];
+    std::snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    std::FILE * file = std::fopen(path, "r");
+    if(!file){ return true; } //no procfs, trust kill()
+    char state = 0;
+    const int parsed = std::fscanf(file, "%*d (%*[^)]) %c", &state);
+    std::fclose(file);
+    return parsed != 1 || state != 'Z';
+  }
+
+}//namespace
+
+#endif // __SHM_PROCESS__H_
@@ -0,0 +1,116 @@
+#ifndef __SHM_READ_PINS__H_
+#define __SHM_READ_PINS__H_
+
+#include <limits>
+#include <new>
+
+#include <pthread.h>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+
+#include "ShmProcess.h"
+
+//Epochs that keep a map's values alive for readers holding them in place.
+//
+//A reader pins under the map's sharable lock: it takes a slot and writes the
+//current epoch in it. A writer that replaces a value while anything is pinned
+//doesn't overwrite or free it, it retires it tagged with the current epoch and
+//moves the epoch on. A pin can only have seen values retired at or after its
+//own epoch, so a value retired at epoch E can be freed once every pin is newer
+//than E. Pins of dead processes are dropped when they hold a value back.
+
+namespace shm_string_hashmap {
+
+  class read_pins {
+  public:
+    static const std::size_t SLOTS = 256; //values pinned at once, across processes
+    static const std::size_t NONE = SLOTS; //no free slot
+
+  private:
+    struct pin_slot {
+      boost::atomic<boost::uint64_t> epoch; //pinned at, 0 if free
+      boost::atomic<boost::uint32_t> pid;   //0 while being claimed
+      char pad[64 - sizeof(boost::atomic<boost::uint64_t>) - sizeof(boost::atomic<boost::uint32_t>)];
+    };
+
+    boost::atomic<boost::uint64_t> m_epoch;  //moved on by every retire, starts at 1
+    boost::atomic<boost::uint32_t> m_pinned; //slots in use
+    pin_slot m_slots[SLOTS];
+
+    //Spread threads over the slots, pthread_t is the thread's descriptor address
+    static std::size_t first_slot(){
+      return (boost::uint64_t(pthread_self()) * 0x9E3779B97F4A7C15ull) >> 56;
+    }
+
+    void release(pin_slot & slot){
+      slot.pid.store(0, boost::memory_order_relaxed);
+      slot.epoch.store(0, boost::memory_order_release);
+      m_pinned.fetch_sub(1, boost::memory_order_release);
+    }
+
+  public:
+    read_pins(): m_epoch(1), m_pinned(0){
+      for(std::size_t i = 0; i < SLOTS; ++i){
+        new (&m_slots[i].epoch) boost::atomic<boost::uint64_t>(0);
+        new (&m_slots[i].pid) boost::atomic<boost::uint32_t>(0);
+      }
+    }
+
+    /*Readers*/
+    //Pin the current epoch, under the map's sharable lock. Returns the slot, or
+    //NONE if all are taken.
+    std::size_t pin(){
+      const boost::uint64_t epoch = m_epoch.load(boost::memory_order_relaxed); //writers are locked out
+      const std::size_t first = first_slot();
+      for(std::size_t i = 0; i < SLOTS; ++i){
+        pin_slot & slot = m_slots[(first + i) % SLOTS];
+        boost::uint64_t expected = 0;
+        if(slot.epoch.load(boost::memory_order_relaxed) == 0
+           && slot.epoch.compare_exchange_strong(expected, epoch, boost::memory_order_acq_rel)){
+          slot.pid.store(shm_process::current_pid(), boost::memory_order_relaxed);
+          m_pinned.fetch_add(1, boost::memory_order_acq_rel);
+          return (first + i) % SLOTS;
+        }
+      }
+      return NONE;
+    }
+
+    //No lock needed
+    void unpin(std::size_t slot){
+      release(m_slots[slot]);
+    }
+
+    /*Writers*/
+    //All of these under the map's exclusive lock
+
+    //Anything pinned, so values must be retired rather than overwritten
+    bool pinned() const { return m_pinned.load(boost::memory_order_acquire) != 0; }
+
+    //Epoch to tag a retired value with
+    boost::uint64_t retire(){ return m_epoch.fetch_add(1, boost::memory_order_relaxed); }
+
+    //Oldest epoch still pinned, past the max if none. Pins of dead processes at
+    //or before needed (the oldest retired value) are dropped on the way.
+    boost::uint64_t oldest(boost::uint64_t needed){
+      boost::uint64_t oldest = std::numeric_limits<boost::uint64_t>::max();
+      for(std::size_t i = 0; i < SLOTS; ++i){
+        pin_slot & slot = m_slots[i];
+        const boost::uint64_t epoch = slot.epoch.load(boost::memory_order_acquire);
+        if(!epoch){ continue; }
+        if(epoch <= needed){
+          const boost::uint32_t pid = slot.pid.load(boost::memory_order_relaxed);
+          if(pid && !shm_process::process_alive(pid)){
+            release(slot);
+            continue;
+          }
+        }
+        if(epoch < oldest){ oldest = epoch; }
+      }
+      return oldest;
+    }
+  };
+
+}//namespace
+
+#endif // __SHM_READ_PINS__H_
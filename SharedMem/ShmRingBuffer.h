@@ -0,0 +1,446 @@
+#ifndef __SHM_RING_BUFFER__H_
+#define __SHM_RING_BUFFER__H_
+
+#include <string>
+#include <cstring>
+#include <new>
+
+#include <boost/assert.hpp>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/static_assert.hpp>
+
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "ShmFutex.h"
+
+//Bounded rings of variable-length records living in shared memory.
+//Both rings are plain memory layouts: they can be placement-constructed into a
+//mapped_region (see ShmRingChannel below) or into a managed_shared_memory block.
+//
+//SpscRing: one producer process, one consumer process. Records are packed back
+//to back ([len][payload] aligned to 8 bytes), writes are staged locally and made
+//visible with a single publish(), reads are released with a single release().
+//
+//MpmcRing: any number of producers and consumers. Records are stored in fixed,
+//cache-line padded slots guarded by a sequence number (Vyukov bounded queue), so
+//a record can be of any length up to max_record.
+//
+//Neither ring makes a syscall on the fast path. The blocking push/pop/wait_*
+//calls spin briefly and then park on a futex (ShmFutex.h); the non-blocking calls
+//only enter the kernel to wake a peer that is actually parked.
+
+namespace shm_ring_buffer {
+
+  BOOST_STATIC_ASSERT(BOOST_ATOMIC_INT64_LOCK_FREE == 2); //must be address free to share between processes
+
+  static const std::size_t CACHE_LINE_SIZE = 64;
+
+  inline std::size_t align_up(std::size_t n, std::size_t align)
+  { return (n + align - 1) & ~(align - 1); }
+
+  inline bool is_power_of_two(std::size_t n)
+  { return n && !(n & (n - 1)); }
+
+  inline std::size_t next_power_of_two(std::size_t n)
+  { std::size_t p = 1; while(p < n) p <<= 1; return p; }
+
+  //A record to publish, used by the bulk operations
+  struct RecordRef {
+    const void * data;
+    boost::uint32_t len;
+  };
+
+  class SpscRing {
+  private:
+    typedef boost::atomic<boost::uint64_t> atomic_pos;
+    static const boost::uint32_t PAD_RECORD = 0xFFFFFFFFu; //skip to the start of the ring
+    static const std::size_t RECORD_HEADER = 8;
+
+    boost::uint64_t m_capacity; //bytes, power of two
+    boost::uint64_t m_mask;
+    boost::uint32_t m_max_record;
+    char m_pad0[CACHE_LINE_SIZE - 2*sizeof(boost::uint64_t) - sizeof(boost::uint32_t)];
+
+    atomic_pos m_head; //published write position, written by the producer
+    char m_pad1[CACHE_LINE_SIZE - sizeof(atomic_pos)];
+
+    atomic_pos m_tail; //released read position, written by the consumer
+    char m_pad2[CACHE_LINE_SIZE - sizeof(atomic_pos)];
+
+    shm_futex::ShmEventCount m_readable;
+    char m_pad3[CACHE_LINE_SIZE - sizeof(shm_futex::ShmEventCount)];
+
+    shm_futex::ShmEventCount m_writable;
+    char m_pad4[CACHE_LINE_SIZE - sizeof(shm_futex::ShmEventCount)];
+
+    //producer private
+    boost::uint64_t m_write_pos;
+    boost::uint64_t m_cached_tail;
+    char m_pad5[CACHE_LINE_SIZE - 2*sizeof(boost::uint64_t)];
+
+    //consumer private
+    boost::uint64_t m_read_pos;
+    boost::uint64_t m_cached_head;
+    char m_pad6[CACHE_LINE_SIZE - 2*sizeof(boost::uint64_t)];
+
+    char * buffer() { return reinterpret_cast<char *>(this) + header_bytes(); }
+
+    static std::size_t header_bytes() { return align_up(sizeof(SpscRing), CACHE_LINE_SIZE); }
+
+    static std::size_t record_bytes(boost::uint32_t len) { return align_up(RECORD_HEADER + len, 8); }
+
+  public:
+    //capacity is in bytes and is rounded up to a power of two
+    SpscRing(std::size_t capacity, boost::uint32_t max_record):
+      m_capacity(next_power_of_two(capacity)), m_mask(m_capacity - 1), m_max_record(max_record),
+      m_head(0), m_tail(0), m_write_pos(0), m_cached_tail(0), m_read_pos(0), m_cached_head(0){
+      //a record plus the pad in front of it must always fit
+      BOOST_ASSERT(record_bytes(max_record) <= m_capacity / 2);
+    }
+
+    //Bytes to reserve for the ring, header included
+    static std::size_t bytes_for(std::size_t capacity, boost::uint32_t /*max_record*/){
+      return header_bytes() + next_power_of_two(capacity);
+    }
+
+    /*Producer*/
+    //Claim len bytes in the ring and return where to write them, or 0 if full.
+    //The record is invisible to the consumer until publish().
+    char * try_claim(boost::uint32_t len){
+      if(len > m_max_record){ return 0; }
+
+      const std::size_t need = record_bytes(len);
+      const std::size_t idx = m_write_pos & m_mask;
+      const std::size_t contiguous = m_capacity - idx;
+      const std::size_t total = contiguous < need ? contiguous + need : need;
+
+      if(m_write_pos + total - m_cached_tail > m_capacity){
+        m_cached_tail = m_tail.load(boost::memory_order_acquire);
+        if(m_write_pos + total - m_cached_tail > m_capacity){ return 0; }
+      }
+
+      char * base = buffer();
+      if(contiguous < need){
+        *reinterpret_cast<boost::uint32_t *>(base + idx) = PAD_RECORD;
+        m_write_pos += contiguous;
+      }
+
+      char * record = base + (m_write_pos & m_mask);
+      *reinterpret_cast<boost::uint32_t *>(record) = len;
+      m_write_pos += need;
+      return record + RECORD_HEADER;
+    }
+
+    bool try_write(const void * data, boost::uint32_t len){
+      char * dst = try_claim(len);
+      if(!dst){ return false; }
+      std::memcpy(dst, data, len);
+      return true;
+    }
+
+    //Make every record written so far visible to the consumer
+    void publish(){
+      m_head.store(m_write_pos, boost::memory_order_release);
+      m_readable.notify_one();
+    }
+
+    bool try_push(const void * data, boost::uint32_t len){
+      if(!try_write(data, len)){ return false; }
+      publish();
+      return true;
+    }
+
+    //Write as many records as fit and publish them once, returns how many were written
+    std::size_t try_push_bulk(const RecordRef * records, std::size_t n){
+      std::size_t written = 0;
+      while(written < n && try_write(records[written].data, records[written].len)){ ++written; }
+      if(written){ publish(); }
+      return written;
+    }
+
+    /*Consumer*/
+    //Point data at the next record in place. The record stays valid until release().
+    bool try_read(const char *& data, boost::uint32_t & len){
+      for(;;){
+        if(m_read_pos == m_cached_head){
+          m_cached_head = m_head.load(boost::memory_order_acquire);
+          if(m_read_pos == m_cached_head){ return false; }
+        }
+
+        const std::size_t idx = m_read_pos & m_mask;
+        const char * record = buffer() + idx;
+        const boost::uint32_t record_len = *reinterpret_cast<const boost::uint32_t *>(record);
+        if(record_len == PAD_RECORD){
+          m_read_pos += m_capacity - idx;
+          continue;
+        }
+
+        data = record + RECORD_HEADER;
+        len = record_len;
+        m_read_pos += record_bytes(record_len);
+        return true;
+      }
+    }
+
+    //Give the space of every record read so far back to the producer
+    void release(){
+      m_tail.store(m_read_pos, boost::memory_order_release);
+      m_writable.notify_one();
+    }
+
+    //Call f(data, len) for up to max records, then release them all at once
+    template<class F>
+    std::size_t consume(F f, std::size_t max){
+      std::size_t n = 0;
+      const char * data;
+      boost::uint32_t len;
+      while(n < max && try_read(data, len)){
+        f(data, len);
+        ++n;
+      }
+      if(n){ release(); }
+      return n;
+    }
+
+    bool try_pop(std::string & val){
+      const char * data;
+      boost::uint32_t len;
+      if(!try_read(data, len)){ return false; }
+      val.assign(data, len);
+      release();
+      return true;
+    }
+
+    /*Blocking*/
+    void push(const void * data, boost::uint32_t len){
+      BOOST_ASSERT(len <= m_max_record);
+      m_writable.await([&]{ return try_push(data, len); });
+    }
+
+    void pop(std::string & val){
+      m_readable.await([&]{ return try_pop(val); });
+    }
+
+    //Wait until the producer has published something past our read position
+    bool wait_readable(const boost::posix_time::time_duration & timeout){
+      return m_readable.await([&]{ return m_read_pos != m_head.load(boost::memory_order_acquire); }, timeout);
+    }
+
+    //Wait until the consumer has released enough space for a len byte record
+    bool wait_writable(boost::uint32_t len, const boost::posix_time::time_duration & timeout){
+      const std::size_t total = 2 * record_bytes(len);
+      return m_writable.await([&]{
+          return m_write_pos + total - m_tail.load(boost::memory_order_acquire) <= m_capacity; }, timeout);
+    }
+
+    /*Observers*/
+    bool empty() const {
+      return m_head.load(boost::memory_order_acquire) == m_tail.load(boost::memory_order_acquire);
+    }
+
+    std::size_t capacity() const { return m_capacity; }
+    boost::uint32_t max_record() const { return m_max_record; }
+  };
+
+  class MpmcRing {
+  private:
+    typedef boost::atomic<boost::uint64_t> atomic_pos;
+    static const std::size_t SLOT_HEADER = 16;
+
+    struct Slot {
+      atomic_pos seq;
+      boost::uint32_t len;
+      boost::uint32_t reserved;
+      char * payload() { return reinterpret_cast<char *>(this) + SLOT_HEADER; }
+    };
+
+    boost::uint64_t m_slot_count; //power of two
+    boost::uint64_t m_mask;
+    boost::uint32_t m_max_record;
+    boost::uint32_t m_slot_stride;
+    char m_pad0[CACHE_LINE_SIZE - 2*sizeof(boost::uint64_t) - 2*sizeof(boost::uint32_t)];
+
+    atomic_pos m_enqueue_pos;
+    char m_pad1[CACHE_LINE_SIZE - sizeof(atomic_pos)];
+
+    atomic_pos m_dequeue_pos;
+    char m_pad2[CACHE_LINE_SIZE - sizeof(atomic_pos)];
+
+    shm_futex::ShmEventCount m_readable;
+    char m_pad3[CACHE_LINE_SIZE - sizeof(shm_futex::ShmEventCount)];
+
+    shm_futex::ShmEventCount m_writable;
+    char m_pad4[CACHE_LINE_SIZE - sizeof(shm_futex::ShmEventCount)];
+
+    static std::size_t header_bytes() { return align_up(sizeof(MpmcRing), CACHE_LINE_SIZE); }
+
+    static std::size_t slot_stride(boost::uint32_t max_record)
+    { return align_up(SLOT_HEADER + max_record, CACHE_LINE_SIZE); }
+
+    Slot & slot_at(boost::uint64_t pos){
+      return *reinterpret_cast<Slot *>(reinterpret_cast<char *>(this) + header_bytes()
+                                       + (pos & m_mask) * m_slot_stride);
+    }
+
+    //Claim up to n consecutive slots whose sequence is pos+offset+ready_offset,
+    //returns the first position claimed and sets n to the number claimed
+    boost::uint64_t claim(atomic_pos & cursor, std::size_t & n, boost::uint64_t ready_offset){
+      boost::uint64_t pos = cursor.load(boost::memory_order_relaxed);
+      for(;;){
+        std::size_t k = 0;
+        bool behind = false;
+        while(k < n){
+          const boost::uint64_t seq = slot_at(pos + k).seq.load(boost::memory_order_acquire);
+          const boost::int64_t diff = (boost::int64_t)(seq - (pos + k + ready_offset));
+          if(diff != 0){ behind = (diff > 0); break; }
+          ++k;
+        }
+
+        if(k == 0){
+          if(!behind){ n = 0; return pos; } //full or empty
+          pos = cursor.load(boost::memory_order_relaxed);
+          continue;
+        }
+
+        if(cursor.compare_exchange_weak(pos, pos + k, boost::memory_order_relaxed)){
+          n = k;
+          return pos;
+        }
+      }
+    }
+
+  public:
+    //capacity is in slots and is rounded up to a power of two
+    MpmcRing(std::size_t capacity, boost::uint32_t max_record):
+      m_slot_count(next_power_of_two(capacity)), m_mask(m_slot_count - 1),
+      m_max_record(max_record), m_slot_stride(slot_stride(max_record)),
+      m_enqueue_pos(0), m_dequeue_pos(0){
+      for(boost::uint64_t i = 0; i < m_slot_count; ++i){
+        Slot & slot = slot_at(i);
+        new (&slot.seq) atomic_pos(i);
+        slot.len = 0;
+      }
+    }
+
+    //Bytes to reserve for the ring, header included
+    static std::size_t bytes_for(std::size_t capacity, boost::uint32_t max_record){
+      return header_bytes() + next_power_of_two(capacity) * slot_stride(max_record);
+    }
+
+    /*Producers*/
+    bool try_push(const void * data, boost::uint32_t len){
+      RecordRef record = { data, len };
+      return try_push_bulk(&record, 1) == 1;
+    }
+
+    //Claim as many consecutive slots as are free with one CAS, returns how many were pushed
+    std::size_t try_push_bulk(const RecordRef * records, std::size_t n){
+      for(std::size_t i = 0; i < n; ++i){
+        if(records[i].len > m_max_record){ n = i; break; }
+      }
+      if(!n){ return 0; }
+
+      const boost::uint64_t pos = claim(m_enqueue_pos, n, 0);
+      for(std::size_t i = 0; i < n; ++i){
+        Slot & slot = slot_at(pos + i);
+        std::memcpy(slot.payload(), records[i].data, records[i].len);
+        slot.len = records[i].len;
+        slot.seq.store(pos + i + 1, boost::memory_order_release);
+      }
+      if(n == 1){ m_readable.notify_one(); } else if(n){ m_readable.notify_all(); }
+      return n;
+    }
+
+    /*Consumers*/
+    //Call f(data, len) in place for up to max records claimed with one CAS
+    template<class F>
+    std::size_t consume(F f, std::size_t max){
+      std::size_t n = max;
+      const boost::uint64_t pos = claim(m_dequeue_pos, n, 1);
+      for(std::size_t i = 0; i < n; ++i){
+        Slot & slot = slot_at(pos + i);
+        f(const_cast<const char *>(slot.payload()), slot.len);
+        slot.seq.store(pos + i + m_slot_count, boost::memory_order_release);
+      }
+      if(n == 1){ m_writable.notify_one(); } else if(n){ m_writable.notify_all(); }
+      return n;
+    }
+
+    bool try_pop(std::string & val){
+      struct assign {
+        std::string & out;
+        void operator()(const char * data, boost::uint32_t len) const { out.assign(data, len); }
+      } f = { val };
+      return consume(f, 1) == 1;
+    }
+
+    /*Blocking*/
+    void push(const void * data, boost::uint32_t len){
+      BOOST_ASSERT(len <= m_max_record);
+      m_writable.await([&]{ return try_push(data, len); });
+    }
+
+    void pop(std::string & val){
+      m_readable.await([&]{ return try_pop(val); });
+    }
+
+    bool wait_readable(const boost::posix_time::time_duration & timeout){
+      return m_readable.await([&]{ return !empty(); }, timeout);
+    }
+
+    bool wait_writable(boost::uint32_t /*len*/, const boost::posix_time::time_duration & timeout){
+      return m_writable.await([&]{
+          return m_enqueue_pos.load(boost::memory_order_acquire) - m_dequeue_pos.load(boost::memory_order_acquire) < m_slot_count; }, timeout);
+    }
+
+    /*Observers*/
+    bool empty() const {
+      return m_dequeue_pos.load(boost::memory_order_acquire) >= m_enqueue_pos.load(boost::memory_order_acquire);
+    }
+
+    std::size_t capacity() const { return m_slot_count; }
+    boost::uint32_t max_record() const { return m_max_record; }
+  };
+
+  //Owns a shared_memory_object/mapped_region pair holding one ring
+  template<class Ring>
+  class ShmRingChannel {
+  private:
+    boost::interprocess::shared_memory_object m_shm;
+    boost::interprocess::mapped_region m_region;
+    Ring * m_ring;
+
+  public:
+    /*Constructor*/
+    //create, fails with interprocess_exception if the name already exists
+    ShmRingChannel(boost::interprocess::create_only_t, const std::string & name,
+                   std::size_t capacity, boost::uint32_t max_record):
+      m_shm(boost::interprocess::create_only, name.c_str(), boost::interprocess::read_write){
+      m_shm.truncate(Ring::bytes_for(capacity, max_record));
+      boost::interprocess::mapped_region(m_shm, boost::interprocess::read_write).swap(m_region);
+      m_ring = new (m_region.get_address()) Ring(capacity, max_record);
+    }
+
+    //open a ring created by another process
+    ShmRingChannel(boost::interprocess::open_only_t, const std::string & name):
+      m_shm(boost::interprocess::open_only, name.c_str(), boost::interprocess::read_write),
+      m_region(m_shm, boost::interprocess::read_write),
+      m_ring(static_cast<Ring *>(m_region.get_address())){}
+
+    Ring & ring() { return *m_ring; }
+    Ring * operator->() { return m_ring; }
+
+    /*Remove*/
+    static bool remove(const std::string & name){
+      return boost::interprocess::shared_memory_object::remove(name.c_str());
+    }
+  };
+
+  typedef ShmRingChannel<SpscRing> ShmSpscChannel;
+  typedef ShmRingChannel<MpmcRing> ShmMpmcChannel;
+
+}//namespace
+
+#endif // __SHM_RING_BUFFER__H_
@@ -0,0 +1,114 @@
+#ifndef __SHM_ROBUST_MUTEX__H_
+#define __SHM_ROBUST_MUTEX__H_
+
+#include <cerrno>
+#include <ctime>
+
+#include <pthread.h>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/interprocess/exceptions.hpp>
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/mem_algo/rbtree_best_fit.hpp>
+#include <boost/interprocess/indexes/iset_index.hpp>
+
+//Process-shared mutexes that survive their owner dying, and a managed segment
+//built on them.
+//
+//managed_shared_memory guards its allocator and its name index with plain
+//process-shared mutexes: a process killed inside an allocation leaves them
+//locked and every later allocation, find or construct in the segment hangs.
+//These are robust pthread mutexes instead, the next process to lock one whose
+//owner died gets it, marks it consistent and carries on. That keeps the segment
+//usable when the owner died outside the critical part of an allocation, but a
+//death in the middle of rebalancing the allocator's free tree leaves the tree
+//damaged, and nothing short of recreating the segment repairs it.
+//recovered_owner_deaths() tells a process it took over such a lock.
+
+namespace shm_robust {
+
+  template<int TYPE>
+  class robust_mutex {
+  private:
+    pthread_mutex_t m_mutex;
+
+    static boost::atomic<boost::uint32_t> & owner_deaths(){
+      static boost::atomic<boost::uint32_t> deaths(0);
+      return deaths;
+    }
+
+    void check(int rc){
+      if(rc == EOWNERDEAD){
+        pthread_mutex_consistent(&m_mutex);
+        owner_deaths().fetch_add(1, boost::memory_order_relaxed);
+      } else if(rc){
+        throw boost::interprocess::interprocess_exception(boost::interprocess::lock_error);
+      }
+    }
+
+  public:
+    robust_mutex(){
+      pthread_mutexattr_t attr;
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_settype(&attr, TYPE);
+      pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+      const int rc = pthread_mutex_init(&m_mutex, &attr);
+      pthread_mutexattr_destroy(&attr);
+      if(rc){ throw boost::interprocess::interprocess_exception(boost::interprocess::lock_error); }
+    }
+
+    ~robust_mutex(){
+      pthread_mutex_destroy(&m_mutex);
+    }
+
+    void lock(){
+      check(pthread_mutex_lock(&m_mutex));
+    }
+
+    bool try_lock(){
+      const int rc = pthread_mutex_trylock(&m_mutex);
+      if(rc == EBUSY){ return false; }
+      check(rc);
+      return true;
+    }
+
+    //abs_time is universal time, as everywhere in boost::interprocess
+    bool timed_lock(const boost::posix_time::ptime & abs_time){
+      if(abs_time.is_pos_infinity()){ lock(); return true; }
+      const boost::posix_time::time_duration since_epoch = abs_time - boost::posix_time::ptime(boost::gregorian::date(1970, 1, 1));
+      struct timespec ts;
+      ts.tv_sec = since_epoch.total_seconds();
+      ts.tv_nsec = (since_epoch.total_microseconds() % 1000000) * 1000;
+      const int rc = pthread_mutex_timedlock(&m_mutex, &ts);
+      if(rc == ETIMEDOUT){ return false; }
+      check(rc);
+      return true;
+    }
+
+    void unlock(){
+      pthread_mutex_unlock(&m_mutex);
+    }
+
+    //Locks taken over from dead owners by this process, for diagnostics
+    static boost::uint32_t recovered_owner_deaths(){
+      return owner_deaths().load(boost::memory_order_relaxed);
+    }
+  };
+
+  struct robust_mutex_family {
+    typedef robust_mutex<PTHREAD_MUTEX_NORMAL> mutex_type;
+    typedef robust_mutex<PTHREAD_MUTEX_RECURSIVE> recursive_mutex_type;
+  };
+
+  //managed_shared_memory with robust allocator and name index locks
+  typedef boost::interprocess::basic_managed_shared_memory<
+    char,
+    boost::interprocess::rbtree_best_fit<robust_mutex_family>,
+    boost::interprocess::iset_index> managed_shared_memory;
+
+}//namespace
+
+#endif // __SHM_ROBUST_MUTEX__H_
@@ -0,0 +1,341 @@
+#ifndef __SHM_SHARDED_MAP__H_
+#define __SHM_SHARDED_MAP__H_
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <ctime>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+#include "ShmProcess.h"
+#include "ShmRobustMutex.h"
+#include "ShmStringHashMap.h"
+
+//A string map spread over several shared memory segments, and a registry of
+//such maps on the host.
+//
+//One segment means one allocator lock for every writer and one size limit. A
+//sharded map puts each key in one of K independent ShmStringHashMaps, shard
+//hash(key) % K, segment "<name>.<shard>". Writers to different shards share no
+//lock and no allocator, and the map holds K segments' worth of data.
+//
+//The registry is a small segment of its own listing every sharded map: its shard
+//count and sizes, who created it and when. The first process to open a map
+//registers it with its parameters, later ones open it as registered whatever
+//they pass, so all processes agree on K. inspect() reads each shard's entries
+//and free memory without taking the maps' locks, only each segment's allocator
+//lock for the moment it takes to find the map in it.
+//
+//bulk_load() fills the map from threads that each own a shard at a time, so
+//they never meet on a lock or an allocator. Several processes can load one map
+//together by each taking the shards of its rank.
+
+namespace shm_sharded_map {
+
+  using shm_string_hashmap::ShmStringHashMap;
+  using shm_string_hashmap::ShmSafeHashMap;
+  using shm_string_hashmap::value_view;
+
+  static const char * const DEFAULT_REGISTRY = "ShmMapRegistry";
+  static const std::size_t MAX_MAPS = 256;
+  static const std::size_t MAX_NAME = 64;
+
+  //A map as registered
+  struct map_entry {
+    char name[MAX_NAME]; //"" if the entry is free
+    boost::uint32_t shards;
+    boost::uint32_t shard_bytes;
+    boost::uint32_t bucket_count; //per shard
+    boost::uint32_t journal_bytes;
+    boost::uint32_t creator;      //pid
+    boost::int64_t created;       //time_t
+  };
+
+  class map_registry {
+  private:
+    typedef shm_robust::robust_mutex<PTHREAD_MUTEX_NORMAL> mutex_type;
+    typedef boost::interprocess::scoped_lock<mutex_type> lock_type;
+
+    mutable mutex_type m_mutex;
+    map_entry m_maps[MAX_MAPS];
+
+    map_entry * lookup(const std::string & name){
+      for(std::size_t i = 0; i < MAX_MAPS; ++i){
+        if(name == m_maps[i].name){ return &m_maps[i]; }
+      }
+      return 0;
+    }
+
+  public:
+    map_registry(){
+      std::memset(m_maps, 0, sizeof(m_maps));
+    }
+
+    //The entry of wanted's name, registering wanted if there is none.
+    //Throws interprocess_exception if the registry is full.
+    map_entry add(const map_entry & wanted){
+      lock_type lock(m_mutex);
+      if(map_entry * found = lookup(wanted.name)){ return *found; }
+      map_entry * free_entry = lookup("");
+      if(!free_entry){
+        throw boost::interprocess::interprocess_exception("ShmShardedMap: the map registry is full");
+      }
+      *free_entry = wanted;
+      return wanted;
+    }
+
+    bool find(const std::string & name, map_entry & entry) const {
+      lock_type lock(m_mutex);
+      const map_entry * found = const_cast<map_registry *>(this)->lookup(name);
+      if(found){ entry = *found; }
+      return found != 0;
+    }
+
+    bool erase(const std::string & name){
+      lock_type lock(m_mutex);
+      map_entry * found = lookup(name);
+      if(found){ std::memset(found, 0, sizeof(map_entry)); }
+      return found != 0;
+    }
+
+    std::vector<map_entry> maps() const {
+      lock_type lock(m_mutex);
+      std::vector<map_entry> out;
+      for(std::size_t i = 0; i < MAX_MAPS; ++i){
+        if(m_maps[i].name[0]){ out.push_back(m_maps[i]); }
+      }
+      return out;
+    }
+  };
+
+  //What inspect() found in one shard's segment
+  struct shard_info {
+    std::string segment;
+    bool exists;
+    std::size_t entries;
+    std::size_t bytes;
+    std::size_t free_bytes;
+    boost::uint32_t recoveries;
+  };
+
+  struct map_info {
+    map_entry entry;
+    std::vector<shard_info> shards;
+
+    std::size_t entries() const {
+      std::size_t total = 0;
+      for(std::size_t i = 0; i < shards.size(); ++i){ total += shards[i].entries; }
+      return total;
+    }
+  };
+
+  class ShmShardedMap {
+  private:
+    typedef boost::shared_ptr<ShmStringHashMap> shard_ptr;
+
+    std::string m_name;
+    map_entry m_entry;
+    std::vector<shard_ptr> m_shards;
+
+    static map_registry & registry(const std::string & registry_name){
+      //opened once per process and name, kept mapped for good
+      static boost::mutex guard;
+      static std::vector<std::pair<std::string, boost::shared_ptr<shm_robust::managed_shared_memory> > > opened;
+      boost::mutex::scoped_lock lock(guard);
+      for(std::size_t i = 0; i < opened.size(); ++i){
+        if(opened[i].first == registry_name){
+          return *opened[i].second->find<map_registry>("registry").first;
+        }
+      }
+      boost::shared_ptr<shm_robust::managed_shared_memory> segment(
+        new shm_robust::managed_shared_memory(boost::interprocess::open_or_create, registry_name.c_str(),
+                                              sizeof(map_registry) + 65536));
+      map_registry * found = segment->find_or_construct<map_registry>("registry")();
+      opened.push_back(std::make_pair(registry_name, segment));
+      return *found;
+    }
+
+    static std::string segment_name(const std::string & name, std::size_t shard){
+      return name + "." + boost::lexical_cast<std::string>(shard);
+    }
+
+    template<class Iterator>
+    struct load_job {
+      std::vector<std::vector<Iterator> > by_shard;
+      boost::atomic<std::size_t> next;
+      boost::atomic<std::size_t> loaded;
+      load_job(std::size_t shards): by_shard(shards), next(0), loaded(0){}
+    };
+
+    template<class Iterator>
+    void load_shards(load_job<Iterator> & job){
+      for(std::size_t shard; (shard = job.next.fetch_add(1)) < job.by_shard.size(); ){
+        const std::vector<Iterator> & entries = job.by_shard[shard];
+        std::size_t loaded = 0;
+        try {
+          for(std::size_t i = 0; i < entries.size(); ++i){
+            m_shards[shard]->insert(entries[i]->first, entries[i]->second);
+            ++loaded;
+          }
+        } catch(const std::exception & e){
+          log_error(("ShmShardedMap: loading " + segment_name(m_name, shard) + " stopped: " + e.what()).c_str());
+        }
+        job.loaded.fetch_add(loaded);
+      }
+    }
+
+  public:
+    /*Constructor*/
+    //open or create. The parameters only matter to the process that registers the
+    //map, see ShmStringHashMap for their meaning. If anything fails, throws
+    //interprocess_exception.
+    ShmShardedMap(const std::string & name, std::size_t shards=8,
+                  const int & shard_bytes=655350, const int & bucket_count=3000,
+                  const int & journal_bytes=0, const std::string & registry_name=DEFAULT_REGISTRY):
+      m_name(name){
+      if(name.empty() || name.size() >= MAX_NAME || !shards){
+        throw boost::interprocess::interprocess_exception("ShmShardedMap: bad map name or shard count");
+      }
+      map_entry wanted;
+      std::memset(&wanted, 0, sizeof(wanted));
+      std::strcpy(wanted.name, name.c_str());
+      wanted.shards = shards;
+      wanted.shard_bytes = shard_bytes;
+      wanted.bucket_count = bucket_count;
+      wanted.journal_bytes = journal_bytes;
+      wanted.creator = shm_process::current_pid();
+      wanted.created = std::time(0);
+      m_entry = registry(registry_name).add(wanted);
+
+      for(std::size_t i = 0; i < m_entry.shards; ++i){
+        m_shards.push_back(shard_ptr(new ShmStringHashMap(segment_name(m_name, i), m_name, m_entry.shard_bytes,
+                                                          m_entry.bucket_count, m_entry.journal_bytes)));
+      }
+    }
+
+    /*Shards*/
+    std::size_t shard_count() const { return m_shards.size(); }
+
+    std::size_t shard_of(const std::string & key) const {
+      return shm_string_hashmap::view_hash()(key) % m_shards.size();
+    }
+
+    ShmStringHashMap & shard(std::size_t i) const { return *m_shards[i]; }
+
+    /*Insert*/
+    bool insert(const std::string & key, const std::string & val){
+      return shard(shard_of(key)).insert(key, val);
+    }
+
+    bool insert_if_absent(const std::string & key, const std::string & val){
+      return shard(shard_of(key)).insert_if_absent(key, val);
+    }
+
+    bool compare_and_set(const std::string & key, const std::string & expected, const std::string & desired){
+      return shard(shard_of(key)).compare_and_set(key, expected, desired);
+    }
+
+    template<class F>
+    bool update(const std::string & key, F fn){
+      return shard(shard_of(key)).update(key, fn);
+    }
+
+    template<class F>
+    bool get_or_compute(const std::string & key, F fn, std::string & val){
+      return shard(shard_of(key)).get_or_compute(key, fn, val);
+    }
+
+    /*Find*/
+    bool find(const std::string & key, std::string & val) const {
+      return shard(shard_of(key)).find(key, val);
+    }
+
+    bool find_view(const std::string & key, value_view & view) const {
+      return shard(shard_of(key)).find_view(key, view);
+    }
+
+    /*Bulk load*/
+    //Insert [first, last) of pairs of strings using threads threads. A process
+    //loading along with others passes its rank among ranks and only loads the
+    //shards s with s % ranks == rank. Returns the entries loaded, fewer than its
+    //share of the input if a shard ran out of memory.
+    template<class Iterator>
+    std::size_t bulk_load(Iterator first, Iterator last, std::size_t threads,
+                          std::size_t rank = 0, std::size_t ranks = 1){
+      load_job<Iterator> job(m_shards.size());
+      for(Iterator it = first; it != last; ++it){
+        const std::size_t shard = shard_of(it->first);
+        if(shard % ranks == rank){ job.by_shard[shard].push_back(it); }
+      }
+
+      boost::thread_group loaders;
+      for(std::size_t i = 1; i < threads; ++i){
+        loaders.create_thread([&]{ load_shards(job); });
+      }
+      load_shards(job);
+      loaders.join_all();
+      return job.loaded.load();
+    }
+
+    /*Size*/
+    size_t size() const {
+      size_t total = 0;
+      for(std::size_t i = 0; i < m_shards.size(); ++i){ total += m_shards[i]->size(); }
+      return total;
+    }
+
+    /*Registry*/
+    static std::vector<map_entry> list(const std::string & registry_name=DEFAULT_REGISTRY){
+      return registry(registry_name).maps();
+    }
+
+    //The registered parameters of a map, false if it isn't registered. Opens none of its segments.
+    static bool registered(const std::string & name, map_entry & entry,
+                           const std::string & registry_name=DEFAULT_REGISTRY){
+      return registry(registry_name).find(name, entry);
+    }
+
+    //Registered parameters and per shard statistics of a map, false if it isn't registered
+    static bool inspect(const std::string & name, map_info & info,
+                        const std::string & registry_name=DEFAULT_REGISTRY){
+      if(!registry(registry_name).find(name, info.entry)){ return false; }
+      info.shards.clear();
+      for(std::size_t i = 0; i < info.entry.shards; ++i){
+        shard_info shard = { segment_name(name, i), false, 0, 0, 0, 0 };
+        try {
+          shm_robust::managed_shared_memory segment(boost::interprocess::open_only, shard.segment.c_str());
+          //find takes the segment's allocator lock, a writer mid-allocation holds it briefly
+          ShmSafeHashMap * map = segment.find<ShmSafeHashMap>(name.c_str()).first;
+          shard.exists = map != 0;
+          shard.entries = map ? map->size() : 0;
+          shard.recoveries = map ? map->recoveries() : 0;
+          shard.bytes = segment.get_size();
+          shard.free_bytes = segment.get_free_memory();
+        } catch(const boost::interprocess::interprocess_exception &){
+          //segment missing
+        }
+        info.shards.push_back(shard);
+      }
+      return true;
+    }
+
+    //Remove the map's segments and registration
+    static bool remove(const std::string & name, const std::string & registry_name=DEFAULT_REGISTRY){
+      map_entry entry;
+      if(!registry(registry_name).find(name, entry)){ return false; }
+      for(std::size_t i = 0; i < entry.shards; ++i){
+        ShmStringHashMap::remove(segment_name(name, i));
+      }
+      return registry(registry_name).erase(name);
+    }
+  };
+
+}//namespace
+
+#endif // __SHM_SHARDED_MAP__H_
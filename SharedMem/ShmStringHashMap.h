@@ -11,23 +11,34 @@
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/interprocess/allocators/allocator.hpp>
 #include <boost/interprocess/containers/string.hpp>
+#include <boost/interprocess/containers/deque.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/functional/hash.hpp>
+#include <boost/utility/string_view.hpp>
 #include <functional>
+#include <cstring>
 
 #include <boost/interprocess/sync/interprocess_upgradable_mutex.hpp>
 #include <boost/interprocess/sync/scoped_lock.hpp>
 #include <boost/interprocess/sync/sharable_lock.hpp>
 #include <boost/interprocess/sync/upgradable_lock.hpp>
 
+#include "ShmFutex.h"
+#include "ShmMapJournal.h"
+#include "ShmReadPins.h"
+#include "ShmRobustMutex.h"
+#include "../Metrics.h"
+
 
 namespace shm_string_hashmap {
-  typedef boost::interprocess::allocator<char, boost::interprocess::managed_shared_memory::segment_manager> CharAllocator;
+  //a writer killed inside an allocation mustn't leave the segment locked
+  typedef shm_robust::managed_shared_memory ManagedSegment;
+  typedef boost::interprocess::allocator<char, ManagedSegment::segment_manager> CharAllocator;
   typedef boost::interprocess::basic_string<char, std::char_traits<char>, CharAllocator> ShmString;
   typedef ShmString KeyType;
   typedef ShmString MappedType;
   typedef std::pair<const KeyType, MappedType> ValueType;
-  typedef boost::interprocess::allocator<ValueType, boost::interprocess::managed_shared_memory::segment_manager> ShmAlloc;
+  typedef boost::interprocess::allocator<ValueType, ManagedSegment::segment_manager> ShmAlloc;
   typedef boost::unordered_map<KeyType, MappedType, boost::hash<KeyType>, std::equal_to<KeyType>, ShmAlloc> ShmHashMap;
 
   template<class T>
@@ -38,57 +49,635 @@ namespace shm_string_hashmap {
   { return std::string(val.begin(), val.end());}
 
   template<class T>
-  inline ShmString to_shm_string(const T &val, boost::interprocess::managed_shared_memory & segment){
+  inline ShmString to_shm_string(const T &val, ManagedSegment & segment){
     std::ostringstream ostr;
     ostr << val;
     return ShmString(ostr.str().c_str(),segment.get_allocator<ShmString>());
   }
 
+  //Lookups by boost::string_view, so a key is only copied into the segment when
+  //it is inserted. Hashes like boost::hash<ShmString>, which is hash_range.
+  struct view_hash {
+    std::size_t operator()(const boost::string_view & key) const
+    { return boost::hash_range(key.begin(), key.end()); }
+  };
+
+  struct view_equal {
+    bool operator()(const boost::string_view & a, const ShmString & b) const
+    { return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size()) == 0; }
+    bool operator()(const ShmString & a, const boost::string_view & b) const
+    { return (*this)(b, a); }
+  };
+
+  inline bool equals(const ShmString & a, const boost::string_view & b)
+  { return view_equal()(b, a); }
+
+  //Values replaced while readers had something pinned, by the epoch they were retired at
+  typedef std::pair<boost::uint64_t, ShmString> RetiredValue;
+  typedef boost::interprocess::allocator<RetiredValue, ManagedSegment::segment_manager> RetiredAlloc;
+  typedef boost::interprocess::deque<RetiredValue, RetiredAlloc> RetiredValues;
+
+  //A value read in place from the segment, no copy. It stays valid and unchanged
+  //until the view is reset or destroyed, however the map is written meanwhile:
+  //writers retire a pinned value instead of overwriting it. Values short enough to
+  //be stored inside their entry are copied into the view instead, as are all values
+  //when every pin slot is taken. Don't keep views longer than needed (retired
+  //values are only freed once no view could see them) and don't let one outlive
+  //the ShmStringHashMap it was read from.
+  class value_view {
+  private:
+    read_pins * m_pins;
+    std::size_t m_slot;
+    const char * m_data;
+    std::size_t m_size;
+    std::string m_copy;
+
+    value_view(const value_view &);
+    value_view & operator=(const value_view &);
+
+    friend class ShmSafeHashMap;
+
+    //Under the map's sharable lock
+    void bind(read_pins & pins, const ShmString & value){
+      const char * object = reinterpret_cast<const char *>(&value);
+      const bool in_entry = value.data() >= object && value.data() < object + sizeof(ShmString);
+      m_slot = in_entry ? read_pins::NONE : pins.pin();
+      if(m_slot == read_pins::NONE){
+        m_copy.assign(value.data(), value.size());
+        m_data = m_copy.data();
+      } else {
+        m_pins = &pins;
+        m_data = value.data();
+      }
+      m_size = value.size();
+    }
+
+  public:
+    value_view(): m_pins(0), m_slot(read_pins::NONE), m_data(0), m_size(0){}
+
+    ~value_view(){ reset(); }
+
+    void reset(){
+      if(m_pins){ m_pins->unpin(m_slot); }
+      m_pins = 0;
+      m_slot = read_pins::NONE;
+      m_data = 0;
+      m_size = 0;
+      m_copy.clear();
+    }
+
+    const char * data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+    boost::string_view str() const { return boost::string_view(m_data, m_size); }
+
+    //Read in place rather than copied
+    bool pinned() const { return m_pins != 0; }
+  };
+
+  //Per process lock statistics, the map itself lives in shared memory.
+  //Compiled out unless ENABLE_METRICS.
+  struct lock_metrics {
+    metrics::Histogram read_lock_ns;  //time to get the sharable lock
+    metrics::Histogram write_lock_ns; //time to get the exclusive lock, or to upgrade to it
+    metrics::Histogram check_lock_ns; //time to get the upgradable lock
+    metrics::Counter contended;       //acquisitions that couldn't try_lock
+    metrics::Counter skipped_writes;  //conditional writes that found nothing to change
+
+    lock_metrics():
+      read_lock_ns("ShmSafeHashMap.read_lock_ns"), write_lock_ns("ShmSafeHashMap.write_lock_ns"),
+      check_lock_ns("ShmSafeHashMap.check_lock_ns"), contended("ShmSafeHashMap.contended"),
+      skipped_writes("ShmSafeHashMap.skipped_writes"){}
+
+    static lock_metrics & get(){
+      static lock_metrics instance;
+      return instance;
+    }
+  };
+
   using boost::unordered_map;
   class ShmSafeHashMap {
   private:
     typedef boost::interprocess::interprocess_upgradable_mutex upgradable_mutex_type;
+    typedef ManagedSegment::segment_manager segment_manager;
     mutable upgradable_mutex_type m_mutex;
-    ShmHashMap m_shm_hashmap;
+    boost::interprocess::offset_ptr<segment_manager> m_segment_manager;
+    boost::interprocess::offset_ptr<ShmHashMap> m_shm_hashmap; //replaced when a recovery rebuilds it
+    boost::interprocess::offset_ptr<ShmHashMap> m_staging;     //journaled inserts build their node here
+    boost::atomic<boost::uint32_t> m_version; //bumped by every write
+    shm_futex::ShmEventCount m_updated;
+    map_journal m_journal;
+    read_pins m_pins;
+    RetiredValues m_retired; //oldest first
+
+    enum access_mode { READ, CHECK, WRITE };
+
+    //Holds the map's lock in one mode: sharable, upgradable or exclusive. With a
+    //journal it also counts this process as a user of the lock while it waits for
+    //or holds it, and gives up waiting on a lock a dead user may hold to recover it.
+    class access {
+    private:
+      const ShmSafeHashMap & m_map;
+      access_mode m_mode;
+
+      bool try_acquire(){
+        switch(m_mode){
+        case READ: return m_map.m_mutex.try_lock_sharable();
+        case CHECK: return m_map.m_mutex.try_lock_upgradable();
+        default: return m_map.m_mutex.try_lock();
+        }
+      }
+
+      bool acquire_until(const boost::posix_time::ptime & deadline){
+        switch(m_mode){
+        case READ: return m_map.m_mutex.timed_lock_sharable(deadline);
+        case CHECK: return m_map.m_mutex.timed_lock_upgradable(deadline);
+        default: return m_map.m_mutex.timed_lock(deadline);
+        }
+      }
+
+      static boost::posix_time::ptime next_step(){
+        return boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100);
+      }
+
+      //A user of the lock is dead: step out of the journal so the recovery can
+      //start, run it (unless another process does) and count back in
+      bool recover_if_needed(){
+        if(!journal().enabled() || !journal().needs_recovery()){ return false; }
+        journal().leave();
+        const_cast<ShmSafeHashMap &>(m_map).recover();
+        journal().enter();
+        return true;
+      }
+
+      void acquire(){
+        while(!acquire_until(next_step())){
+          recover_if_needed();
+        }
+      }
+
+      metrics::Histogram & histogram() const {
+        lock_metrics & m = lock_metrics::get();
+        return m_mode == READ ? m.read_lock_ns : m_mode == CHECK ? m.check_lock_ns : m.write_lock_ns;
+      }
+
+      map_journal & journal() const { return const_cast<map_journal &>(m_map.m_journal); }
+
+    public:
+      access(const ShmSafeHashMap & map, access_mode mode): m_map(map), m_mode(mode){
+        if(journal().enabled()){ journal().enter(); }
+        const boost::uint64_t start = metrics::Now();
+        if(!try_acquire()){
+          lock_metrics::get().contended.Add();
+          acquire();
+        }
+        histogram().Record(metrics::Now() - start);
+      }
+
+      //Trade the upgradable lock for the exclusive one once the readers have left.
+      //No other writer can get in between, so whatever was checked still holds.
+      //Returns false if a reader died holding its lock instead: the map was
+      //recovered and this holds a new upgradable lock, so check again.
+      bool upgrade(){
+        const boost::uint64_t start = metrics::Now();
+        while(!m_map.m_mutex.timed_unlock_upgradable_and_lock(next_step())){
+          if(journal().enabled() && journal().needs_recovery()){
+            m_map.m_mutex.unlock_upgradable();
+            recover_if_needed();
+            if(!try_acquire()){ acquire(); }
+            return false;
+          }
+        }
+        m_mode = WRITE;
+        lock_metrics::get().write_lock_ns.Record(metrics::Now() - start);
+        return true;
+      }
+
+      ~access(){
+        switch(m_mode){
+        case READ: m_map.m_mutex.unlock_sharable(); break;
+        case CHECK: m_map.m_mutex.unlock_upgradable(); break;
+        default: m_map.m_mutex.unlock(); break;
+        }
+        if(journal().enabled()){ journal().leave(); }
+      }
+    };
+
+    void notify_updated(){
+      m_version.fetch_add(1, boost::memory_order_release);
+      m_updated.notify_all();
+    }
+
+    ShmHashMap::iterator lookup(const boost::string_view & key){
+      return m_shm_hashmap->find(key, view_hash(), view_equal());
+    }
+
+    ShmHashMap::const_iterator lookup(const boost::string_view & key) const {
+      return m_shm_hashmap->find(key, view_hash(), view_equal());
+    }
+
+    static void put(ShmHashMap & map, ShmHashMap::iterator it, const boost::string_view & key, const boost::string_view & val){
+      if(it != map.end()){
+        it->second.assign(val.begin(), val.end());
+        return;
+      }
+      const CharAllocator alloc(map.get_allocator());
+      map.emplace(ShmString(key.data(), key.size(), alloc), ShmString(val.data(), val.size(), alloc));
+    }
+
+    //Keep a replaced value for the readers that may have it pinned
+    void retire(ShmString & old){
+      m_retired.push_back(RetiredValue(m_pins.retire(), ShmString(old.get_allocator())));
+      m_retired.back().second.swap(old);
+    }
+
+    //Free the retired values no pin can see anymore
+    void reclaim(){
+      if(m_retired.empty()){ return; }
+      const boost::uint64_t oldest = m_pins.oldest(m_retired.front().first);
+      while(!m_retired.empty() && m_retired.front().first < oldest){
+        m_retired.pop_front();
+      }
+    }
+
+    //Give an entry a new value, retiring the old one if anything is pinned
+    void replace(ShmString & value, const boost::string_view & val){
+      if(!m_pins.pinned()){
+        value.assign(val.begin(), val.end());
+        return;
+      }
+      ShmString fresh(val.data(), val.size(), value.get_allocator());
+      value.swap(fresh);
+      retire(fresh);
+    }
+
+    //Set key's value under the exclusive lock, it is key's entry or end()
+    void store(ShmHashMap::iterator it, const boost::string_view & key, const boost::string_view & val){
+      reclaim();
+      if(!m_journal.enabled()){
+        if(it != m_shm_hashmap->end()){ replace(it->second, val); }
+        else { put(*m_shm_hashmap, it, key, val); }
+        return;
+      }
+      ShmHashMap & map = *m_shm_hashmap;
+      const CharAllocator alloc(map.get_allocator());
+      const bool pinned = m_pins.pinned();
+      m_journal.begin(key, it != map.end() ? &it->second : (const ShmString *)0, val);
+
+      //a value with room is copied over in place, otherwise everything is
+      //allocated before touching the table, so that a crash inside the swap
+      //below can only tear the entry's value and only one inside the link
+      //can leave the table inconsistent
+      try {
+        if(it != map.end() && !pinned && it->second.capacity() >= val.size()){
+          m_journal.advance(map_journal::OVERWRITE);
+          it->second.assign(val.begin(), val.end());
+        } else if(it != map.end()){
+          ShmString fresh(val.data(), val.size(), alloc);
+          m_journal.advance(map_journal::SWAP);
+          it->second.swap(fresh);
+          m_journal.advance(map_journal::RELEASE);
+          if(pinned){ retire(fresh); }
+        } else {
+          m_staging->emplace(ShmString(key.data(), key.size(), alloc), ShmString(val.data(), val.size(), alloc));
+          ShmHashMap::node_type node = m_staging->extract(m_staging->begin());
+          m_journal.advance(map_journal::LINK);
+          map.insert(boost::move(node));
+        }
+      } catch(...){
+        //out of memory: the table is as it was, a later recovery mustn't replay the write
+        m_staging->clear();
+        m_journal.commit();
+        throw;
+      }
+      m_journal.commit();
+    }
+
+    static bool skip_write(){
+      lock_metrics::get().skipped_writes.Add();
+      return false;
+    }
+
+    //Finish the write of a writer that died: roll it forward if the journal kept
+    //the new value. Only a crash while linking can have damaged the table.
+    void complete_write(){
+      const map_journal::write_phase phase = m_journal.phase();
+      if(phase == map_journal::LINK){
+        rebuild();
+        return;
+      }
+      if(phase == map_journal::SWAP){
+        complete_swap();
+        return;
+      }
+      if(phase == map_journal::PREPARE){ //the staging table may be half built
+        m_staging = m_segment_manager->construct<ShmHashMap>(boost::interprocess::anonymous_instance)
+          (1, m_shm_hashmap->hash_function(), m_shm_hashmap->key_eq(), m_shm_hashmap->get_allocator());
+      }
+      const boost::uint32_t flags = m_journal.flags();
+      if(!(flags & map_journal::HAS_KEY)){
+        if(phase == map_journal::OVERWRITE){
+          log_error("ShmSafeHashMap recovery: the interrupted write's key didn't fit the journal, its value may be torn");
+        }
+        return;
+      }
+      const boost::string_view key = m_journal.key();
+      ShmHashMap::iterator it = lookup(key);
+      if(flags & map_journal::HAS_REDO){
+        if(it != m_shm_hashmap->end()){ replace(it->second, m_journal.redo()); }
+        else { put(*m_shm_hashmap, it, key, m_journal.redo()); }
+      } else if(phase == map_journal::OVERWRITE && (flags & map_journal::HAS_UNDO)){
+        replace(it->second, m_journal.undo());
+      } else if(phase == map_journal::OVERWRITE){
+        m_shm_hashmap->erase(it);
+        log_error("ShmSafeHashMap recovery: the interrupted write's value didn't fit the journal, its key was dropped");
+      }
+    }
+
+    //A writer died swapping a new value into an existing entry. The table is
+    //intact, but the entry's string may be half swapped: it is constructed
+    //afresh in place, leaking what either side pointed to, and given the value
+    //from the journal.
+    void complete_swap(){
+      const boost::uint32_t flags = m_journal.flags();
+      if(!(flags & map_journal::HAS_KEY)){
+        log_error("ShmSafeHashMap recovery: the interrupted write's key didn't fit the journal, its value may be torn");
+        return;
+      }
+      ShmHashMap::iterator it = lookup(m_journal.key());
+      if(it == m_shm_hashmap->end()){ return; }
+
+      new (&it->second) ShmString(CharAllocator(m_shm_hashmap->get_allocator()));
+      if(flags & map_journal::HAS_REDO){
+        it->second.assign(m_journal.redo().begin(), m_journal.redo().end());
+      } else if(flags & map_journal::HAS_UNDO){
+        it->second.assign(m_journal.undo().begin(), m_journal.undo().end());
+      } else {
+        m_shm_hashmap->erase(it);
+        log_error("ShmSafeHashMap recovery: the interrupted write's value didn't fit the journal, its key was dropped");
+      }
+    }
+
+    //Segment bytes a string takes besides its object, with the allocator's header
+    static std::size_t string_bytes(const ShmString & str){
+      const char * object = reinterpret_cast<const char *>(&str);
+      const bool in_entry = str.data() >= object && str.data() < object + sizeof(ShmString);
+      return in_entry ? 0 : str.capacity() + 1 + 2 * sizeof(void *);
+    }
+
+    //Roughly what rebuild() allocates to copy old, walking at most limit entries
+    static std::size_t rebuild_bytes(const ShmHashMap & old, std::size_t limit){
+      const std::size_t node_bytes = sizeof(ValueType) + 4 * sizeof(void *);
+      std::size_t bytes = (old.bucket_count() + 1) * 2 * sizeof(void *);
+      std::size_t walked = 0;
+      for(ShmHashMap::const_iterator it = old.begin(); it != old.end() && walked < limit; ++it, ++walked){
+        bytes += node_bytes + string_bytes(it->first) + string_bytes(it->second);
+      }
+      return bytes + bytes / 8; //slack for fragmentation
+    }
+
+    //Copy every entry but the interrupted one into a new table, then redo (or
+    //undo) the interrupted write on it. The old table may be inconsistent, so it
+    //is walked with a bound and left allocated rather than destroyed, which
+    //takes about as much free memory again as the table uses: without it the
+    //old table is kept as it is. Throws if an allocation fails anyway.
+    void rebuild(){
+      ShmHashMap & old = *m_shm_hashmap;
+      const std::size_t limit = old.size() + 1;
+      const std::size_t needed = rebuild_bytes(old, limit);
+      if(m_segment_manager->get_free_memory() < needed){
+        log_error(("ShmSafeHashMap recovery: rebuilding the table needs about " + to_string(needed) + " free bytes, only "
+                   + to_string(m_segment_manager->get_free_memory()) + " left; the table may be inconsistent").c_str());
+        return;
+      }
+
+      ShmHashMap * fresh = m_segment_manager->construct<ShmHashMap>(boost::interprocess::anonymous_instance)
+        (old.bucket_count(), old.hash_function(), old.key_eq(), old.get_allocator());
+
+      const boost::uint32_t flags = m_journal.flags();
+      const bool has_key = flags & map_journal::HAS_KEY;
+      const boost::string_view key = m_journal.key();
+      std::size_t walked = 0;
+      try {
+        for(ShmHashMap::const_iterator it = old.begin(); it != old.end() && walked < limit; ++it, ++walked){
+          if(has_key && equals(it->first, key)){ continue; }
+          fresh->emplace(it->first, it->second);
+        }
+        if(has_key && (flags & map_journal::HAS_REDO)){
+          put(*fresh, fresh->end(), key, m_journal.redo());
+        } else if(has_key && (flags & map_journal::HAS_UNDO)){
+          put(*fresh, fresh->end(), key, m_journal.undo());
+        }
+      } catch(...){
+        m_segment_manager->destroy_ptr(fresh); //the copy is consistent, the old table stays
+        throw;
+      }
+
+      if(!has_key){
+        log_error("ShmSafeHashMap recovery: the interrupted write's key didn't fit the journal, its entry may be damaged");
+      } else if(!(flags & (map_journal::HAS_REDO | map_journal::HAS_UNDO)) && (flags & map_journal::EXISTED)){
+        log_error("ShmSafeHashMap recovery: the interrupted write's value didn't fit the journal, its key was dropped");
+      }
+      if(walked == limit || fresh->size() + 1 < old.size()){
+        log_error("ShmSafeHashMap recovery: the table was damaged, entries may be missing");
+      }
+
+      m_shm_hashmap = fresh;
+    }
 
   public:
+    //journal_bytes: room for the key and values of one write, 0 for no journal
     explicit ShmSafeHashMap(size_t bucket_count,
                             const boost::hash<KeyType>& hash,
                             const std::equal_to<KeyType>& equal,
-                            const ShmAlloc& alloc):
-      m_shm_hashmap(bucket_count, hash, equal, alloc){}
+                            const ShmAlloc& alloc,
+                            boost::uint32_t journal_bytes = 0):
+      m_segment_manager(alloc.get_segment_manager()),
+      m_shm_hashmap(m_segment_manager->construct<ShmHashMap>(boost::interprocess::anonymous_instance)(bucket_count, hash, equal, alloc)),
+      m_staging(journal_bytes ? m_segment_manager->construct<ShmHashMap>(boost::interprocess::anonymous_instance)(1, hash, equal, alloc) : 0),
+      m_version(0),
+      m_journal(journal_bytes ? static_cast<char *>(m_segment_manager->allocate(map_journal::bytes_for(journal_bytes))) : 0,
+                journal_bytes),
+      m_retired(RetiredAlloc(m_segment_manager.get())){}
+
+    ~ShmSafeHashMap(){
+      m_segment_manager->destroy_ptr(m_shm_hashmap.get());
+      if(m_staging){ m_segment_manager->destroy_ptr(m_staging.get()); }
+      if(m_journal.enabled()){ m_segment_manager->deallocate(m_journal.region()); }
+    }
+
+    bool find(const boost::string_view & key, std::string & val) const {
+      access lock(*this, READ);
+      ShmHashMap::const_iterator iter = lookup(key);
+      if (iter == m_shm_hashmap->end()) {
+        return false;
+      }
+      val.assign(iter->second.begin(), iter->second.end());
+      return true;
+    }
 
     bool find(const ShmString & key, std::string & val) const {
-      boost::interprocess::sharable_lock<upgradable_mutex_type> lock(m_mutex);
-      ShmHashMap::const_iterator iter = m_shm_hashmap.find(key);
-      if (iter == m_shm_hashmap.end()) {
+      return find(boost::string_view(key.data(), key.size()), val);
+    }
+
+    //Like find, but view reads the value in place, see value_view
+    bool find_view(const boost::string_view & key, value_view & view) const {
+      view.reset();
+      access lock(*this, READ);
+      ShmHashMap::const_iterator iter = lookup(key);
+      if (iter == m_shm_hashmap->end()) {
         return false;
       }
-      val = to_string(iter->second);
+      view.bind(const_cast<read_pins &>(m_pins), iter->second);
+      return true;
+    }
+
+    bool insert(const boost::string_view & key, const boost::string_view & val){
+      {
+        access lock(*this, WRITE);
+        store(lookup(key), key, val);
+      }
+
+      notify_updated();
       return true;
     }
 
     bool insert(const ShmString & key, const ShmString & val){
-      boost::interprocess::scoped_lock<upgradable_mutex_type> lock(m_mutex);
-      ShmHashMap::iterator it = m_shm_hashmap.find(key);
-      if(it!=m_shm_hashmap.end()){
-        it->second = val;
-        return true;
+      return insert(boost::string_view(key.data(), key.size()), boost::string_view(val.data(), val.size()));
+    }
+
+    /*Conditional writes*/
+    //Each checks under the upgradable lock, which readers share, and only takes the
+    //exclusive lock when it has something to write.
+
+    //Insert key only if it is missing, false if it was there
+    bool insert_if_absent(const boost::string_view & key, const boost::string_view & val){
+      {
+        access lock(*this, CHECK);
+        ShmHashMap::iterator it;
+        do {
+          it = lookup(key);
+          if(it != m_shm_hashmap->end()){ return skip_write(); }
+        } while(!lock.upgrade());
+        store(it, key, val);
+      }
+
+      notify_updated();
+      return true;
+    }
+
+    //Set key to desired only if its value is expected, false if it isn't (or is missing)
+    bool compare_and_set(const boost::string_view & key, const boost::string_view & expected,
+                         const boost::string_view & desired){
+      {
+        access lock(*this, CHECK);
+        ShmHashMap::iterator it;
+        do {
+          it = lookup(key);
+          if(it == m_shm_hashmap->end() || !equals(it->second, expected)){ return false; }
+          if(expected == desired){ skip_write(); return true; }
+        } while(!lock.upgrade());
+        store(it, key, desired);
+      }
+
+      notify_updated();
+      return true;
+    }
+
+    //Read-modify-write in one step. fn(std::string & value, bool found) edits a copy of
+    //the value ("" if key is missing) and returns false to leave the map alone. Nothing
+    //is written if the value comes back unchanged. Returns true if the map changed.
+    //fn runs under the lock: keep it short and don't use the map from it. It runs
+    //again on a fresh copy if the map had to be recovered before the write.
+    template<class F>
+    bool update(const boost::string_view & key, F fn){
+      std::string value;
+      {
+        access lock(*this, CHECK);
+        ShmHashMap::iterator it;
+        do {
+          it = lookup(key);
+          const bool found = it != m_shm_hashmap->end();
+          if(found){ value.assign(it->second.begin(), it->second.end()); }
+          else { value.clear(); }
+          if(!fn(value, found) || (found && equals(it->second, value))){ return skip_write(); }
+        } while(!lock.upgrade());
+        store(it, key, value);
+      }
+
+      notify_updated();
+      return true;
+    }
+
+    //val = key's value, inserting fn() first if key is missing. Processes racing on a
+    //missing key call fn once between them. Returns true if fn was called.
+    template<class F>
+    bool get_or_compute(const boost::string_view & key, F fn, std::string & val){
+      if(find(key, val)){ return false; }
+      {
+        access lock(*this, CHECK);
+        ShmHashMap::iterator it;
+        bool computed = false;
+        do {
+          it = lookup(key);
+          if(it != m_shm_hashmap->end()){
+            val.assign(it->second.begin(), it->second.end());
+            return false;
+          }
+          if(!computed){ val = fn(); computed = true; }
+        } while(!lock.upgrade());
+        store(it, key, val);
+      }
+
+      notify_updated();
+      return true;
+    }
+
+    /*Recovery*/
+    //Take over the lock from a process that died using it, completing its write
+    //if it died mid-write. Returns false if there was nothing to recover. Runs when
+    //a process opens the map and when a lock waiter finds a user dead.
+    //Completing the write may fail, e.g. on a full segment: that is logged and
+    //the claim released all the same, or every user would wait on it forever.
+    bool recover(){
+      if(!m_journal.enabled() || !m_journal.begin_recovery()){ return false; }
+      new (&m_mutex) upgradable_mutex_type(); //nobody else is using it, any holder is dead
+      try {
+        if(m_journal.phase() != map_journal::IDLE){ complete_write(); }
+      } catch(const std::exception & e){
+        log_error((std::string("ShmSafeHashMap recovery: completing the interrupted write failed, the map may be inconsistent: ")
+                   + e.what()).c_str());
       }
+      m_journal.end_recovery();
+      notify_updated();
+      return true;
+    }
+
+    boost::uint32_t recoveries() const {
+      return m_journal.recoveries();
+    }
 
-      return m_shm_hashmap.insert(ValueType(key,val)).second;
+    boost::uint32_t version() const {
+      return m_version.load(boost::memory_order_acquire);
+    }
+
+    //Block until a write happens after version seen, returns false on timeout
+    bool wait_for_update(boost::uint32_t & seen, const boost::posix_time::time_duration & timeout){
+      boost::uint32_t now = seen;
+      const bool updated = m_updated.await([&]{ return (now = version()) != seen; }, timeout);
+      seen = now;
+      return updated;
     }
 
     void dump(){
-      boost::interprocess::sharable_lock<upgradable_mutex_type> lock(m_mutex);
-      ShmHashMap::const_iterator iter = m_shm_hashmap.begin();
-      for(;iter!=m_shm_hashmap.end();++iter){
+      access lock(*this, READ);
+      ShmHashMap::const_iterator iter = m_shm_hashmap->begin();
+      for(;iter!=m_shm_hashmap->end();++iter){
         std::cout<<iter->first<<" "<<iter->second<<std::endl;
       }
     }
 
     size_t size(){
-      return m_shm_hashmap.size();
+      return m_shm_hashmap->size();
     }
   };
 
@@ -100,7 +689,7 @@ namespace shm_string_hashmap {
     std::string m_hashmap_name;
     int m_hashmap_size;
 
-    mutable boost::interprocess::managed_shared_memory m_segment;
+    mutable ManagedSegment m_segment;
     ShmSafeHashMap * m_shm_hashmap_ptr;
 
     bool checkValid() const {
@@ -115,8 +704,11 @@ namespace shm_string_hashmap {
   public:
     /*Constructor*/
     //open or create
+    //journal_bytes only matters to the process that creates the map: room to journal
+    //the key and values of one write, 0 for no journal and no crash recovery
     ShmStringHashMap(const std::string & shm_name, const std::string & hashmap_name,
-                     const int & shm_bytes=655350, const int & hashmap_size=3000):
+                     const int & shm_bytes=655350, const int & hashmap_size=3000,
+                     const int & journal_bytes=0):
       m_shm_name(shm_name), m_shm_bytes(shm_bytes),
       m_hashmap_name(hashmap_name),m_hashmap_size(hashmap_size),
       m_segment(boost::interprocess::open_or_create, m_shm_name.c_str(), m_shm_bytes){
@@ -129,9 +721,13 @@ namespace shm_string_hashmap {
         (m_hashmap_size,                       // initial bucket count
          boost::hash<KeyType>(),               // the hash function
          std::equal_to<KeyType>(),             // the equality function
-         m_segment.get_allocator<ValueType>());  // the allocator
+         m_segment.get_allocator<ValueType>(),   // the allocator
+         journal_bytes);                       // journal for crash recovery
 
-      checkValid();
+      //repair the map if a process died holding its lock
+      if(checkValid() && m_shm_hashmap_ptr->recover()){
+        log_error("ShmStringHashMap: recovered from a process that died holding the lock");
+      }
     }
 
     /*Insert*/
@@ -139,31 +735,79 @@ namespace shm_string_hashmap {
       //check
       if(!checkValid()){ return false; }
 
-      //find
-      ShmString shm_key = to_shm_string(key,m_segment);
-      ShmString shm_val = to_shm_string(val,m_segment);
-      return m_shm_hashmap_ptr->insert(shm_key, shm_val);
+      //insert, the key is only copied into the segment if it is new
+      return m_shm_hashmap_ptr->insert(boost::string_view(key), boost::string_view(val));
     }
 
     bool append(const std::string & key,std::string & val){
       //check
       if(!checkValid()){ return false; }
 
-      //find
-      ShmString shm_key = to_shm_string(key,m_segment);
-      std::string orig_val;
-      m_shm_hashmap_ptr->find(shm_key,orig_val);
+      //read, append and write back under one lock
+      m_shm_hashmap_ptr->update(boost::string_view(key), [&](std::string & orig_val, bool){
+          orig_val += val;
+          return true;
+        });
+      return true;
+    }
+
+    /*Conditional writes*/
+    bool insert_if_absent(const std::string & key, const std::string & val){
+      if(!checkValid()){ return false; }
+      return m_shm_hashmap_ptr->insert_if_absent(boost::string_view(key), boost::string_view(val));
+    }
 
-      //insert
-      ShmString shm_val = to_shm_string(orig_val+val,m_segment);
-      return m_shm_hashmap_ptr->insert(shm_key, shm_val);
+    bool compare_and_set(const std::string & key, const std::string & expected, const std::string & desired){
+      if(!checkValid()){ return false; }
+      return m_shm_hashmap_ptr->compare_and_set(boost::string_view(key), boost::string_view(expected),
+                                                boost::string_view(desired));
+    }
+
+    //fn(std::string & value, bool found), see ShmSafeHashMap::update
+    template<class F>
+    bool update(const std::string & key, F fn){
+      if(!checkValid()){ return false; }
+      return m_shm_hashmap_ptr->update(boost::string_view(key), fn);
+    }
+
+    //std::string fn(), see ShmSafeHashMap::get_or_compute
+    template<class F>
+    bool get_or_compute(const std::string & key, F fn, std::string & val){
+      if(!checkValid()){ return false; }
+      return m_shm_hashmap_ptr->get_or_compute(boost::string_view(key), fn, val);
     }
 
     /*Find*/
     bool find(const std::string & key,std::string & val) const {
       if(!checkValid()){ return false; }
 
-      return m_shm_hashmap_ptr->find(to_shm_string(key,m_segment), val);
+      return m_shm_hashmap_ptr->find(boost::string_view(key), val);
+    }
+
+    //Zero-copy find, the value stays pinned in the segment while view holds it
+    bool find_view(const std::string & key, value_view & view) const {
+      if(!checkValid()){ view.reset(); return false; }
+
+      return m_shm_hashmap_ptr->find_view(boost::string_view(key), view);
+    }
+
+    /*Wait*/
+    //Block until another process writes to the map. Start with seen = version().
+    boost::uint32_t version() const {
+      if(!checkValid()){ return 0; }
+      return m_shm_hashmap_ptr->version();
+    }
+
+    bool wait_for_update(boost::uint32_t & seen, const boost::posix_time::time_duration & timeout){
+      if(!checkValid()){ return false; }
+      return m_shm_hashmap_ptr->wait_for_update(seen, timeout);
+    }
+
+    /*Recovery*/
+    //Writers found dead and recovered from since the map was created
+    boost::uint32_t recoveries() const {
+      if(!checkValid()){ return 0; }
+      return m_shm_hashmap_ptr->recoveries();
     }
 
     /*Dump*/
@@ -177,6 +821,11 @@ namespace shm_string_hashmap {
       return m_segment.destroy<ShmSafeHashMap>(m_hashmap_name.c_str());
     }
 
+    //Remove the segment itself, processes that have it open keep their mapping
+    static bool remove(const std::string & shm_name){
+      return boost::interprocess::shared_memory_object::remove(shm_name.c_str());
+    }
+
     /*Size*/
     size_t size() const {
       if(!checkValid()){ return 0; }
@@ -0,0 +1,339 @@
+#ifndef __SHM_WORK_QUEUE__H_
+#define __SHM_WORK_QUEUE__H_
+
+#include <string>
+#include <cstring>
+#include <new>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+
+#include "ShmFutex.h"
+#include "ShmProcess.h"
+#include "ShmRingBuffer.h"
+
+//Job queue shared by any number of producer and worker processes, no broker.
+//
+//Jobs live in a fixed table of slots, each holding up to max_payload bytes.
+//Two MpmcRings of slot numbers move them around: the free ring holds empty
+//slots, the ready ring holds submitted jobs. A job is never copied between
+//the rings: a producer takes a free slot, writes the payload in place and
+//queues its number, a worker claims the number and reads the payload in place.
+//
+//Claim/ack: a claimed job stays in its slot, leased to the worker's pid, until
+//the worker acks it (slot freed) or nacks it (job queued again). recover() finds
+//leases held by processes that no longer exist and queues their jobs again, so a
+//worker crash delays its jobs but never loses them. Delivery is at least once:
+//job::attempts tells a worker it is seeing a job again.
+//
+//Blocking calls spin and then park on the rings' futexes, nothing enters the
+//kernel unless a peer is actually parked.
+//
+//A process killed in the few instructions between taking a ring position and
+//leasing the slot loses that slot, the same window MpmcRing itself has.
+
+namespace shm_work_queue {
+
+  using shm_ring_buffer::CACHE_LINE_SIZE;
+  using shm_ring_buffer::align_up;
+  using shm_ring_buffer::MpmcRing;
+
+  using shm_process::current_pid;
+  using shm_process::process_alive;
+
+  //A claimed job, valid until acked or nacked
+  struct job {
+    const char * data;         //payload, in the segment
+    boost::uint32_t len;
+    boost::uint32_t attempts;  //1 on first delivery
+    boost::uint32_t slot;
+    boost::uint64_t lease;
+  };
+
+  class WorkQueue {
+  private:
+    typedef boost::atomic<boost::uint64_t> atomic_lease;
+    static const std::size_t SLOT_HEADER = 24;
+
+    enum slot_state { FREE, WRITING, READY, CLAIMED };
+
+    //lease = (leases taken << 32) | holder pid, pid 0 when nobody holds the slot
+    struct Slot {
+      atomic_lease lease;
+      boost::atomic<boost::uint32_t> state;
+      boost::uint32_t len;
+      boost::uint32_t attempts;
+      boost::uint32_t reserved;
+      char * payload() { return reinterpret_cast<char *>(this) + SLOT_HEADER; }
+    };
+
+    static const boost::uint32_t INDEX_BYTES = sizeof(boost::uint32_t);
+
+    boost::uint32_t m_slot_count;
+    boost::uint32_t m_max_payload;
+    boost::uint32_t m_slot_stride;
+    boost::uint32_t m_reserved;
+    boost::uint64_t m_ready_offset;
+    boost::uint64_t m_slots_offset;
+    char m_pad0[CACHE_LINE_SIZE - 4*sizeof(boost::uint32_t) - 2*sizeof(boost::uint64_t)];
+
+    boost::atomic<boost::uint64_t> m_requeued;
+    char m_pad1[CACHE_LINE_SIZE - sizeof(boost::atomic<boost::uint64_t>)];
+
+    static std::size_t header_bytes() { return align_up(sizeof(WorkQueue), CACHE_LINE_SIZE); }
+
+    static std::size_t slot_stride(boost::uint32_t max_payload)
+    { return align_up(SLOT_HEADER + max_payload, CACHE_LINE_SIZE); }
+
+    static std::size_t ring_bytes(std::size_t slots)
+    { return align_up(MpmcRing::bytes_for(2 * slots, INDEX_BYTES), CACHE_LINE_SIZE); }
+
+    char * base() { return reinterpret_cast<char *>(this); }
+
+    MpmcRing & free_ring() { return *reinterpret_cast<MpmcRing *>(base() + header_bytes()); }
+    MpmcRing & ready_ring() { return *reinterpret_cast<MpmcRing *>(base() + m_ready_offset); }
+
+    Slot & slot_at(boost::uint32_t index)
+    { return *reinterpret_cast<Slot *>(base() + m_slots_offset + (std::size_t)index * m_slot_stride); }
+
+    static boost::uint64_t next_lease(boost::uint64_t lease, pid_t pid)
+    { return ((lease >> 32) + 1) << 32 | (boost::uint32_t)pid; }
+
+    static boost::uint64_t released(boost::uint64_t lease)
+    { return lease & ~(boost::uint64_t)0xFFFFFFFFu; }
+
+    struct read_index {
+      boost::uint32_t & out;
+      void operator()(const char * data, boost::uint32_t) const { std::memcpy(&out, data, INDEX_BYTES); }
+    };
+
+    static bool pop_index(MpmcRing & ring, boost::uint32_t & index){
+      read_index f = { index };
+      return ring.consume(f, 1) == 1;
+    }
+
+    static void push_index(MpmcRing & ring, boost::uint32_t index){
+      //a ring has room for twice the slot numbers, so it only looks full while a
+      //consumer preempted mid-pop still holds the position we wrap onto
+      while(!ring.try_push(&index, INDEX_BYTES)){ shm_futex::cpu_relax(); }
+    }
+
+    void make_ready(boost::uint32_t index){
+      slot_at(index).state.store(READY, boost::memory_order_release);
+      push_index(ready_ring(), index);
+    }
+
+    void make_free(boost::uint32_t index){
+      slot_at(index).state.store(FREE, boost::memory_order_release);
+      push_index(free_ring(), index);
+    }
+
+  public:
+    WorkQueue(std::size_t slots, boost::uint32_t max_payload):
+      m_slot_count((boost::uint32_t)slots), m_max_payload(max_payload), m_slot_stride((boost::uint32_t)slot_stride(max_payload)),
+      m_reserved(0), m_ready_offset(header_bytes() + ring_bytes(slots)),
+      m_slots_offset(m_ready_offset + ring_bytes(slots)), m_requeued(0){
+      new (&free_ring()) MpmcRing(2 * slots, INDEX_BYTES);
+      new (&ready_ring()) MpmcRing(2 * slots, INDEX_BYTES);
+      for(boost::uint32_t i = 0; i < m_slot_count; ++i){
+        Slot & slot = slot_at(i);
+        new (&slot.lease) atomic_lease(0);
+        new (&slot.state) boost::atomic<boost::uint32_t>(FREE);
+        slot.len = 0;
+        slot.attempts = 0;
+        push_index(free_ring(), i);
+      }
+    }
+
+    //Bytes to reserve for the queue, header included
+    static std::size_t bytes_for(std::size_t slots, boost::uint32_t max_payload){
+      return header_bytes() + 2 * ring_bytes(slots) + slots * slot_stride(max_payload);
+    }
+
+    /*Producers*/
+    //Queue a copy of data, false if every slot is in use or len > max_payload
+    bool try_submit(const void * data, boost::uint32_t len){
+      if(len > m_max_payload){ return false; }
+      boost::uint32_t index;
+      if(!pop_index(free_ring(), index)){ return false; }
+
+      Slot & slot = slot_at(index);
+      const boost::uint64_t lease = next_lease(slot.lease.load(boost::memory_order_relaxed), current_pid());
+      //state before lease: whoever wins the lease in recover() sees this state
+      slot.state.store(WRITING, boost::memory_order_relaxed);
+      slot.lease.store(lease, boost::memory_order_release);
+
+      std::memcpy(slot.payload(), data, len);
+      slot.len = len;
+      slot.attempts = 0;
+      slot.lease.store(released(lease), boost::memory_order_relaxed);
+      make_ready(index);
+      return true;
+    }
+
+    //Wait up to timeout for a free slot
+    bool submit(const void * data, boost::uint32_t len, const boost::posix_time::time_duration & timeout){
+      if(len > m_max_payload){ return false; }
+      const boost::int64_t deadline_us = shm_futex::monotonic_us() + timeout.total_microseconds();
+      for(;;){
+        if(try_submit(data, len)){ return true; }
+        const boost::int64_t left = deadline_us - shm_futex::monotonic_us();
+        if(left <= 0 || !free_ring().wait_readable(boost::posix_time::microseconds(left))){
+          return try_submit(data, len);
+        }
+      }
+    }
+
+    /*Workers*/
+    //Lease the oldest ready job to this process
+    bool try_claim(job & out){
+      boost::uint32_t index;
+      if(!pop_index(ready_ring(), index)){ return false; }
+
+      Slot & slot = slot_at(index);
+      const boost::uint64_t lease = next_lease(slot.lease.load(boost::memory_order_relaxed), current_pid());
+      slot.state.store(CLAIMED, boost::memory_order_relaxed);
+      slot.lease.store(lease, boost::memory_order_release);
+
+      out.data = slot.payload();
+      out.len = slot.len;
+      out.attempts = ++slot.attempts;
+      out.slot = index;
+      out.lease = lease;
+      return true;
+    }
+
+    //Wait up to timeout for a job
+    bool claim(job & out, const boost::posix_time::time_duration & timeout){
+      const boost::int64_t deadline_us = shm_futex::monotonic_us() + timeout.total_microseconds();
+      for(;;){
+        if(try_claim(out)){ return true; }
+        const boost::int64_t left = deadline_us - shm_futex::monotonic_us();
+        if(left <= 0 || !ready_ring().wait_readable(boost::posix_time::microseconds(left))){
+          return try_claim(out);
+        }
+      }
+    }
+
+    //Done with the job, its slot is free again. False if the lease was lost to recover().
+    bool ack(const job & j){
+      boost::uint64_t lease = j.lease;
+      if(!slot_at(j.slot).lease.compare_exchange_strong(lease, released(lease), boost::memory_order_acq_rel)){
+        return false;
+      }
+      make_free(j.slot);
+      return true;
+    }
+
+    //Give the job back to be claimed again, by any worker
+    bool nack(const job & j){
+      boost::uint64_t lease = j.lease;
+      if(!slot_at(j.slot).lease.compare_exchange_strong(lease, released(lease), boost::memory_order_acq_rel)){
+        return false;
+      }
+      make_ready(j.slot);
+      return true;
+    }
+
+    /*Recovery*/
+    //Queue again the jobs leased to dead processes and free the slots dead producers
+    //were writing. Safe to call from any number of processes at once, returns the
+    //number of jobs queued again. Call it periodically or when a worker exits.
+    std::size_t recover(){
+      std::size_t requeued = 0;
+      for(boost::uint32_t i = 0; i < m_slot_count; ++i){
+        Slot & slot = slot_at(i);
+        const boost::uint32_t seen = slot.state.load(boost::memory_order_acquire);
+        if(seen != CLAIMED && seen != WRITING){ continue; }
+
+        boost::uint64_t lease = slot.lease.load(boost::memory_order_acquire);
+        const pid_t holder = (pid_t)(lease & 0xFFFFFFFFu);
+        if(!holder || process_alive(holder)){ continue; }
+        if(!slot.lease.compare_exchange_strong(lease, released(lease), boost::memory_order_acq_rel)){
+          continue; //another process recovered it first
+        }
+
+        //the slot may have been acked and reused by a producer since the first
+        //load, only the state that went with the lease we took counts
+        if(slot.state.load(boost::memory_order_acquire) == CLAIMED){
+          make_ready(i);
+          ++requeued;
+        } else {
+          make_free(i);
+        }
+      }
+      if(requeued){ m_requeued.fetch_add(requeued, boost::memory_order_relaxed); }
+      return requeued;
+    }
+
+    /*Observers*/
+    bool empty() { return ready_ring().empty(); }
+    std::size_t capacity() const { return m_slot_count; }
+    boost::uint32_t max_payload() const { return m_max_payload; }
+
+    //Jobs queued again by recover() since the queue was created
+    boost::uint64_t requeued() const { return m_requeued.load(boost::memory_order_relaxed); }
+  };
+
+  //Owns a managed_shared_memory segment holding one named WorkQueue
+  class ShmWorkQueue {
+  private:
+    std::string m_shm_name;
+    std::string m_queue_name;
+    boost::interprocess::managed_shared_memory m_segment;
+    WorkQueue * m_queue;
+
+    //Room for the segment manager and the name index on top of the queue
+    static std::size_t segment_bytes(std::size_t slots, boost::uint32_t max_payload){
+      return WorkQueue::bytes_for(slots, max_payload) + 65536;
+    }
+
+    struct find_or_construct_queue {
+      boost::interprocess::managed_shared_memory & segment;
+      const char * name;
+      std::size_t slots;
+      boost::uint32_t max_payload;
+      WorkQueue * & out;
+
+      void operator()(){
+        typedef boost::uint64_t word; //named arrays of words are 8 byte aligned
+        std::pair<word *, std::size_t> found = segment.find<word>(name);
+        if(found.first){
+          out = reinterpret_cast<WorkQueue *>(found.first);
+          return;
+        }
+        const std::size_t words = (WorkQueue::bytes_for(slots, max_payload) + sizeof(word) - 1) / sizeof(word);
+        word * memory = segment.construct<word>(name)[words](0);
+        out = new (memory) WorkQueue(slots, max_payload);
+      }
+    };
+
+  public:
+    /*Constructor*/
+    //open or create, slots and max_payload only matter to the process that creates it.
+    //If anything fails, throws interprocess_exception
+    ShmWorkQueue(const std::string & shm_name, const std::string & queue_name,
+                 std::size_t slots=4096, boost::uint32_t max_payload=1024):
+      m_shm_name(shm_name), m_queue_name(queue_name),
+      m_segment(boost::interprocess::open_or_create, m_shm_name.c_str(), segment_bytes(slots, max_payload)),
+      m_queue(0){
+      //under the segment lock, so only one process constructs the queue
+      find_or_construct_queue f = { m_segment, m_queue_name.c_str(), slots, max_payload, m_queue };
+      m_segment.atomic_func(f);
+    }
+
+    WorkQueue & queue() { return *m_queue; }
+    WorkQueue * operator->() { return m_queue; }
+
+    /*Remove*/
+    static bool remove(const std::string & shm_name){
+      return boost::interprocess::shared_memory_object::remove(shm_name.c_str());
+    }
+  };
+
+}//namespace
+
+#endif // __SHM_WORK_QUEUE__H_
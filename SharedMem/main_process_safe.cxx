@@ -76,6 +76,27 @@ namespace shm_string_hashmap {
       return m_shm_hashmap.insert(ValueType(key,val)).second;
     }
 
+    //Read-modify-write under one lock: fn(value, found) edits a copy of the value
+    //and returns false to leave it alone. Checks under the upgradable lock, which
+    //readers share, and only upgrades to the exclusive lock for a real change.
+    template<class F>
+    bool update(const ShmString & key, F fn){
+      boost::interprocess::upgradable_lock<upgradable_mutex_type> lock(m_mutex);
+      ShmHashMap::iterator it = m_shm_hashmap.find(key);
+      const bool found = it != m_shm_hashmap.end();
+      std::string val = found ? to_string(it->second) : std::string();
+      if(!fn(val, found) || (found && val == to_string(it->second))){
+        return false;
+      }
+
+      boost::interprocess::scoped_lock<upgradable_mutex_type> write_lock(boost::move(lock));
+      if(found){
+        it->second.assign(val.begin(), val.end());
+        return true;
+      }
+      return m_shm_hashmap.insert(ValueType(key, ShmString(val.c_str(), key.get_allocator()))).second;
+    }
+
     void dump(){
       boost::interprocess::sharable_lock<upgradable_mutex_type> lock(m_mutex);
       ShmHashMap::const_iterator iter = m_shm_hashmap.begin();
@@ -146,14 +167,13 @@ namespace shm_string_hashmap {
       //check
       if(!checkValid()){ return false; }
 
-      //find
+      //read, append and write back under one lock, so concurrent appends don't get lost
       ShmString shm_key = to_shm_string(key,m_segment);
-      std::string orig_val;
-      m_shm_hashmap_ptr->find(shm_key,orig_val);
-
-      //insert
-      ShmString shm_val = to_shm_string(orig_val+val,m_segment);
-      return m_shm_hashmap_ptr->insert(shm_key, shm_val);
+      m_shm_hashmap_ptr->update(shm_key, [&](std::string & orig_val, bool){
+          orig_val += val;
+          return true;
+        });
+      return true;
     }
 
     /*Find*/
@@ -0,0 +1,344 @@
+#ifndef __SYNCHRONISED_QUEUE__H_
+#define __SYNCHRONISED_QUEUE__H_
+
+#include <boost/thread.hpp>
+#include <boost/range/begin.hpp>
+#include <boost/range/end.hpp>
+#include <boost/circular_buffer.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+#include "ObjectPool.h"
+#include "QueueClosed.h"
+#include "Metrics.h"
+
+// What a bounded queue does with Enqueue when it is full
+enum OverflowPolicy{
+  BlockWhenFull, // Wait for room
+  FailWhenFull,  // Reject the new item, Enqueue returns false
+  DropOldest     // Discard the oldest queued item to make room
+};
+
+// Shared by every SynchronisedQueue, compiled out unless ENABLE_METRICS
+struct SynchronisedQueueMetrics{
+  metrics::Counter enqueued;
+  metrics::Counter dequeued;
+  metrics::Counter dropped;
+  metrics::Counter consumer_parks; // Dequeue found the queue empty and waited
+  metrics::Counter producer_parks; // Enqueue found the queue full and waited
+  metrics::Histogram depth;        // Queue size seen by each Enqueue
+  metrics::Histogram queued_ns;    // Time items spent in the queue
+  metrics::Histogram park_ns;      // Time spent waiting on a condition
+
+  SynchronisedQueueMetrics():
+    enqueued("SynchronisedQueue.enqueued"), dequeued("SynchronisedQueue.dequeued"),
+    dropped("SynchronisedQueue.dropped"),
+    consumer_parks("SynchronisedQueue.consumer_parks"), producer_parks("SynchronisedQueue.producer_parks"),
+    depth("SynchronisedQueue.depth", metrics::Histogram::VALUE),
+    queued_ns("SynchronisedQueue.queued_ns"), park_ns("SynchronisedQueue.park_ns"){}
+
+  static SynchronisedQueueMetrics& Get(){
+    static SynchronisedQueueMetrics instance;
+    return instance;
+  }
+};
+
+// Queue class that has thread synchronisation.
+// Unbounded by default; with a capacity, memory stays bounded under overload
+// and the OverflowPolicy decides who pays. Close() wakes every waiter: producers
+// are refused from then on, consumers drain what is left and then get false.
+// Allocator places the ring storage, e.g. NumaAllocator on the node of the workers.
+template <typename T, typename Allocator=std::allocator<T> >
+class SynchronisedQueue{
+private:
+  // An item and, with metrics on, when it was queued. Stamp is empty otherwise.
+  struct Entry : metrics::Stamp{
+    T value;
+    template <typename... Args>
+    explicit Entry(Args&&... args): value(std::forward<Args>(args)...){}
+  };
+
+  // Ring storage that only grows, so the steady state doesn't allocate
+  boost::circular_buffer<Entry, typename std::allocator_traits<Allocator>::template rebind_alloc<Entry> > m_queue;
+  const std::size_t m_capacity; // 0 for unbounded
+  const OverflowPolicy m_policy;
+  bool m_closed;
+  std::size_t m_dropped; // Items discarded by DropOldest
+  int m_consumers_waiting; // Only notify when someone waits
+  int m_producers_waiting;
+  boost::mutex m_mutex; // The mutex to synchronise on
+  boost::condition_variable m_cond; // Data is ready or the queue closed
+  boost::condition_variable m_not_full; // Room is available or the queue closed
+  boost::scoped_ptr<ObjectPool<T> > m_pool; // Optional recycled message buffers
+
+  bool Full() const { return m_capacity && m_queue.size()>=m_capacity; }
+
+  // Wait on cond until ready() or the deadline, m_mutex must be held
+  template <typename Ready>
+  bool Wait(boost::unique_lock<boost::mutex>& lock, boost::condition_variable& cond, int& waiting,
+            Ready ready, const boost::system_time* deadline){
+    if (ready()) return true;
+
+    SynchronisedQueueMetrics& stats=SynchronisedQueueMetrics::Get();
+    (&cond==&m_cond ? stats.consumer_parks : stats.producer_parks).Add();
+    const boost::uint64_t start=metrics::Now();
+
+    ++waiting;
+    bool ok=true;
+    while (!ready()){
+      if (!deadline) cond.wait(lock);
+      else if (!cond.timed_wait(lock, *deadline)){ ok=ready(); break; }
+    }
+    --waiting;
+
+    stats.park_ns.Record(metrics::Now()-start);
+    return ok;
+  }
+
+  // Make room for one item following the policy, m_mutex must be held.
+  // block=false turns BlockWhenFull into FailWhenFull.
+  bool MakeRoom(boost::unique_lock<boost::mutex>& lock, bool block, const boost::system_time* deadline){
+    if (m_closed) return false;
+    if (!Full()) return true;
+
+    switch (m_policy){
+    case DropOldest:
+      m_queue.pop_front(); ++m_dropped;
+      SynchronisedQueueMetrics::Get().dropped.Add();
+      return true;
+    case FailWhenFull:
+      return false;
+    case BlockWhenFull:
+      if (!block) return false;
+      return Wait(lock, m_not_full, m_producers_waiting, [this]{ return m_closed || !Full(); }, deadline)
+        && !m_closed;
+    }
+    return false;
+  }
+
+  // Construct an item at the back, m_mutex must be held
+  template <typename... Args>
+  void Push(Args&&... args){
+    if (m_queue.full()) m_queue.set_capacity(std::max<std::size_t>(16, m_queue.capacity()*2));
+    SynchronisedQueueMetrics& stats=SynchronisedQueueMetrics::Get();
+    stats.depth.Record(m_queue.size());
+    stats.enqueued.Add();
+    m_queue.push_back(Entry(std::forward<Args>(args)...));
+  }
+
+  // Move the front item out, m_mutex must be held
+  void Pop(T& result){
+    Entry& front=m_queue.front();
+    SynchronisedQueueMetrics& stats=SynchronisedQueueMetrics::Get();
+    stats.queued_ns.Record(front.Age());
+    stats.dequeued.Add();
+    result=std::move(front.value); m_queue.pop_front();
+  }
+
+  template <typename... Args>
+  bool Insert(bool block, const boost::system_time* deadline, Args&&... args){
+    // Acquire lock on the queue
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    if (!MakeRoom(lock, block, deadline)) return false;
+
+    // Add the data to the queue
+    Push(std::forward<Args>(args)...);
+
+    // Notify others that data is ready
+    if (m_consumers_waiting) m_cond.notify_one();
+    return true;
+  } // Lock is automatically released here
+
+  bool Remove(T& result, bool block, const boost::system_time* deadline){
+    // Acquire lock on the queue
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    // When there is no data, wait till someone fills it or closes the queue.
+    // Lock is automatically released in the wait and obtained
+    // again after the wait
+    if (m_queue.empty()){
+      if (!block) return false;
+      Wait(lock, m_cond, m_consumers_waiting, [this]{ return m_closed || !m_queue.empty(); }, deadline);
+      if (m_queue.empty()) return false;
+    }
+
+    // Move the data out of the queue
+    Pop(result);
+    if (m_producers_waiting) m_not_full.notify_one();
+    return true;
+  } // Lock is automatically released here
+
+public:
+  // capacity 0 means unbounded
+  explicit SynchronisedQueue(std::size_t capacity=0, OverflowPolicy policy=BlockWhenFull,
+                             const Allocator& alloc=Allocator()):
+    m_queue(capacity ? capacity : 16, alloc), m_capacity(capacity), m_policy(policy),
+    m_closed(false), m_dropped(0), m_consumers_waiting(0), m_producers_waiting(0){}
+
+  // Add data to the queue and notify others.
+  // Returns false if the queue is closed or full under FailWhenFull.
+  bool Enqueue(const T& data){
+    return Insert(true, 0, data);
+  }
+
+  bool Enqueue(T&& data){
+    return Insert(true, 0, std::move(data));
+  }
+
+  // Build the data from args and add it to the queue
+  template <typename... Args>
+  bool Emplace(Args&&... args){
+    return Insert(true, 0, std::forward<Args>(args)...);
+  }
+
+  // Add data only if that doesn't need to wait for room
+  template <typename U>
+  bool TryEnqueue(U&& data){
+    return Insert(false, 0, std::forward<U>(data));
+  }
+
+  // Add data, waiting at most timeout for room
+  template <typename U>
+  bool TimedEnqueue(U&& data, const boost::posix_time::time_duration& timeout){
+    const boost::system_time deadline=boost::get_system_time()+timeout;
+    return Insert(true, &deadline, std::forward<U>(data));
+  }
+
+  // Get data from the queue. Wait for data if not available.
+  // Throws QueueClosed once the queue is closed and drained.
+  T Dequeue(){
+    T result;
+    if (!Remove(result, true, 0)) throw QueueClosed();
+    return result;
+  }
+
+  // Get data from the queue, returns false once closed and drained
+  bool Dequeue(T& result){
+    return Remove(result, true, 0);
+  }
+
+  bool TryDequeue(T& result){
+    return Remove(result, false, 0);
+  }
+
+  // Get data, waiting at most timeout for it
+  bool TimedDequeue(T& result, const boost::posix_time::time_duration& timeout){
+    const boost::system_time deadline=boost::get_system_time()+timeout;
+    return Remove(result, true, &deadline);
+  }
+
+  // Add a batch of data under one lock and wake consumers once.
+  // Under BlockWhenFull this waits for room as needed; returns how many were added.
+  template <typename InputIterator>
+  std::size_t EnqueueBulk(InputIterator first, InputIterator last){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    std::size_t n=0;
+    for (; first!=last; ++first, ++n){
+      if (Full() && n && m_consumers_waiting) m_cond.notify_all(); // Let consumers make room
+      if (!MakeRoom(lock, true, 0)) break;
+      Push(*first);
+    }
+
+    if (m_consumers_waiting){
+      if (n==1) m_cond.notify_one();
+      else if (n>1) m_cond.notify_all();
+    }
+    return n;
+  }
+
+  template <typename Range>
+  std::size_t EnqueueBulk(const Range& range){
+    return EnqueueBulk(boost::begin(range), boost::end(range));
+  }
+
+  // Get up to max items under one lock. Waits up to timeout for the first
+  // item and returns how many were written to out (0 on timeout or when
+  // the queue is closed and drained).
+  template <typename OutputIterator>
+  std::size_t DequeueBulk(OutputIterator out, std::size_t max, const boost::posix_time::time_duration& timeout){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    const boost::system_time deadline=boost::get_system_time()+timeout;
+    Wait(lock, m_cond, m_consumers_waiting, [this]{ return m_closed || !m_queue.empty(); }, &deadline);
+
+    return Take(out, max);
+  }
+
+  // Get everything currently queued without waiting
+  template <typename OutputIterator>
+  std::size_t DrainAll(OutputIterator out){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return Take(out, m_queue.size());
+  }
+
+  // Refuse new items and wake every waiter. Items already queued can still
+  // be dequeued.
+  void Close(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    m_closed=true;
+    m_cond.notify_all();
+    m_not_full.notify_all();
+  }
+
+  bool IsClosed(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_closed;
+  }
+
+  std::size_t Size(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_queue.size();
+  }
+
+  // Items discarded so far by DropOldest
+  std::size_t Dropped(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_dropped;
+  }
+
+  // Grow the storage up front so Enqueue doesn't allocate below n items
+  void Reserve(std::size_t n){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    if (n>m_queue.capacity()) m_queue.set_capacity(n);
+  }
+
+  // Keep up to pool_size consumed buffers for AcquireBuffer().
+  // Call before the queue is shared between threads.
+  void EnableBufferPool(std::size_t pool_size){
+    m_pool.reset(pool_size ? new ObjectPool<T>(pool_size) : 0);
+  }
+
+  // Get a buffer to build a message in, recycled if the pool has one
+  T AcquireBuffer(){
+    return m_pool ? m_pool->Acquire() : T();
+  }
+
+  // Hand a consumed message back for reuse
+  void RecycleBuffer(T&& buffer){
+    if (m_pool) m_pool->Release(std::move(buffer));
+  }
+
+private:
+  // Move up to max items to out and wake producers, m_mutex must be held
+  template <typename OutputIterator>
+  std::size_t Take(OutputIterator out, std::size_t max){
+    std::size_t n=0;
+    T item;
+    for (; n<max && !m_queue.empty(); ++n){
+      Pop(item);
+      *out++=std::move(item);
+    }
+
+    if (m_producers_waiting){
+      if (n==1) m_not_full.notify_one();
+      else if (n>1) m_not_full.notify_all();
+    }
+    return n;
+  }
+};
+
+#endif // __SYNCHRONISED_QUEUE__H_
@@ -0,0 +1,266 @@
+#ifndef __TASK_GRAPH__H_
+#define __TASK_GRAPH__H_
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <exception>
+#include <utility>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Futures with continuations and dependency-driven tasks on a ThreadPool.
+// A task starts as soon as every future it depends on is ready, on whichever
+// worker is free, so independent stages overlap instead of waiting on joins.
+//
+//   TaskGraph graph(pool);
+//   Future<Data> a=graph.Add(Load);
+//   Future<Data> b=graph.Add(Fetch);
+//   Future<Result> c=graph.Add([=]{ return Merge(a.Get(), b.Get()); }, a, b);
+//   Future<void> d=c.Then([](const Result& r){ Report(r); });
+//   graph.Wait(); // a, b and c
+//   d.Wait();
+//
+// The graph only tracks what was Add()ed: Then() continuations belong to no
+// graph, wait on their futures directly.
+// An exception thrown by a task is stored in its future, rethrown by Get(),
+// and passed on to every task and continuation depending on it.
+
+// Value of a ready Future<void>
+struct FutureUnit{};
+
+template <typename T> struct FutureStorage{ typedef T type; };
+template <> struct FutureStorage<void>{ typedef FutureUnit type; };
+
+// What every future state shares, whatever its value type
+class FutureStateBase{
+private:
+  boost::mutex m_mutex;
+  boost::condition_variable m_ready_cond;
+  bool m_ready;
+  std::vector<boost::function<void()> > m_continuations;
+
+public:
+  ThreadPool* const pool;
+  std::exception_ptr error; // Set before the state is ready, read after
+
+  explicit FutureStateBase(ThreadPool* executor): m_ready(false), pool(executor){}
+
+  bool IsReady(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_ready;
+  }
+
+  // Run f once ready, right away if it already is. f runs on the thread that
+  // completes the state, so it should only hand work on.
+  void OnReady(const boost::function<void()>& f){
+    {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      if (!m_ready){ m_continuations.push_back(f); return; }
+    }
+    f();
+  }
+
+  void Complete(){
+    std::vector<boost::function<void()> > continuations;
+    {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      m_ready=true;
+      continuations.swap(m_continuations);
+      m_ready_cond.notify_all();
+    }
+    for (std::size_t i=0; i<continuations.size(); ++i) continuations[i]();
+  }
+
+  void Fail(std::exception_ptr e){
+    error=e;
+    Complete();
+  }
+
+  // Block until ready. A pool worker runs other tasks meanwhile instead, so
+  // waiting inside a task can't starve the pool of the task it waits for.
+  void Wait(){
+    const bool worker=pool->CurrentWorker()>=0;
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (!m_ready){
+      if (!worker){ m_ready_cond.wait(lock); continue; }
+      lock.unlock();
+      const bool helped=pool->RunPendingTask();
+      lock.lock();
+      if (!helped && !m_ready) m_ready_cond.timed_wait(lock, boost::posix_time::milliseconds(1));
+    }
+  }
+};
+
+template <typename T>
+class FutureState : public FutureStateBase{
+public:
+  boost::optional<typename FutureStorage<T>::type> value;
+
+  explicit FutureState(ThreadPool* executor): FutureStateBase(executor){}
+
+  // Run f, keeping its result or exception, then complete
+  template <typename F>
+  void Run(F& f){
+    try {
+      Store(f, (T*)0);
+      Complete();
+    } catch (...) {
+      Fail(std::current_exception());
+    }
+  }
+
+private:
+  template <typename F, typename U>
+  void Store(F& f, U*){ value=f(); }
+
+  template <typename F>
+  void Store(F& f, void*){ f(); value=FutureUnit(); }
+};
+
+template <typename T>
+class Future;
+
+// Calls a continuation with the value of a ready state, or with nothing for void
+template <typename T>
+struct FutureApply{
+  template <typename F>
+  static auto Call(F& f, FutureState<T>& state) -> decltype(f(*state.value)) { return f(*state.value); }
+  static const T& Get(FutureState<T>& state){ return *state.value; }
+};
+
+template <>
+struct FutureApply<void>{
+  template <typename F>
+  static auto Call(F& f, FutureState<void>&) -> decltype(f()) { return f(); }
+  static void Get(FutureState<void>&){}
+};
+
+template <typename T>
+class Future{
+private:
+  boost::shared_ptr<FutureState<T> > m_state;
+
+public:
+  Future(){}
+  explicit Future(const boost::shared_ptr<FutureState<T> >& state): m_state(state){}
+
+  bool Valid() const { return m_state.get()!=0; }
+  bool IsReady() const { return m_state->IsReady(); }
+
+  void Wait() const { m_state->Wait(); }
+
+  // Wait for the value, rethrowing the task's exception if it threw
+  auto Get() const -> decltype(FutureApply<T>::Get(*m_state)) {
+    m_state->Wait();
+    if (m_state->error) std::rethrow_exception(m_state->error);
+    return FutureApply<T>::Get(*m_state);
+  }
+
+  // Run f(value) (f() for Future<void>) on the pool once this is ready.
+  // If this future failed, f is skipped and the result fails the same way.
+  // No TaskGraph waits for f, wait on the returned future.
+  template <typename F>
+  auto Then(F f) const -> Future<decltype(FutureApply<T>::Call(f, *m_state))> {
+    typedef decltype(FutureApply<T>::Call(f, *m_state)) R;
+    const boost::shared_ptr<FutureState<T> > self=m_state;
+    const boost::shared_ptr<FutureState<R> > next(new FutureState<R>(self->pool));
+
+    self->OnReady([self, next, f]{
+        self->pool->Submit([self, next, f]() mutable {
+            if (self->error) next->Fail(self->error);
+            else {
+              auto call=[&]{ return FutureApply<T>::Call(f, *self); };
+              next->Run(call);
+            }
+          });
+      });
+    return Future<R>(next);
+  }
+
+  // Type independent access, for dependency tracking
+  boost::shared_ptr<FutureStateBase> State() const { return m_state; }
+};
+
+// Tasks with dependencies on a shared ThreadPool
+class TaskGraph{
+private:
+  ThreadPool& m_pool;
+  boost::atomic<std::size_t> m_outstanding; // Added and not finished
+  boost::mutex m_mutex;
+  boost::condition_variable m_done;
+
+  typedef std::vector<boost::shared_ptr<FutureStateBase> > Dependencies;
+
+  static void Collect(Dependencies&){}
+
+  template <typename D, typename... Rest>
+  static void Collect(Dependencies& deps, const D& dep, const Rest&... rest){
+    deps.push_back(dep.State());
+    Collect(deps, rest...);
+  }
+
+  void Finished(){
+    if (m_outstanding.fetch_sub(1, boost::memory_order_acq_rel)==1){
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      m_done.notify_all();
+    }
+  }
+
+public:
+  explicit TaskGraph(ThreadPool& pool): m_pool(pool), m_outstanding(0){}
+
+  // Tasks hold on to the graph, so let them finish
+  ~TaskGraph(){
+    Wait();
+  }
+
+  // Run f() once every dependency (any Future) is ready. If one of them
+  // failed, f is skipped and its future fails with the same exception.
+  template <typename F, typename... Deps>
+  auto Add(F f, const Deps&... deps) -> Future<decltype(f())> {
+    typedef decltype(f()) R;
+    const boost::shared_ptr<FutureState<R> > state(new FutureState<R>(&m_pool));
+    const boost::shared_ptr<Dependencies> inputs(new Dependencies);
+    Collect(*inputs, deps...);
+    m_outstanding.fetch_add(1, boost::memory_order_relaxed);
+
+    // One count per dependency, plus one released below once all are registered
+    const boost::shared_ptr<boost::atomic<std::size_t> > remaining(new boost::atomic<std::size_t>(inputs->size()+1));
+    TaskGraph* graph=this;
+    const boost::function<void()> arrive=[graph, state, inputs, remaining, f]{
+      if (remaining->fetch_sub(1, boost::memory_order_acq_rel)!=1) return;
+      graph->m_pool.Submit([graph, state, inputs, f]() mutable {
+          std::exception_ptr error;
+          for (std::size_t i=0; i<inputs->size() && !error; ++i) error=(*inputs)[i]->error;
+          if (error) state->Fail(error);
+          else state->Run(f);
+          graph->Finished();
+        });
+    };
+    for (std::size_t i=0; i<inputs->size(); ++i) (*inputs)[i]->OnReady(arrive);
+    arrive();
+    return Future<R>(state);
+  }
+
+  // Block until every task added so far has finished, helping from a worker.
+  // Continuations from Then() aren't counted.
+  void Wait(){
+    const bool worker=m_pool.CurrentWorker()>=0;
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (m_outstanding.load()!=0){
+      if (!worker){ m_done.wait(lock); continue; }
+      lock.unlock();
+      const bool helped=m_pool.RunPendingTask();
+      lock.lock();
+      if (!helped && m_outstanding.load()!=0) m_done.timed_wait(lock, boost::posix_time::milliseconds(1));
+    }
+  }
+
+  ThreadPool& Pool(){ return m_pool; }
+};
+
+#endif // __TASK_GRAPH__H_
@@ -0,0 +1,222 @@
+#ifndef __THREAD_PLACEMENT__H_
+#define __THREAD_PLACEMENT__H_
+
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Where worker threads run, so the threads sharing a queue stay on the same
+// socket instead of wherever the scheduler last put them.
+//   PlaceNone    - leave it to the OS
+//   PlaceCompact - fill one NUMA node, core by core (hyperthread siblings
+//                  together), before using the next: best when the workers
+//                  share data, like producers and consumers of one queue
+//   PlaceScatter - spread over the nodes and cores round robin, siblings
+//                  last: best for independent, bandwidth hungry workers
+// Worker i is pinned to the i-th CPU of that order, wrapping around. Only
+// CPUs the process may run on (taskset, cgroups) are used.
+//
+// The policy can come from the THREAD_PLACEMENT environment variable
+// (none|compact|scatter), which is what ThreadPool uses by default.
+enum PlacementPolicy{
+  PlaceNone,
+  PlaceCompact,
+  PlaceScatter
+};
+
+class ThreadPlacement{
+private:
+  struct Cpu{
+    int id;
+    int node;
+    int package;
+    int core;
+    int sibling; // 0 for the first hardware thread of a core, 1 for the next...
+  };
+
+  PlacementPolicy m_policy;
+  std::vector<Cpu> m_order; // CPUs in placement order
+
+  static int ReadInt(const std::string& path, int fallback){
+    std::ifstream in(path.c_str());
+    int value;
+    return (in>>value) ? value : fallback;
+  }
+
+  static int NodeOf(int cpu){
+    const std::string dir="/sys/devices/system/cpu/cpu"+boost::lexical_cast<std::string>(cpu)+"/node";
+    for (int node=0; node<1024; ++node)
+      if (access((dir+boost::lexical_cast<std::string>(node)).c_str(), F_OK)==0) return node;
+    return 0;
+  }
+
+  static bool CompactOrder(const Cpu& a, const Cpu& b){
+    if (a.node!=b.node) return a.node<b.node;
+    if (a.package!=b.package) return a.package<b.package;
+    if (a.core!=b.core) return a.core<b.core;
+    return a.id<b.id;
+  }
+
+  static bool ScatterOrder(const Cpu& a, const Cpu& b){
+    if (a.sibling!=b.sibling) return a.sibling<b.sibling;
+    return CompactOrder(a, b);
+  }
+
+  void Discover(){
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)!=0) return;
+
+    std::vector<Cpu> cpus;
+    for (int id=0; id<CPU_SETSIZE; ++id){
+      if (!CPU_ISSET(id, &allowed)) continue;
+      const std::string topology="/sys/devices/system/cpu/cpu"+boost::lexical_cast<std::string>(id)+"/topology/";
+      Cpu cpu;
+      cpu.id=id;
+      cpu.node=NodeOf(id);
+      cpu.package=ReadInt(topology+"physical_package_id", 0);
+      cpu.core=ReadInt(topology+"core_id", id);
+      cpu.sibling=0;
+      cpus.push_back(cpu);
+    }
+
+    // Number the hardware threads of each core
+    std::sort(cpus.begin(), cpus.end(), CompactOrder);
+    for (std::size_t i=1; i<cpus.size(); ++i){
+      const Cpu& prev=cpus[i-1];
+      if (cpus[i].node==prev.node && cpus[i].package==prev.package && cpus[i].core==prev.core)
+        cpus[i].sibling=prev.sibling+1;
+    }
+
+    if (m_policy!=PlaceScatter){
+      m_order.swap(cpus);
+      return;
+    }
+
+    // Round robin over the nodes, each node's CPUs spread over its cores first
+    std::sort(cpus.begin(), cpus.end(), ScatterOrder);
+    std::vector<std::vector<Cpu> > nodes;
+    for (std::size_t i=0; i<cpus.size(); ++i){
+      if ((std::size_t)cpus[i].node>=nodes.size()) nodes.resize(cpus[i].node+1);
+      nodes[cpus[i].node].push_back(cpus[i]);
+    }
+    for (std::size_t i=0; m_order.size()<cpus.size(); ++i)
+      for (std::size_t n=0; n<nodes.size(); ++n)
+        if (i<nodes[n].size()) m_order.push_back(nodes[n][i]);
+  }
+
+public:
+  explicit ThreadPlacement(PlacementPolicy policy=PlaceNone):
+    m_policy(policy){
+    if (m_policy!=PlaceNone) Discover();
+    if (m_order.empty()) m_policy=PlaceNone;
+  }
+
+  // Parse none|compact|scatter, returns false for anything else
+  static bool ParsePolicy(const std::string& name, PlacementPolicy& policy){
+    if (name=="none") policy=PlaceNone;
+    else if (name=="compact") policy=PlaceCompact;
+    else if (name=="scatter") policy=PlaceScatter;
+    else return false;
+    return true;
+  }
+
+  // The policy named by THREAD_PLACEMENT, PlaceNone if unset or unknown
+  static ThreadPlacement FromEnvironment(){
+    PlacementPolicy policy=PlaceNone;
+    const char* name=std::getenv("THREAD_PLACEMENT");
+    if (name) ParsePolicy(name, policy);
+    return ThreadPlacement(policy);
+  }
+
+  PlacementPolicy Policy() const { return m_policy; }
+
+  // CPU for worker i, -1 when not pinning
+  int CpuFor(std::size_t worker) const {
+    return m_order.empty() ? -1 : m_order[worker%m_order.size()].id;
+  }
+
+  // NUMA node worker i runs on, -1 when not pinning
+  int NodeFor(std::size_t worker) const {
+    return m_order.empty() ? -1 : m_order[worker%m_order.size()].node;
+  }
+
+  // Pin the calling thread as worker i. Returns false if not pinning or it failed.
+  bool Pin(std::size_t worker) const {
+    const int cpu=CpuFor(worker);
+    if (cpu<0) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set)==0;
+  }
+};
+
+// Allocate whole pages preferably on a NUMA node. node -1 allocates normally,
+// which on Linux places pages on the node of the thread that first touches them.
+inline void* AllocateOnNode(std::size_t bytes, int node){
+  void* p=mmap(0, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p==MAP_FAILED) throw std::bad_alloc();
+#ifdef SYS_mbind
+  if (node>=0 && node<(int)(8*sizeof(unsigned long))){
+    const int MPOL_PREFERRED_MODE=1; // MPOL_PREFERRED, without needing libnuma
+    unsigned long mask=1ul<<node;
+    syscall(SYS_mbind, p, bytes, MPOL_PREFERRED_MODE, &mask, 8*sizeof(mask), 0); // Only a hint, ignore failure
+  }
+#endif
+  return p;
+}
+
+inline void FreeOnNode(void* p, std::size_t bytes){
+  if (p) munmap(p, bytes);
+}
+
+// STL allocator for storage local to one NUMA node, such as the cells of a
+// queue whose producers and consumers are pinned to that node. Works in
+// pages, so use it for large, long lived buffers.
+template <typename T>
+class NumaAllocator{
+private:
+  int m_node;
+
+  template <typename U> friend class NumaAllocator;
+
+public:
+  typedef T value_type;
+
+  // node -1 leaves placement to the first touch
+  explicit NumaAllocator(int node=-1): m_node(node){}
+
+  template <typename U>
+  NumaAllocator(const NumaAllocator<U>& other): m_node(other.m_node){}
+
+  template <typename U>
+  struct rebind{ typedef NumaAllocator<U> other; };
+
+  T* allocate(std::size_t n){
+    return static_cast<T*>(AllocateOnNode(n*sizeof(T), m_node));
+  }
+
+  void deallocate(T* p, std::size_t n){
+    FreeOnNode(p, n*sizeof(T));
+  }
+
+  int Node() const { return m_node; }
+
+  template <typename U>
+  bool operator==(const NumaAllocator<U>& other) const { return m_node==other.m_node; }
+
+  template <typename U>
+  bool operator!=(const NumaAllocator<U>& other) const { return m_node!=other.m_node; }
+};
+
+#endif // __THREAD_PLACEMENT__H_
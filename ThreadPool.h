@@ -0,0 +1,242 @@
+#ifndef __THREAD_POOL__H_
+#define __THREAD_POOL__H_
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <deque>
+#include <exception>
+#include <iostream>
+
+#include "ThreadPlacement.h"
+
+// Work-stealing executor. Every worker owns a deque of tasks: it pushes and
+// pops its own work at the back (LIFO, cache-warm) while idle workers steal
+// from the front of a randomly chosen victim. Each deque has its own small
+// lock, so there is no global queue mutex. Workers that find nothing park on
+// a condition variable that is only signalled when someone is parked.
+// Worker i is pinned following the ThreadPlacement, THREAD_PLACEMENT by default.
+class ThreadPool{
+public:
+  typedef boost::function<void()> Task;
+
+private:
+  struct Worker{
+    boost::mutex mutex;
+    std::deque<Task> tasks;
+    char pad[64]; // Keep neighbouring workers' locks off one cache line
+  };
+
+  boost::ptr_vector<Worker> m_workers;
+  const ThreadPlacement m_placement;
+  boost::thread_group m_threads;
+
+  boost::atomic<bool> m_stop;
+  boost::atomic<std::size_t> m_next; // Round robin for external submissions
+  boost::atomic<std::size_t> m_pending; // Submitted but not finished
+  boost::atomic<std::size_t> m_failed; // Tasks that threw
+  boost::atomic<int> m_sleepers;
+  boost::mutex m_sleep_mutex;
+  boost::condition_variable m_wake;
+  boost::condition_variable m_idle; // Signalled when m_pending drops to 0
+
+  // Which pool worker the calling thread is, if any
+  struct ThreadState{
+    ThreadPool* pool;
+    std::size_t index;
+    unsigned random;
+  };
+
+  static ThreadState& Current(){
+    static boost::thread_specific_ptr<ThreadState> state;
+    if (!state.get()){
+      ThreadState* s=new ThreadState;
+      s->pool=0; s->index=0;
+      s->random=(unsigned)reinterpret_cast<std::size_t>(s) | 1u;
+      state.reset(s);
+    }
+    return *state;
+  }
+
+  // Index of the calling worker, m_workers.size() for threads outside this pool
+  std::size_t Self() const {
+    const ThreadState& s=Current();
+    return s.pool==this ? s.index : m_workers.size();
+  }
+
+  static unsigned NextRandom(){
+    unsigned& x=Current().random; // xorshift32
+    x^=x<<13; x^=x>>17; x^=x<<5;
+    return x;
+  }
+
+  bool PopLocal(std::size_t self, Task& task){
+    Worker& w=m_workers[self];
+    boost::unique_lock<boost::mutex> lock(w.mutex);
+    if (w.tasks.empty()) return false;
+    task.swap(w.tasks.back()); w.tasks.pop_back();
+    return true;
+  }
+
+  // A quick pass skips victims whose lock is busy, a thorough one waits for it
+  bool Steal(std::size_t self, Task& task, bool thorough){
+    const std::size_t n=m_workers.size();
+    const std::size_t start=NextRandom()%n;
+    for (std::size_t i=0; i<n; ++i){
+      const std::size_t victim=(start+i)%n;
+      if (victim==self) continue;
+      Worker& w=m_workers[victim];
+      boost::unique_lock<boost::mutex> lock(w.mutex, boost::defer_lock);
+      if (thorough) lock.lock();
+      else if (!lock.try_lock()) continue;
+      if (w.tasks.empty()) continue;
+      task.swap(w.tasks.front()); w.tasks.pop_front();
+      return true;
+    }
+    return false;
+  }
+
+  // self may be m_workers.size() for a thread outside the pool
+  bool FindTask(std::size_t self, Task& task, bool thorough=false){
+    return (self<m_workers.size() && PopLocal(self, task)) || Steal(self, task, thorough);
+  }
+
+  // Counts a task finished however it ends, so Wait() can't hang on one that threw
+  class Finished{
+  private:
+    ThreadPool& m_pool;
+    Task& m_task;
+
+  public:
+    Finished(ThreadPool& pool, Task& task): m_pool(pool), m_task(task){}
+    ~Finished(){
+      m_task.clear();
+      if (m_pool.m_pending.fetch_sub(1, boost::memory_order_acq_rel)==1){
+        boost::unique_lock<boost::mutex> lock(m_pool.m_sleep_mutex);
+        m_pool.m_idle.notify_all();
+        if (m_pool.m_stop.load()) m_pool.m_wake.notify_all(); // Let the workers exit
+      }
+    }
+  };
+
+  // An exception escaping a task is logged and dropped: it would otherwise
+  // terminate a worker, or surface in whoever ran the task from RunPendingTask()
+  void Run(Task& task){
+    Finished finished(*this, task);
+    try {
+      task();
+    } catch (const std::exception& e) {
+      m_failed.fetch_add(1, boost::memory_order_relaxed);
+      std::cerr<<"ThreadPool: task threw: "<<e.what()<<std::endl;
+    } catch (...) {
+      m_failed.fetch_add(1, boost::memory_order_relaxed);
+      std::cerr<<"ThreadPool: task threw an unknown exception"<<std::endl;
+    }
+  }
+
+  void WorkerLoop(std::size_t self){
+    Current().pool=this;
+    Current().index=self;
+    m_placement.Pin(self);
+    Task task;
+    while (true){
+      if (FindTask(self, task)){ Run(task); continue; }
+
+      // Nothing to do: register as a sleeper, look once more, then park.
+      // Submit() checks m_sleepers after queueing, so either the second look
+      // finds its task or Submit() sees us and notifies under m_sleep_mutex.
+      boost::unique_lock<boost::mutex> lock(m_sleep_mutex);
+      m_sleepers.fetch_add(1, boost::memory_order_seq_cst);
+      boost::atomic_thread_fence(boost::memory_order_seq_cst);
+      const bool found=FindTask(self, task, true);
+      if (!found){
+        if (m_stop.load() && m_pending.load()==0){ m_sleepers.fetch_sub(1); return; }
+        m_wake.wait(lock);
+      }
+      m_sleepers.fetch_sub(1, boost::memory_order_relaxed);
+      lock.unlock();
+      if (found) Run(task);
+    }
+  }
+
+  void WakeOne(){
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    if (m_sleepers.load(boost::memory_order_relaxed)==0) return;
+    boost::unique_lock<boost::mutex> lock(m_sleep_mutex);
+    m_wake.notify_one();
+  }
+
+public:
+  // 0 threads means one per hardware thread
+  explicit ThreadPool(std::size_t threads=0, const ThreadPlacement& placement=ThreadPlacement::FromEnvironment()):
+    m_placement(placement), m_stop(false), m_next(0), m_pending(0), m_failed(0), m_sleepers(0){
+    if (threads==0) threads=boost::thread::hardware_concurrency();
+    if (threads==0) threads=1;
+    for (std::size_t i=0; i<threads; ++i) m_workers.push_back(new Worker);
+    for (std::size_t i=0; i<threads; ++i) m_threads.create_thread(boost::bind(&ThreadPool::WorkerLoop, this, i));
+  }
+
+  // Finishes every submitted task, then joins the workers
+  ~ThreadPool(){
+    Shutdown();
+  }
+
+  // Run task on the pool. From a worker it goes to that worker's own deque,
+  // otherwise to the next worker round robin. Producer/Consumer style functors
+  // can be submitted directly. Tasks should handle their own exceptions, one
+  // that escapes is only logged and counted in Failed().
+  template <typename F>
+  void Submit(F task){
+    m_pending.fetch_add(1, boost::memory_order_relaxed);
+    std::size_t target=Self();
+    if (target==m_workers.size()) target=m_next.fetch_add(1, boost::memory_order_relaxed)%m_workers.size();
+    {
+      Worker& w=m_workers[target];
+      boost::unique_lock<boost::mutex> lock(w.mutex);
+      w.tasks.push_back(Task(task));
+    }
+    WakeOne();
+  }
+
+  // Run one pending task on the calling thread, returns false if none was found.
+  // Lets a worker help instead of blocking while it waits for other tasks.
+  bool RunPendingTask(){
+    Task task;
+    if (!FindTask(Self(), task)) return false;
+    Run(task);
+    return true;
+  }
+
+  // Block until every submitted task has finished
+  void Wait(){
+    boost::unique_lock<boost::mutex> lock(m_sleep_mutex);
+    while (m_pending.load()!=0) m_idle.wait(lock);
+  }
+
+  // Finish every submitted task and join the workers
+  void Shutdown(){
+    if (m_stop.exchange(true)) return;
+    {
+      boost::unique_lock<boost::mutex> lock(m_sleep_mutex);
+      m_wake.notify_all();
+    }
+    m_threads.join_all();
+  }
+
+  std::size_t Size() const { return m_workers.size(); }
+
+  // Tasks that threw since the pool started
+  std::size_t Failed() const { return m_failed.load(boost::memory_order_relaxed); }
+
+  // Where the workers run, e.g. to allocate a queue on their NUMA node
+  const ThreadPlacement& Placement() const { return m_placement; }
+
+  // Index of the calling pool worker, -1 if not called from this pool
+  int CurrentWorker() const {
+    const std::size_t self=Self();
+    return self==m_workers.size() ? -1 : (int)self;
+  }
+};
+
+#endif // __THREAD_POOL__H_
@@ -0,0 +1,328 @@
+#ifndef __TIMER_WHEEL__H_
+#define __TIMER_WHEEL__H_
+
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/bind/bind.hpp>
+#include <algorithm>
+#include <vector>
+#include <time.h>
+
+#include "ThreadPool.h"
+
+// Timer service for many one-shot and periodic timers on one thread.
+// Timers live in a hierarchical timing wheel: LEVELS wheels of SLOTS lists,
+// each level SLOTS times coarser than the one below. A timer goes in the
+// finest level whose range covers it and moves down a level each time the
+// wheel below completes a turn, so Schedule() and Cancel() are O(1) and a
+// tick only touches the timers due in it, however many are registered.
+// Due callbacks are submitted to a ThreadPool (or run on the timer thread
+// without one), so a slow callback never delays other timers.
+//
+//   TimerWheel timers(&pool);
+//   TimerWheel::TimerId id=timers.SchedulePeriodic(boost::posix_time::seconds(1), Publish);
+//   timers.Cancel(id);
+class TimerWheel{
+public:
+  typedef boost::function<void()> Callback;
+  typedef boost::uint64_t TimerId; // 0 is never a valid id
+
+  // What a periodic timer does when a run is due while the previous one is
+  // still going, e.g. in the pool behind a backlog
+  enum Overrun{
+    RunAll,          // Submit every run on time, runs may overlap
+    SkipWhileRunning // Drop the run, the next one is a period later
+  };
+
+private:
+  static const int SLOT_BITS = 8;
+  static const std::size_t SLOTS = 1<<SLOT_BITS;
+  static const int LEVELS = 6; // 2^48 ticks, centuries at 1 ms
+  static const boost::uint32_t NIL = 0xffffffffu;
+
+  struct Node{
+    boost::uint32_t prev, next; // In the slot list, or next free node
+    boost::uint32_t list;       // level*SLOTS+slot, NIL when not scheduled
+    boost::uint32_t generation; // Bumped on free so stale ids don't match
+    boost::uint64_t expires;    // Tick
+    boost::uint64_t period;     // Ticks, 0 for one-shot
+    Callback callback;
+    boost::shared_ptr<boost::atomic<bool> > running; // SkipWhileRunning: a run is in flight
+  };
+
+  // Clears the in-flight flag however the callback ends
+  struct RunningGuard{
+    boost::atomic<bool>& running;
+    explicit RunningGuard(boost::atomic<bool>& flag): running(flag){}
+    ~RunningGuard(){ running.store(false, boost::memory_order_release); }
+  };
+
+  static void RunExclusive(const Callback& callback, const boost::shared_ptr<boost::atomic<bool> >& running){
+    RunningGuard guard(*running);
+    callback();
+  }
+
+  ThreadPool* m_pool;
+  const boost::uint64_t m_tick_us;
+  const boost::uint64_t m_start_us;
+
+  boost::mutex m_mutex;
+  boost::condition_variable m_wake;
+  std::vector<Node> m_nodes;
+  boost::uint32_t m_free; // Free list of nodes
+  boost::uint32_t m_heads[LEVELS*SLOTS];
+  boost::uint64_t m_current; // Next tick to process
+  boost::uint64_t m_sleep_until; // Tick the timer thread sleeps until
+  std::size_t m_size;
+  boost::uint64_t m_skipped; // Periodic runs dropped by SkipWhileRunning
+  bool m_stop;
+  std::vector<Callback> m_due; // Collected under the lock, dispatched outside
+  boost::thread m_thread;
+
+  static boost::uint64_t NowUs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (boost::uint64_t)ts.tv_sec*1000000u + ts.tv_nsec/1000;
+  }
+
+  boost::uint64_t NowTick() const {
+    return (NowUs()-m_start_us)/m_tick_us;
+  }
+
+  static boost::uint64_t Micros(const boost::posix_time::time_duration& delay){
+    return (boost::uint64_t)std::max<boost::int64_t>(0, delay.total_microseconds());
+  }
+
+  static TimerId MakeId(boost::uint32_t index, boost::uint32_t generation){
+    return ((TimerId)generation<<32) | (index+1);
+  }
+
+  void Link(boost::uint32_t index){
+    Node& node=m_nodes[index];
+    const boost::uint64_t expires=std::max(node.expires, m_current);
+    // The finest level where expires and m_current agree on all coarser digits
+    int level=0;
+    while (level<LEVELS-1 && (expires>>(SLOT_BITS*(level+1)))!=(m_current>>(SLOT_BITS*(level+1)))) ++level;
+    const boost::uint64_t digit= level==LEVELS-1 && (expires>>(SLOT_BITS*LEVELS))!=(m_current>>(SLOT_BITS*LEVELS))
+      ? (m_current>>(SLOT_BITS*level))-1 // Beyond the wheel: park in the last slot of the top level
+      : expires>>(SLOT_BITS*level);
+    const boost::uint32_t list=(boost::uint32_t)(level*SLOTS+(digit&(SLOTS-1)));
+
+    node.list=list;
+    node.prev=NIL;
+    node.next=m_heads[list];
+    if (node.next!=NIL) m_nodes[node.next].prev=index;
+    m_heads[list]=index;
+  }
+
+  void Unlink(boost::uint32_t index){
+    Node& node=m_nodes[index];
+    if (node.prev!=NIL) m_nodes[node.prev].next=node.next;
+    else m_heads[node.list]=node.next;
+    if (node.next!=NIL) m_nodes[node.next].prev=node.prev;
+    node.list=NIL;
+  }
+
+  void Free(boost::uint32_t index){
+    Node& node=m_nodes[index];
+    node.callback.clear();
+    node.running.reset();
+    ++node.generation;
+    node.next=m_free;
+    m_free=index;
+    --m_size;
+  }
+
+  // Move a coarser slot's timers down to the finer levels
+  void Cascade(int level){
+    const boost::uint32_t list=(boost::uint32_t)(level*SLOTS+((m_current>>(SLOT_BITS*level))&(SLOTS-1)));
+    boost::uint32_t index=m_heads[list];
+    m_heads[list]=NIL;
+    while (index!=NIL){
+      const boost::uint32_t next=m_nodes[index].next;
+      Link(index);
+      index=next;
+    }
+  }
+
+  // Process tick m_current, collecting due callbacks in m_due
+  void Advance(){
+    // Cascade from the coarsest level that turned over, so timers can drop several levels
+    int top=0;
+    while (top+1<LEVELS && (m_current&(((boost::uint64_t)1<<(SLOT_BITS*(top+1)))-1))==0) ++top;
+    for (int level=top; level>=1; --level) Cascade(level);
+
+    const boost::uint32_t list=(boost::uint32_t)(m_current&(SLOTS-1));
+    boost::uint32_t index=m_heads[list];
+    m_heads[list]=NIL;
+    boost::uint32_t periodic=NIL; // Fired periodic timers, relinked once this tick is done
+    while (index!=NIL){
+      Node& node=m_nodes[index];
+      const boost::uint32_t next=node.next;
+      if (node.period){
+        if (!node.running) m_due.push_back(node.callback);
+        else if (node.running->exchange(true, boost::memory_order_acq_rel)) ++m_skipped;
+        else m_due.push_back(boost::bind(&TimerWheel::RunExclusive, node.callback, node.running));
+        node.expires+=node.period; // From the due time, so periods don't drift
+        node.next=periodic;
+        periodic=index;
+      } else {
+        node.list=NIL;
+        m_due.push_back(Callback());
+        m_due.back().swap(node.callback);
+        Free(index);
+      }
+      index=next;
+    }
+
+    ++m_current;
+    while (periodic!=NIL){
+      const boost::uint32_t next=m_nodes[periodic].next;
+      Link(periodic);
+      periodic=next;
+    }
+  }
+
+  // First tick from m_current on that has work: a due timer or a cascade
+  boost::uint64_t NextEvent() const {
+    if ((m_current&(SLOTS-1))==0) return m_current; // Cascade not done yet
+    const boost::uint64_t block_end=(m_current|(SLOTS-1))+1;
+    for (boost::uint64_t tick=m_current; tick<block_end; ++tick)
+      if (m_heads[tick&(SLOTS-1)]!=NIL) return tick;
+    return block_end;
+  }
+
+  void Dispatch(std::vector<Callback>& due){
+    for (std::size_t i=0; i<due.size(); ++i){
+      if (m_pool) m_pool->Submit(due[i]);
+      else due[i]();
+    }
+    due.clear();
+  }
+
+  void Run(){
+    std::vector<Callback> due;
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (!m_stop){
+      const boost::uint64_t now=NowTick();
+      while (m_current<=now && m_size) Advance();
+      if (!m_size) m_current=std::max(m_current, now+1); // Empty, nothing to keep in step
+
+      if (!m_due.empty()){
+        due.swap(m_due);
+        lock.unlock();
+        Dispatch(due);
+        lock.lock();
+        continue;
+      }
+
+      if (!m_size){
+        m_sleep_until=~(boost::uint64_t)0;
+        m_wake.wait(lock);
+      } else {
+        m_sleep_until=NextEvent();
+        const boost::uint64_t wake_us=m_start_us+m_sleep_until*m_tick_us;
+        const boost::uint64_t now_us=NowUs();
+        if (wake_us>now_us) m_wake.timed_wait(lock, boost::posix_time::microseconds(wake_us-now_us));
+      }
+    }
+  }
+
+  // Times in microseconds. Expiry rounds up to a tick, so a timer never fires early.
+  TimerId Add(boost::uint64_t delay_us, boost::uint64_t period_us, const Callback& callback, Overrun overrun=RunAll){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    if (m_free==NIL){
+      m_nodes.push_back(Node());
+      m_nodes.back().generation=0;
+      m_free=(boost::uint32_t)(m_nodes.size()-1);
+      m_nodes.back().next=NIL;
+    }
+    const boost::uint32_t index=m_free;
+    Node& node=m_nodes[index];
+    m_free=node.next;
+
+    const boost::uint64_t now_us=NowUs()-m_start_us;
+    if (!m_size) m_current=std::max(m_current, now_us/m_tick_us); // Catch up an idle wheel
+    node.expires=(now_us+delay_us+m_tick_us-1)/m_tick_us;
+    node.period= period_us ? std::max<boost::uint64_t>(1, (period_us+m_tick_us/2)/m_tick_us) : 0;
+    node.callback=callback;
+    if (overrun==SkipWhileRunning) node.running=boost::make_shared<boost::atomic<bool> >(false);
+    Link(index);
+    ++m_size;
+
+    if (node.expires<m_sleep_until) m_wake.notify_one();
+    return MakeId(index, node.generation);
+  }
+
+public:
+  // Callbacks go to pool, or run on the timer thread if pool is 0.
+  // Timers are kept to the precision of tick.
+  explicit TimerWheel(ThreadPool* pool=0, const boost::posix_time::time_duration& tick=boost::posix_time::milliseconds(1)):
+    m_pool(pool), m_tick_us(std::max<boost::int64_t>(1, tick.total_microseconds())), m_start_us(NowUs()),
+    m_free(NIL), m_current(0), m_sleep_until(~(boost::uint64_t)0), m_size(0), m_skipped(0), m_stop(false){
+    std::fill(m_heads, m_heads+LEVELS*SLOTS, (boost::uint32_t)NIL); // By value, NIL has no definition
+    m_thread=boost::thread(&TimerWheel::Run, this);
+  }
+
+  ~TimerWheel(){
+    Stop();
+  }
+
+  // Run callback once after delay
+  TimerId Schedule(const boost::posix_time::time_duration& delay, const Callback& callback){
+    return Add(Micros(delay), 0, callback);
+  }
+
+  // Run callback every period, first after first_delay (one period if not given).
+  // With RunAll runs are submitted on time even if the previous one is still
+  // running; callbacks that must not overlap take SkipWhileRunning.
+  TimerId SchedulePeriodic(const boost::posix_time::time_duration& period, const Callback& callback,
+                           const boost::posix_time::time_duration& first_delay=boost::posix_time::not_a_date_time,
+                           Overrun overrun=RunAll){
+    const boost::uint64_t period_us=std::max<boost::uint64_t>(1, Micros(period));
+    return Add(first_delay.is_special() ? period_us : Micros(first_delay), period_us, callback, overrun);
+  }
+
+  // Returns false if the timer already fired (one-shot) or was cancelled.
+  // A callback already handed to the pool still runs.
+  bool Cancel(TimerId id){
+    const boost::uint32_t index=(boost::uint32_t)(id&0xffffffffu)-1;
+    const boost::uint32_t generation=(boost::uint32_t)(id>>32);
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    if (index>=m_nodes.size()) return false;
+    Node& node=m_nodes[index];
+    if (node.generation!=generation || node.list==NIL) return false;
+    Unlink(index);
+    Free(index);
+    return true;
+  }
+
+  // Timers scheduled and not yet fired or cancelled
+  std::size_t Size(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_size;
+  }
+
+  // Periodic runs dropped because the previous run was still going
+  boost::uint64_t Skipped(){
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_skipped;
+  }
+
+  // Stop the timer thread, pending timers never fire
+  void Stop(){
+    {
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      if (m_stop) return;
+      m_stop=true;
+      m_wake.notify_one();
+    }
+    m_thread.join();
+  }
+};
+
+#endif // __TIMER_WHEEL__H_
@@ -0,0 +1,59 @@
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <iostream>
+#include <stdlib.h>
+
+#include "ThreadPool.h"
+#include "TimerWheel.h"
+#include "PeriodicPublisher.h"
+
+using namespace std;
+
+// Thousands of periodic publishers driven by one timer thread and a small
+// pool, instead of a thread (or two) per publisher.
+//
+//   TimerWheel_Publishers [PUBLISHERS] [SECONDS]
+
+boost::atomic<long> published(0);
+
+void Publish(const int &)
+{
+  ++published;
+}
+
+int main(int argc, char* argv[])
+{
+  const int publishers = argc > 1 ? boost::lexical_cast<int>(argv[1]) : 10000;
+  const int seconds = argc > 2 ? boost::lexical_cast<int>(argv[2]) : 3;
+
+  ThreadPool pool;
+  TimerWheel timers(&pool);
+
+  //Each publisher is ticked every 100 ms, the first ticks spread over one period.
+  //Tick() must not overlap itself, so a tick still queued or running skips the next.
+  boost::ptr_vector<PeriodicPublisher<int> > feeds;
+  for(int i=0;i<publishers;i++){
+    feeds.push_back(new PeriodicPublisher<int>(Publish, boost::posix_time::seconds(0)));
+    timers.SchedulePeriodic(boost::posix_time::millisec(100),
+                            boost::bind(&PeriodicPublisher<int>::Tick, &feeds.back()),
+                            boost::posix_time::microseconds(rand() % 100000),
+                            TimerWheel::SkipWhileRunning);
+  }
+  cout << publishers << " publishers, " << timers.Size() << " timers on " << pool.Size() << " workers" << endl;
+
+  //One producer updating random feeds as fast as it can
+  const boost::system_time end = boost::get_system_time() + boost::posix_time::seconds(seconds);
+  long updates = 0;
+  while(boost::get_system_time() < end){
+    for(int i=0;i<1000;i++,updates++) feeds[rand() % publishers].Update(i);
+  }
+
+  timers.Stop();
+  pool.Wait();
+  cout << "Updates: " << updates << ", publishes: " << published
+       << " (at most " << (long)publishers*seconds*10 << " by cadence), ticks skipped: " << timers.Skipped() << endl;
+  return 0;
+}
@@ -2,52 +2,39 @@
 #include <iostream>
 #include <stdlib.h>
 
+#include "PeriodicPublisher.h"
+
 using namespace std;
 
-boost::mutex m;
-boost::condition_variable con_publisher;
-int counter(0);
-volatile bool done = false;
 //Publish for every 1000 ms, prevent producer producing too fast
-//However when producer produces kind of slow, wait for it to finish
-void Publisher()
+//However when producer produces kind of slow, publish as soon as it has something
+void Publish(const int & counter)
 {
-
-  boost::this_thread::sleep(boost::posix_time::millisec(1000));
-  cout <<"Waited: [1000] ms"<< endl;
-  if(!done){//if done, just skip this lock and no waiting
-    boost::mutex::scoped_lock lock(m);
-    con_publisher.wait(lock);
-  }
   cout <<"Publish production: ["<<counter<<"]"<< endl;
-  done = false;
 }
 
-void Producer()
+void Producer(PeriodicPublisher<int> & publisher)
 {
-  for(int i=0;i<10;i++){
-    ++counter;
+  for(int counter=1;counter<=30;counter++){
     cout <<"Producing: ["<<counter<<"]"<< endl;
-    boost::this_thread::sleep(boost::posix_time::millisec(rand() % 100 + 300));//may have deadlock when Producer product too quick
+    publisher.Update(counter);//never waits for the publisher
+    //fast at first, then slower than the publishing interval
+    const int delay = counter<20 ? rand() % 100 + 300 : rand() % 500 + 1200;
+    boost::this_thread::sleep(boost::posix_time::millisec(delay));
   }
-  done = true;
-  con_publisher.notify_one();
 }
 
 int main()
 {
+  //Publishes the latest counter every 1000 ms, or early after 5 updates
+  PeriodicPublisher<int> publisher(Publish, boost::posix_time::millisec(1000), 5);
 
-  for(int i=0;i<10;i++){
-    boost::thread publisher_pthread(Publisher);
-    boost::thread producer_pthread(Producer);
-    
-    // Function with Arguments
-    //void workerFunc(const char* msg, unsigned delaySecs) //...
-    //boost::thread workerThread(workerFunc, "Hello, boost!", 3);
-    
-    publisher_pthread.join();
-    producer_pthread.join();
-  }
+  boost::thread producer_pthread(Producer, boost::ref(publisher));
+  producer_pthread.join();
+  publisher.Stop();
 
+  cout <<"Updates: "<<publisher.Updates()<<", publishes: "<<publisher.Publishes()
+       <<", conflated: "<<publisher.Conflated()<< endl;
+  metrics::Registry::Instance().Dump(cout);
   return 0;
 }
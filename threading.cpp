@@ -1,26 +1,40 @@
-#include "boost/shared_ptr.hpp"
 #include <boost/thread.hpp>
 #include <iostream>
+#include <string>
 
-using namespace boost;
+#include "ThreadPool.h"
+#include "TaskGraph.h"
 
-void task1() {
+int task1() {
   std::cout<<"task1..."<<std::endl;
+  return 1;
 }
 
-void task2() {
+int task2() {
   std::cout<<"task2..."<<std::endl;
+  return 2;
 }
 
 int main(){
   std::cout<<"Play with multithreading..."<<std::endl;
 
-  thread thread_1 = thread(task1);
-  thread thread_2 = thread(task2);
+  ThreadPool pool;
+  TaskGraph graph(pool);
+
+  // task1 and task2 run in parallel on the pool, task3 as soon as both are done
+  Future<int> result_1 = graph.Add(task1);
+  Future<int> result_2 = graph.Add(task2);
+  Future<int> result_3 = graph.Add([=]{
+      std::cout<<"task3..."<<std::endl;
+      return result_1.Get() + result_2.Get();
+    }, result_1, result_2);
+
+  // Continuations run on the pool when their input is ready
+  Future<std::string> report = result_3.Then([](int sum){ return "sum is " + std::to_string(sum); });
+  Future<void> printed = report.Then([](const std::string& text){ std::cout<<text<<std::endl; });
 
   // do other stuff
-  thread_2.join();
-  thread_1.join();
+  printed.Get();
+  graph.Wait();
   return 0;
 }
-